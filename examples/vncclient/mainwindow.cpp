@@ -43,6 +43,9 @@ MainWindow::Private::Private(::MainWindow *parent)
     // Set up the VNC client
     stackedWidget->setCurrentIndex(0);
     vncClient.setSocket(&socket);
+    vncClient.setLocalCursor(true);
+    // Keep the screen while the reconnection logic below does its work
+    vncClient.setSessionResume(true);
     
     // Important: Replace QVncClient from UI with QVncWidget
     // Cast vnc widget reference from UI to our VncWidget type
@@ -3,10 +3,14 @@
 
 #include "vncwidget.h"
 
+#include <QtCore/QPointer>
+#include <QtCore/QtMath>
+#include <QtGui/QCursor>
 #include <QtGui/QPainter>
 #include <QtGui/QPaintEvent>
 #include <QtGui/QKeyEvent>
 #include <QtGui/QMouseEvent>
+#include <QtGui/QRegion>
 
 class VncWidget::Private
 {
@@ -14,12 +18,21 @@ public:
     Private(VncWidget *parent);
     
     void paint(const QRect &rect);
+    void updateSize();
+    void updateRegionOfInterest();
+    void watchAncestors();
+    void forwardPointerEvent(QMouseEvent *e);
+    void updateCursor();
+    void moveCursor(const QPoint &position);
+    QRect toWidget(const QRect &rect) const;
     
 private:
     VncWidget *q;
     
 public:
     QVncClient *client = nullptr;
+    qreal scale = 1.0;
+    QList<QPointer<QWidget>> ancestors;
 };
 
 VncWidget::Private::Private(VncWidget *parent)
@@ -28,16 +41,118 @@ VncWidget::Private::Private(VncWidget *parent)
     q->setMouseTracking(true);
 }
 
+QRect VncWidget::Private::toWidget(const QRect &rect) const
+{
+    if (qFuzzyCompare(scale, 1.0))
+        return rect;
+    return QRectF(rect.x() * scale, rect.y() * scale, rect.width() * scale, rect.height() * scale).toAlignedRect();
+}
+
+void VncWidget::Private::updateSize()
+{
+    if (!client || client->framebufferWidth() <= 0 || client->framebufferHeight() <= 0)
+        return;
+    q->setFixedSize(qCeil(client->framebufferWidth() * scale), qCeil(client->framebufferHeight() * scale));
+    q->update();
+}
+
+// Follows the part of the widget that is actually on screen, e.g. the
+// viewport of an enclosing QScrollArea, and requests updates only for it.
+void VncWidget::Private::updateRegionOfInterest()
+{
+    if (!client)
+        return;
+
+    // A rectangle outside the framebuffer pauses updates while nothing is visible
+    const QRect offscreen(-1, -1, 1, 1);
+    const QRect visible = q->isVisible() ? q->visibleRegion().boundingRect() : QRect();
+    QRect roi;
+    if (visible.isEmpty()) {
+        roi = offscreen;
+    } else if (visible != q->rect()) {
+        roi = QRectF(visible.x() / scale, visible.y() / scale, visible.width() / scale, visible.height() / scale).toAlignedRect();
+    }
+    client->setRegionOfInterest(roi);
+}
+
+// Scrolling moves the widget inside the viewport and resizing a window
+// changes the viewport, so watch every ancestor for both.
+void VncWidget::Private::watchAncestors()
+{
+    for (const auto &ancestor : std::as_const(ancestors)) {
+        if (ancestor)
+            ancestor->removeEventFilter(q);
+    }
+    ancestors.clear();
+    for (QWidget *w = q->parentWidget(); w; w = w->parentWidget()) {
+        w->installEventFilter(q);
+        ancestors.append(w);
+    }
+}
+
+// With a local cursor the window system draws the remote shape at the
+// mouse position, so the pointer never lags behind by a round trip.
+void VncWidget::Private::updateCursor()
+{
+    if (!client || !client->localCursor()) {
+        q->unsetCursor();
+        return;
+    }
+    const QImage shape = client->cursorShape();
+    if (shape.isNull()) {
+        q->setCursor(Qt::BlankCursor);
+        return;
+    }
+    if (qFuzzyCompare(scale, 1.0)) {
+        q->setCursor(QCursor(QPixmap::fromImage(shape), client->cursorHotSpot().x(), client->cursorHotSpot().y()));
+        return;
+    }
+    const QSize size = (QSizeF(shape.size()) * scale).toSize().expandedTo(QSize(1, 1));
+    const QPoint hotSpot = (QPointF(client->cursorHotSpot()) * scale).toPoint();
+    q->setCursor(QCursor(QPixmap::fromImage(shape.scaled(size, Qt::IgnoreAspectRatio, Qt::SmoothTransformation)), hotSpot.x(), hotSpot.y()));
+}
+
+// The server moved the pointer by itself, follow it while the mouse is here
+void VncWidget::Private::moveCursor(const QPoint &position)
+{
+    if (!client || !client->localCursor() || !q->underMouse())
+        return;
+    QCursor::setPos(q->mapToGlobal((QPointF(position) * scale).toPoint()));
+}
+
+void VncWidget::Private::forwardPointerEvent(QMouseEvent *e)
+{
+    if (!client)
+        return;
+    if (qFuzzyCompare(scale, 1.0)) {
+        client->handlePointerEvent(e);
+        return;
+    }
+    QMouseEvent mapped(e->type(), e->position() / scale, e->globalPosition(), e->button(), e->buttons(), e->modifiers(), e->pointingDevice());
+    client->handlePointerEvent(&mapped);
+}
+
 void VncWidget::Private::paint(const QRect &rect)
 {
     QPainter p(q);
-    if (!client || !client->socket() || client->socket()->state() != QTcpSocket::ConnectedState) {
+    if (!client || (!client->isConnected() && !client->isFramebufferStale())) {
         p.setOpacity(0.5);
         p.fillRect(rect, Qt::lightGray);
         return;
     }
     
-    p.drawImage(rect, client->image(), rect);
+    if (qFuzzyCompare(scale, 1.0)) {
+        p.drawImage(rect, client->constImage(), rect);
+    } else {
+        p.setRenderHint(QPainter::SmoothPixmapTransform);
+        const QRectF source(rect.x() / scale, rect.y() / scale, rect.width() / scale, rect.height() / scale);
+        p.drawImage(QRectF(rect), client->constImage(), source);
+    }
+    // The last frame of a lost connection, greyed out until it is resumed
+    if (client->isFramebufferStale()) {
+        p.setOpacity(0.5);
+        p.fillRect(rect, Qt::lightGray);
+    }
 }
 
 VncWidget::VncWidget(QWidget *parent)
@@ -66,14 +181,39 @@ void VncWidget::setClient(QVncClient *client)
     
     if (client) {
         connect(client, &QVncClient::framebufferSizeChanged, this, [this](int width, int height) {
-            setFixedSize(width, height);
-            update();
+            Q_UNUSED(width);
+            Q_UNUSED(height);
+            d->updateSize();
+            d->updateRegionOfInterest();
         });
         
-        connect(client, &QVncClient::imageChanged, this, [this](const QRect &rect) {
-            update(rect);
+        connect(client, &QVncClient::framebufferUpdated, this, [this](const QRegion &region) {
+            if (qFuzzyCompare(d->scale, 1.0)) {
+                update(region);
+                return;
+            }
+            QRegion scaled;
+            for (const QRect &rect : region)
+                scaled += d->toWidget(rect);
+            update(scaled);
         });
         
+        connect(client, &QVncClient::localCursorChanged, this, [this]() {
+            d->updateCursor();
+        });
+
+        connect(client, &QVncClient::cursorShapeChanged, this, [this]() {
+            d->updateCursor();
+        });
+
+        connect(client, &QVncClient::cursorPositionChanged, this, [this](const QPoint &position) {
+            d->moveCursor(position);
+        });
+
+        connect(client, &QVncClient::framebufferStaleChanged, this, [this]() {
+            update();
+        });
+
         connect(client, &QVncClient::connectionStateChanged, this, [this](bool connected) {
             repaint();
             if (connected)
@@ -81,9 +221,72 @@ void VncWidget::setClient(QVncClient *client)
         });
     }
     
+    d->watchAncestors();
+    d->updateRegionOfInterest();
+    d->updateCursor();
     emit clientChanged(client);
 }
 
+qreal VncWidget::scale() const
+{
+    return d->scale;
+}
+
+void VncWidget::setScale(qreal scale)
+{
+    if (scale <= 0 || qFuzzyCompare(d->scale, scale))
+        return;
+    d->scale = scale;
+    d->updateSize();
+    d->updateRegionOfInterest();
+    d->updateCursor();
+    emit scaleChanged(scale);
+}
+
+bool VncWidget::eventFilter(QObject *watched, QEvent *event)
+{
+    switch (event->type()) {
+    case QEvent::Move:
+    case QEvent::Resize:
+    case QEvent::Show:
+    case QEvent::Hide:
+        d->updateRegionOfInterest();
+        break;
+    case QEvent::ParentChange:
+        d->watchAncestors();
+        d->updateRegionOfInterest();
+        break;
+    default:
+        break;
+    }
+    return QWidget::eventFilter(watched, event);
+}
+
+void VncWidget::moveEvent(QMoveEvent *e)
+{
+    QWidget::moveEvent(e);
+    d->updateRegionOfInterest();
+}
+
+void VncWidget::resizeEvent(QResizeEvent *e)
+{
+    QWidget::resizeEvent(e);
+    d->updateRegionOfInterest();
+}
+
+void VncWidget::showEvent(QShowEvent *e)
+{
+    QWidget::showEvent(e);
+    d->watchAncestors();
+    d->updateRegionOfInterest();
+}
+
+void VncWidget::hideEvent(QHideEvent *e)
+{
+    QWidget::hideEvent(e);
+    d->updateRegionOfInterest();
+}
+
 void VncWidget::keyPressEvent(QKeyEvent *e)
 {
     if (d->client) {
@@ -100,23 +303,17 @@ void VncWidget::keyReleaseEvent(QKeyEvent *e)
 
 void VncWidget::mousePressEvent(QMouseEvent *e)
 {
-    if (d->client) {
-        d->client->handlePointerEvent(e);
-    }
+    d->forwardPointerEvent(e);
 }
 
 void VncWidget::mouseMoveEvent(QMouseEvent *e)
 {
-    if (d->client) {
-        d->client->handlePointerEvent(e);
-    }
+    d->forwardPointerEvent(e);
 }
 
 void VncWidget::mouseReleaseEvent(QMouseEvent *e)
 {
-    if (d->client) {
-        d->client->handlePointerEvent(e);
-    }
+    d->forwardPointerEvent(e);
 }
 
 void VncWidget::paintEvent(QPaintEvent *e)
@@ -10,11 +10,16 @@
 class QKeyEvent;
 class QMouseEvent;
 class QPaintEvent;
+class QMoveEvent;
+class QResizeEvent;
+class QShowEvent;
+class QHideEvent;
 
 class VncWidget : public QWidget
 {
     Q_OBJECT
     Q_PROPERTY(QVncClient *client READ client WRITE setClient NOTIFY clientChanged)
+    Q_PROPERTY(qreal scale READ scale WRITE setScale NOTIFY scaleChanged)
 
 public:
     explicit VncWidget(QWidget *parent = nullptr);
@@ -23,10 +28,19 @@ public:
     QVncClient *client() const;
     void setClient(QVncClient *client);
 
+    qreal scale() const;
+    void setScale(qreal scale);
+
 signals:
     void clientChanged(QVncClient *client);
+    void scaleChanged(qreal scale);
 
 protected:
+    bool eventFilter(QObject *watched, QEvent *event) override;
+    void moveEvent(QMoveEvent *e) override;
+    void resizeEvent(QResizeEvent *e) override;
+    void showEvent(QShowEvent *e) override;
+    void hideEvent(QHideEvent *e) override;
     void keyPressEvent(QKeyEvent *e) override;
     void keyReleaseEvent(QKeyEvent *e) override;
     void mousePressEvent(QMouseEvent *e) override;
@@ -8,7 +8,7 @@
 // This file implements the QVncClient class, which provides a VNC client implementation.
 // 
 // Class Overview:
-// - QVncClient connects to VNC servers using a provided QTcpSocket
+// - QVncClient connects to VNC servers using a provided QTcpSocket or other QIODevice
 // - Handles protocol handshaking, authentication, and framebuffer updates
 // - Provides an interface for sending input events to the VNC server
 // - Emits signals when framebuffer is updated or connection state changes
@@ -21,7 +21,7 @@
 //
 // Main Classes and Functions:
 // - QVncClient: Main public API for client applications
-//   - setSocket(): Sets the socket for VNC communication
+//   - setSocket(), setDevice(): Set the transport for VNC communication
 //   - image(): Gets the current framebuffer image
 //   - handleKeyEvent(): Forwards keyboard events to the server
 //   - handlePointerEvent(): Forwards mouse events to the server
@@ -33,20 +33,237 @@
 // For Qt Help integration, build with: qdoc src/vncclient/vncclient.qdocconf
 //
 #include "qvncclient.h"
+#include "qvncdecodescheduler_p.h"
 
 #include <QtCore/QDebug>
 #include <QtCore/QtEndian>
 #include <QtGui/QKeyEvent>
 #include <QtGui/QMouseEvent>
 #include <QtCore/QByteArray>
+#include <QtCore/QCryptographicHash>
+#include <QtCore/QRandomGenerator>
+#include <QtCore/QUrl>
 #include <QtCore/QVector>
+#include <QtCore/QHash>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QMutex>
+#include <QtCore/QProcess>
+#include <QtCore/QTimer>
+#include <QtCore/QVarLengthArray>
 #include <QtGui/QPainter>
+#include <QtGui/QRegion>
+#include <QtNetwork/QLocalSocket>
+#if QT_CONFIG(ssl)
+#include <QtCore/QDeadlineTimer>
+#include <QtNetwork/QSslConfiguration>
+#include <QtNetwork/QSslSocket>
+#endif
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <utility>
 
 // Include for Tight encoding
 #ifdef USE_ZLIB
 #include <zlib.h>
 #endif
 
+// Native socket transport
+#ifdef USE_EPOLL
+#include "qvncepolltransport_p.h"
+#include <QtCore/QSocketNotifier>
+#include <QtNetwork/QHostAddress>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#ifdef USE_IO_URING
+#include "qvncuringtransport_p.h"
+#endif
+
+namespace {
+// Qt keys from Key_Escape on that have an X11 keysym
+struct KeyMapping
+{
+    int key;
+    quint32 keysym;
+};
+
+constexpr KeyMapping specialKeys[] = {
+    { Qt::Key_Escape, 0xff1b },
+    { Qt::Key_Tab, 0xff09 },
+    { Qt::Key_Backtab, 0xfe20 },
+    { Qt::Key_Backspace, 0xff08 },
+    { Qt::Key_Return, 0xff0d },
+    { Qt::Key_Enter, 0xff8d },
+    { Qt::Key_Insert, 0xff63 },
+    { Qt::Key_Delete, 0xffff },
+    { Qt::Key_Pause, 0xff13 },
+    { Qt::Key_Print, 0xff61 },
+    { Qt::Key_SysReq, 0xff15 },
+    { Qt::Key_Clear, 0xff0b },
+    { Qt::Key_Home, 0xff50 },
+    { Qt::Key_End, 0xff57 },
+    { Qt::Key_Left, 0xff51 },
+    { Qt::Key_Up, 0xff52 },
+    { Qt::Key_Right, 0xff53 },
+    { Qt::Key_Down, 0xff54 },
+    { Qt::Key_PageUp, 0xff55 },
+    { Qt::Key_PageDown, 0xff56 },
+    { Qt::Key_Shift, 0xffe1 },
+    { Qt::Key_Control, 0xffe3 },
+    { Qt::Key_Meta, 0xffe7 },
+    { Qt::Key_Alt, 0xffe9 },
+    { Qt::Key_CapsLock, 0xffe5 },
+    { Qt::Key_NumLock, 0xff7f },
+    { Qt::Key_ScrollLock, 0xff14 },
+    { Qt::Key_Super_L, 0xffeb },
+    { Qt::Key_Super_R, 0xffec },
+    { Qt::Key_Menu, 0xff67 },
+    { Qt::Key_Hyper_L, 0xffed },
+    { Qt::Key_Hyper_R, 0xffee },
+    { Qt::Key_Help, 0xff6a },
+    { Qt::Key_Back, 0x1008ff26 },
+    { Qt::Key_Forward, 0x1008ff27 },
+    { Qt::Key_Stop, 0x1008ff28 },
+    { Qt::Key_Refresh, 0x1008ff29 },
+    { Qt::Key_VolumeDown, 0x1008ff11 },
+    { Qt::Key_VolumeMute, 0x1008ff12 },
+    { Qt::Key_VolumeUp, 0x1008ff13 },
+    { Qt::Key_MediaPlay, 0x1008ff14 },
+    { Qt::Key_MediaStop, 0x1008ff15 },
+    { Qt::Key_MediaPrevious, 0x1008ff16 },
+    { Qt::Key_MediaNext, 0x1008ff17 },
+};
+
+// Indexed by key - Key_Escape, so a lookup is a single load
+constexpr int SpecialKeyCount = 0x100;
+constexpr std::array<quint32, SpecialKeyCount> specialKeyTable = []() {
+    std::array<quint32, SpecialKeyCount> table {};
+    for (const auto &mapping : specialKeys)
+        table[mapping.key - Qt::Key_Escape] = mapping.keysym;
+    // F1 to F35 are consecutive in both
+    for (int i = 0; i <= Qt::Key_F35 - Qt::Key_F1; i++)
+        table[Qt::Key_F1 - Qt::Key_Escape + i] = 0xffbe + i;
+    return table;
+}();
+
+// Keypad keys, told apart by Qt::KeypadModifier
+constexpr KeyMapping keypadKeys[] = {
+    { Qt::Key_Asterisk, 0xffaa },
+    { Qt::Key_Plus, 0xffab },
+    { Qt::Key_Comma, 0xffac },
+    { Qt::Key_Minus, 0xffad },
+    { Qt::Key_Period, 0xffae },
+    { Qt::Key_Slash, 0xffaf },
+    { Qt::Key_Equal, 0xffbd },
+    { Qt::Key_Enter, 0xff8d },
+};
+
+// XT scan codes of the Linux input event codes from 89 on; the ones below
+// are the same in both
+constexpr quint8 evdevExtendedKeycodes[] = {
+    0x73, 0x78, 0x77, 0x79, 0x70, 0x7b, 0x5c, 0x9c, // 89 RO to 96 KPENTER
+    0x9d, 0xb5, 0xb7, 0xb8, 0x00, 0xc7, 0xc8, 0xc9, // 97 RIGHTCTRL to 104 PAGEUP
+    0xcb, 0xcd, 0xcf, 0xd0, 0xd1, 0xd2, 0xd3, 0x00, // 105 LEFT to 112 MACRO
+    0xa0, 0xae, 0xb0, 0xde, 0x59, 0x00, 0xc6, 0x00, // 113 MUTE to 120 SCALE
+    0x7e, 0x00, 0x00, 0x7d, 0xdb, 0xdc, 0xdd,       // 121 KPCOMMA to 127 COMPOSE
+};
+
+// Typed text goes out in chunks of this many characters, one per interval
+// (in ms) when the server cannot pace them with Fence
+constexpr int TypingChunk = 512;
+constexpr int TypingInterval = 10;
+
+// Bytes of typed key events a server answering Fences may have queued, a
+// few round trips' worth of keys without risking its input queue
+constexpr qsizetype TypingWindow = 32 * 1024;
+
+// Payload of the Fences pacing typed text
+constexpr char TypingFence[] = "typing";
+
+// WebSocket frame opcodes (RFC 6455)
+enum WebSocketOpcode : quint8 {
+    WebSocketContinuation = 0x0,
+    WebSocketText = 0x1,
+    WebSocketBinary = 0x2,
+    WebSocketClose = 0x8,
+    WebSocketPing = 0x9,
+    WebSocketPong = 0xa,
+};
+
+// Appended to the key of a WebSocket handshake before it is hashed
+constexpr char WebSocketGuid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+// Size of the largest upgrade response accepted from a WebSocket server
+constexpr qsizetype WebSocketMaxResponse = 16 * 1024;
+
+// Copies size bytes from in to out, XORed with the 4 byte WebSocket
+// masking key starting offset bytes into it, eight bytes at a time
+void applyWebSocketMask(char *out, const char *in, qsizetype size, const uchar *key, quint64 offset)
+{
+    uchar pattern[8];
+    for (int i = 0; i < 8; i++)
+        pattern[i] = key[(offset + i) & 3];
+    quint64 wide;
+    memcpy(&wide, pattern, sizeof(wide));
+    qsizetype i = 0;
+    for (; i + 8 <= size; i += 8) {
+        quint64 value;
+        memcpy(&value, in + i, sizeof(value));
+        value ^= wide;
+        memcpy(out + i, &value, sizeof(value));
+    }
+    for (; i < size; i++)
+        out[i] = char(in[i] ^ pattern[i & 7]);
+}
+
+// JPEG quality of the first refresh of a resumed session
+constexpr int ResumeQualityLevel = 1;
+
+// VeNCrypt subtypes without a password, in order of preference
+enum VeNCryptSubtype : quint32 {
+    VeNCryptX509None = 260,                     // TLS with the server certificate checked
+    VeNCryptTLSNone = 257,                      // Anonymous TLS
+};
+
+#if QT_CONFIG(ssl)
+// A TLS session ticket the server handed out
+struct TlsSession
+{
+    QByteArray ticket;
+    QDeadlineTimer expiry;
+};
+
+// Session tickets of all clients, so that a reconnect to the same server,
+// by any client, resumes the session instead of doing a full handshake
+struct TlsSessionCache
+{
+    QMutex mutex;
+    QHash<QString, TlsSession> sessions;
+};
+
+Q_GLOBAL_STATIC(TlsSessionCache, tlsSessions)
+#endif
+
+#ifdef USE_EPOLL
+// A native socket is read straight into the end of the receive buffer in
+// steps of this many bytes; what does not fit lands in a small buffer on
+// the stack
+constexpr qsizetype NativeReadChunk = 128 * 1024;
+constexpr qsizetype NativeReadOverflow = 16 * 1024;
+
+// Bytes read from a native socket before other connections get a turn
+constexpr qsizetype NativeReadBudget = 1024 * 1024;
+#endif
+}
+
 /*!
     \internal
     \class QVncClient::Private
@@ -71,6 +288,10 @@ public:
         ProtocolVersionState = 0x611, ///< Negotiating the protocol version
         SecurityState = 0x612,        ///< Negotiating security type
         SecurityResultState = 0x613,  ///< Processing security handshake result
+        VeNCryptVersionState = 0x614, ///< Negotiating the VeNCrypt version
+        VeNCryptSubtypeState = 0x615, ///< Choosing a VeNCrypt subtype
+        VeNCryptAckState = 0x616,     ///< Waiting for the server to accept the subtype
+        TlsHandshakeState = 0x617,    ///< Waiting for the TLS handshake to complete
         ClientInitState = 0x631,      ///< Client initialization
         ServerInitState = 0x632,      ///< Server initialization
         WaitingState = 0x640,         ///< Normal operation state, waiting for server messages
@@ -88,6 +309,8 @@ public:
         SetPixelFormat = 0x00,           ///< Set the pixel format for framebuffer data
         SetEncodings = 0x02,             ///< Set the encoding types the client supports
         FramebufferUpdateRequest = 0x03, ///< Request an update of the framebuffer
+        ClientFence = 0xf8,              ///< Fence (synchronisation and round trip measurement)
+        QemuClientMessage = 0xff,        ///< QEMU extension messages such as extended key events
     };
 
     /*!
@@ -100,6 +323,7 @@ public:
     */
     enum ServerMessageType {
         FramebufferUpdate = 0x00, ///< Server sends framebuffer update data
+        ServerFence = 0xf8,       ///< Fence request or reply
     };
 
     /*!
@@ -119,6 +343,17 @@ public:
 #ifdef USE_ZLIB
         Tight = 7,       ///< Tight encoding (with zlib compression and JPEG)
 #endif
+        QualityLevel0 = -32,      ///< Pseudo-encoding: JPEG quality level 0 (lowest)
+        QualityLevel9 = -23,      ///< Pseudo-encoding: JPEG quality level 9 (highest)
+        CompressionLevel0 = -256, ///< Pseudo-encoding: compression level 0 (fastest)
+        CompressionLevel9 = -247, ///< Pseudo-encoding: compression level 9 (smallest)
+        FineQualityLevel0 = -512, ///< Pseudo-encoding: fine-grained JPEG quality 0
+        FineQualityLevel100 = -412, ///< Pseudo-encoding: fine-grained JPEG quality 100
+        JpegSubsampling1X = -768, ///< Pseudo-encoding: chroma subsampling 4:4:4 (-768 to -763)
+        FencePseudoEncoding = -312, ///< Pseudo-encoding: client supports Fence messages
+        CursorPseudoEncoding = -239, ///< Pseudo-encoding: client draws the cursor shape
+        PointerPosPseudoEncoding = -232, ///< Pseudo-encoding: server reports the pointer position
+        QemuExtendedKeyEventPseudoEncoding = -258, ///< Pseudo-encoding: client sends scan codes with key events
     };
     
     /*!
@@ -151,19 +386,19 @@ public:
     /*!
         \internal
         \struct QVncClient::Private::TightData
-        \brief Holds data for Tight encoding processing.
+        \brief Holds data for Tight and ZRLE encoding processing.
         
-        This structure contains zlib streams and related configuration
-        data for handling Tight encoding. ZLIB support is optional.
+        This structure contains the zlib streams that persist across the
+        rectangles of a session: the four Tight streams followed by the ZRLE
+        stream. ZLIB support is optional.
     */
     struct TightData {
-        z_stream zlibStream[4];      ///< Zlib streams for compression channels
-        bool zlibStreamActive[4];    ///< Whether each zlib stream is active
-        int jpegQuality;             ///< JPEG quality level (0-100)
-        int compressionLevel;        ///< Compression level (1-9)
+        static constexpr int ZRLEIndex = 4; ///< Index of the ZRLE stream
+        z_stream zlibStream[5];      ///< Zlib streams for compression channels
+        bool zlibStreamActive[5];    ///< Whether each zlib stream is active
 
-        TightData() : jpegQuality(75), compressionLevel(6) {
-            for (int i = 0; i < 4; i++) {
+        TightData() {
+            for (int i = 0; i < 5; i++) {
                 zlibStreamActive[i] = false;
             }
         }
@@ -173,7 +408,7 @@ public:
         }
         
         void resetZlibStreams() {
-            for (int i = 0; i < 4; i++) {
+            for (int i = 0; i < 5; i++) {
                 if (zlibStreamActive[i]) {
                     inflateEnd(&zlibStream[i]);
                     zlibStreamActive[i] = false;
@@ -181,8 +416,152 @@ public:
             }
         }
     };
+
+    /*!
+        \internal
+        \struct QVncClient::Private::Inflater
+        \brief Inflates the zlib payload of a rectangle into a small window.
+
+        The compressed input is handed over in whatever pieces have arrived,
+        and only as much is inflated as the decoder asks for, so the memory
+        used stays around one tile or row however large the rectangle is.
+    */
+    struct Inflater {
+        z_stream *stream = nullptr;   ///< Persistent stream the payload continues, null for data sent as is
+        const uchar *input = nullptr; ///< Compressed bytes at hand
+        qint64 inputSize = 0;         ///< Number of bytes at input
+        qint64 remaining = 0;         ///< Compressed bytes of the payload not inflated yet
+        QByteArray window;            ///< Inflated bytes
+        qsizetype pos = 0;            ///< Start of the bytes in window not consumed yet
+        bool failed = false;          ///< Whether the payload turned out to be corrupt
+
+        bool need(qsizetype size);
+        bool finish();
+        const uchar *data() const { return reinterpret_cast<const uchar *>(window.constData()) + pos; }
+        void consume(qsizetype size) { pos += size; }
+
+    private:
+        bool inflateSome(qsizetype room);
+    };
+
+    /*!
+        \internal
+        \enum QVncClient::Private::TightFilter
+        \brief Filters applied to Tight basic compression data.
+    */
+    enum TightFilter {
+        TightCopyFilter = 0,     ///< Pixels are sent as they are
+        TightPaletteFilter = 1,  ///< Pixels are indices into a palette
+        TightGradientFilter = 2, ///< Pixels are differences to a prediction
+    };
+
+    /*!
+        \internal
+        \struct QVncClient::Private::ZlibRect
+        \brief Decoding state of a rectangle with zlib compressed pixels.
+    */
+    struct ZlibRect {
+        Inflater in;                  ///< Source of the inflated data
+        int next = 0;                 ///< Next ZRLE tile or Tight row to decode
+        int rowsDone = 0;             ///< Rows of the rectangle that are complete
+        quint8 filter = TightCopyFilter; ///< Tight filter
+        qsizetype rowBytes = 0;       ///< Tight bytes per filtered row
+        QList<QRgb> palette;          ///< Tight palette
+        QList<int> previous;          ///< Tight gradient components of the row above
+    };
 #endif
 
+    /*!
+        \internal
+        \struct QVncClient::Private::EncodingStatistics
+        \brief Measurements that drive adaptive encoding selection.
+        
+        Costs are seeded with typical values and then smoothed with every
+        decoded rectangle of the respective encoding.
+    */
+    struct EncodingStatistics {
+        struct Cost {
+            double nsecsPerPixel = 0; ///< Decode time per pixel
+            double bytesPerPixel = 0; ///< Bytes on the wire per pixel
+        };
+        QHash<qint32, Cost> costs;    ///< Cost per supported encoding
+        int updates = 0;              ///< Updates since the last decision
+        QElapsedTimer lastDecision;   ///< Time of the last decision
+        QList<qint32> order;          ///< Adaptive order of preference
+    };
+
+    /*!
+        \internal
+        \struct QVncClient::Private::BackBuffer
+        \brief A framebuffer the decoders write to in buffered modes.
+    */
+    struct BackBuffer {
+        QImage image;                 ///< Framebuffer contents
+        QRegion stale;                ///< Area published since this buffer was last written
+    };
+
+    /*!
+        \internal
+        \enum QVncClient::Private::ZlibStream
+        \brief Bits identifying the zlib streams shared by rectangles.
+    */
+    enum ZlibStream {
+        TightStreams = 0x0f, ///< Tight streams 0 to 3, one bit each
+        ZRLEStream = 0x10,   ///< The single ZRLE stream
+    };
+
+    /*!
+        \internal
+        \struct QVncClient::Private::DeferredDecode
+        \brief A rectangle of the current update decoded on the decode threads.
+    */
+    struct DeferredDecode {
+        QRect target;                 ///< Area of the framebuffer written
+        QRect source;                 ///< Area of the framebuffer read, e.g. by CopyRect
+        quint8 streams = 0;           ///< ZlibStream bits of the streams used
+        int node = -1;                ///< Node in the decode graph
+        qint32 encoding = 0;          ///< Encoding of the rectangle
+        qint64 bytes = 0;             ///< Size of the rectangle on the wire
+        qint64 readNsecs = 0;         ///< Time spent reading it
+        qint64 nsecs = 0;             ///< Time spent decoding it, written by the decoder
+    };
+
+    /*!
+        \internal
+        \struct QVncClient::Private::LinkStatistics
+        \brief Continuous estimates of throughput and latency of the connection.
+        
+        Times are nanoseconds on \c clock, which starts with the connection.
+        Update round trips are kept in a small window whose minimum stands for
+        an update the server could answer right away.
+    */
+    struct LinkStatistics {
+        QElapsedTimer clock;          ///< Time base for all timestamps
+        double throughput = 0;        ///< Downstream throughput in bytes per second, 0 if unknown
+        double fenceRoundTrip = -1;   ///< Smoothed Fence round trip in ms, -1 if unknown
+        QList<double> updateRoundTrips; ///< Recent request to update times in ms
+        qint64 requestSentAt = -1;    ///< Oldest unanswered FramebufferUpdateRequest
+        bool fenceSupported = false;  ///< Whether the server has sent a Fence
+        quint32 fenceSequence = 0;    ///< Payload of the last Fence we sent
+        qint64 fenceSentAt = -1;      ///< When that Fence was sent, -1 if answered
+        qint64 lastFenceAt = -1;      ///< When the last probe was sent
+        double bandwidth = -1;        ///< Last published bandwidth
+        double roundTripTime = -1;    ///< Last published round trip time
+        double serverLatency = -1;    ///< Last published server latency
+    };
+
+    /*!
+        \internal
+        \enum QVncClient::Private::FenceFlag
+        \brief Flags of the Fence message.
+    */
+    enum FenceFlag : quint32 {
+        FenceBlockBefore = 0x00000001, ///< Process after all previous messages
+        FenceBlockAfter = 0x00000002,  ///< Process later messages only after this one
+        FenceSyncNext = 0x00000004,    ///< Apply the next message atomically
+        FenceRequest = 0x80000000,     ///< The peer must reply with the same payload
+    };
+
     /*!
         \internal
         \struct QVncClient::Private::PixelFormat
@@ -225,1074 +604,4070 @@ public:
 
     /*!
         \internal
-        \brief Handles a keyboard event and sends it to the VNC server.
-        \param e The keyboard event to be processed and sent.
-        
-        Translates Qt key events to VNC protocol key events and sends them to the server.
+        \struct QVncClient::Private::Settings
+        \brief Properties set by the application that affect the protocol.
+
+        The application's copy is changed by the property setters; the
+        protocol thread works on its own copy, which applySettings() replaces.
     */
-    void keyEvent(QKeyEvent *e);
-    
+    struct Settings {
+        int qualityLevel = -1;        ///< JPEG quality level (0-9), -1 for server default
+        int compressionLevel = -1;    ///< Compression level (0-9), -1 for server default
+        int fineQualityLevel = -1;    ///< Fine-grained JPEG quality (1-100), -1 for unset
+        ChromaSubsampling subsampling = SubsamplingDefault; ///< JPEG chroma subsampling
+        bool adaptiveEncoding = false; ///< Whether the encoding order adapts to the link
+        QRect regionOfInterest;       ///< Area updates are requested for, null for all
+        BufferingMode bufferingMode = SingleBuffering; ///< Number of framebuffers
+        bool localCursor = false;     ///< Whether the cursor is drawn by the application
+        bool sessionResume = false;   ///< Whether a reconnect keeps the framebuffer
+    };
+
     /*!
         \internal
-        \brief Handles a mouse event and sends it to the VNC server.
-        \param e The mouse event to be processed and sent.
-        
-        Translates Qt mouse events to VNC protocol pointer events and sends them to the server.
+        \enum QVncClient::Private::ResumePass
+        \brief Passes of the refresh that brings a resumed framebuffer up to date.
     */
-    void pointerEvent(QMouseEvent *e);
+    enum ResumePass {
+        ResumeNone,                   ///< Not resuming, or done
+        ResumeLowQuality,             ///< Refreshing everything in coarse JPEG
+        ResumeLossless,               ///< Refreshing everything without loss
+    };
 
-private:
-    void reset();
+    /*!
+        \internal
+        \brief Waits for the work still queued on the scheduler, if any.
+    */
+    ~Private();
 
     /*!
         \internal
-        \brief Checks if the connection to the server is valid.
-        \return true if the socket is connected, false otherwise.
+        \brief Hands the application's settings to the protocol thread.
     */
-    bool isValid() const {
-        return socket && socket->state() == QTcpSocket::ConnectedState;
-    }
-    
+    void applySettings();
+
     /*!
         \internal
-        \brief Reads and processes data from the socket based on the current state.
-        
-        This is the main state machine dispatcher that directs incoming data to the
-        appropriate parsing function based on the current protocol state.
+        \brief Moves the protocol to or from the shared decode scheduler.
     */
-    void read();
-    
+    void setThreaded(bool threaded);
+
     /*!
         \internal
-        \brief Reads a binary structure from the socket.
-        \param out Pointer to the structure to be filled with data.
-        \tparam T The type of structure to read.
-        
-        Reads binary data from the socket directly into the provided structure.
+        \brief Returns whether the protocol runs on the decode scheduler.
     */
-    template<class T>
-    void read(T *out) {
-        if (isValid())
-            socket->read(reinterpret_cast<char *>(out), sizeof(T));
-    }
-    
+    bool isThreaded() const { return strand != nullptr; }
+
     /*!
         \internal
-        \brief Writes a string to the socket.
-        \param out The null-terminated string to write.
+        \brief Handles a keyboard event and sends it to the VNC server.
+        \param e The keyboard event to be processed and sent.
         
-        Sends string data to the VNC server.
+        Translates Qt key events to VNC protocol key events and sends them to the server.
     */
-    void write(const char *out) {
-        if (isValid())
-            socket->write(out, strlen(out));
-    }
-    
+    void keyEvent(QKeyEvent *e);
+
     /*!
         \internal
-        \brief Writes binary data to the socket.
-        \param out The binary data to write.
-        \param len The length of the data in bytes.
-        
-        Sends raw binary data to the VNC server.
+        \brief Returns the X11 keysym for \a key, or 0 if it has none.
+        \param key A Qt::Key.
+        \param modifiers The modifiers, of which only Qt::KeypadModifier matters.
+        \param text The text the key produced with the current layout.
     */
-    void write(const unsigned char *out, int len) {
-        if (isValid())
-            socket->write(reinterpret_cast<const char *>(out), len);
-    }
-    
+    static quint32 keysym(int key, Qt::KeyboardModifiers modifiers, const QString &text);
+
     /*!
         \internal
-        \brief Writes a binary structure to the socket.
-        \param out The structure to write.
-        \tparam T The type of structure to write.
-        
-        Sends binary structure data to the VNC server.
+        \brief Returns the XT scan code of the key with \a nativeScanCode,
+        or 0 if it is unknown on this platform.
     */
-    template<class T>
-    void write(const T &out) {
-        if (isValid())
-            socket->write(reinterpret_cast<const char *>(&out), sizeof(T));
-    }
+    static quint32 xtKeycode(quint32 nativeScanCode);
 
-    /// Handshaking Messages
-    
     /*!
         \internal
-        \brief Parses the protocol version from the server.
-        
-        Reads the RFB protocol version string from the server and sets the
-        appropriate version enum value.
+        \brief Returns the keysym of the character \a ucs.
     */
-    void parseProtocolVersion();
-    
+    static quint32 characterKeysym(char32_t ucs);
+
     /*!
         \internal
-        \brief Handles protocol version changes.
-        \param protocolVersion The new protocol version.
-        
-        Called when the protocol version is set or changes. Responds to the
-        server with the appropriate version response and updates internal state.
+        \brief Types \a text with at most \a rate characters per second, 0 for no limit.
     */
-    void protocolVersionChanged(ProtocolVersion protocolVersion);
-    
+    void typeText(const QString &text, int rate);
+
     /*!
         \internal
-        \brief Dispatches to the appropriate security parsing function.
-        
-        Selects the security parsing method based on the negotiated protocol version.
+        \brief Sends more of the text being typed.
     */
-    void parseSecurity();
-    
+    void typeMore();
+
     /*!
         \internal
-        \brief Parses security data for protocol version 3.3.
-        
-        Handles the security type message format specific to VNC protocol version 3.3.
+        \brief Sends a key press or release.
+
+        Uses a QEMU extended key event carrying the scan code too if the
+        server supports it and \a keycode is known.
     */
-    void parseSecurity33();
+    void sendKey(bool down, quint32 keysym, quint32 keycode);
     
     /*!
         \internal
-        \brief Parses security data for protocol version 3.7 and later.
+        \brief Handles a mouse event and sends it to the VNC server.
+        \param e The mouse event to be processed and sent.
         
-        Handles the security type message format for VNC protocol versions 3.7 and 3.8.
+        Translates Qt mouse events to VNC protocol pointer events and sends them to the server.
     */
-    void parseSecurity37();
-    
+    void pointerEvent(QMouseEvent *e);
+
     /*!
         \internal
-        \brief Handles security type changes.
-        \param securityType The new security type.
-        
-        Called when the security type is set or changes. Responds to the server
-        with the appropriate security handshake and updates internal state.
+        \brief Sends a PointerEvent message with \a buttonMask at \a x, \a y.
     */
-    void securityTypeChanged(SecurityType securityType);
-    
+    void sendPointer(quint8 buttonMask, int x, int y);
+
     /*!
         \internal
-        \brief Parses the reason for a security failure.
-        
-        Reads and logs the reason string provided by the server when security negotiation fails.
+        \brief Sends the last position held back by the pointer rate limit.
     */
-    void parseSecurityReason();
+    void flushPointer();
 
-    // Initialisation Messages
-    
     /*!
         \internal
-        \brief Sends the client initialization message.
-        
-        Sends the client initialization message to the server, indicating whether
-        the connection will be shared.
+        \brief Builds the encoding list announced to the server.
+        \return The encodings and pseudo-encodings in order of preference.
+
+        Appends the quality and compression level pseudo-encodings when they
+        have been set.
     */
-    void clientInit();
-    
+    QList<qint32> encodings() const;
+
     /*!
         \internal
-        \brief Parses the server initialization message.
-        
-        Processes the server initialization data, including framebuffer dimensions,
-        pixel format, and server name.
+        \brief Re-sends SetEncodings when the connection is in normal operation.
+
+        Used when an encoding related property changes mid-session.
     */
-    void parserServerInit();
+    void updateEncodings();
 
-    // Client to server messages
-    
     /*!
         \internal
-        \brief Sends a SetPixelFormat message to the server.
-        
-        Configures the pixel format that the server should use when sending
-        framebuffer updates.
+        \brief Reacts to changed settings in the protocol thread.
+        \param previous The settings before the change.
     */
-    void setPixelFormat();
-    
+    void settingsChanged(const Settings &previous);
+
     /*!
         \internal
-        \brief Sends a SetEncodings message to the server.
-        \param encodings List of encoding types the client supports.
-        
-        Tells the server which encoding types the client prefers for framebuffer updates.
+        \brief Requests the parts of the region of interest that were not covered before.
+        \param previous The previous region in framebuffer coordinates, or a
+        null rect for the whole framebuffer.
     */
-    void setEncodings(const QList<qint32> &encodings);
-    
+    void regionOfInterestChanged(const QRect &previous);
+
     /*!
         \internal
-        \brief Sends a FramebufferUpdateRequest message to the server.
-        \param incremental If true, only changed parts of the framebuffer are requested.
-        \param rect The rectangle to update, or empty for the entire framebuffer.
+        \brief Resets the encoding statistics and seeds the cost model.
         
-        Requests the server to send framebuffer updates for the specified region.
+        Called when a new connection starts, so measurements of a previous
+        link do not leak into the next one.
     */
-    void framebufferUpdateRequest(bool incremental = true, const QRect &rect = QRect());
+    void resetStatistics();
 
-    // Server to client messages
-    
     /*!
         \internal
-        \brief Parses and dispatches incoming server messages.
-        
-        Reads the message type from the socket and calls the appropriate handler.
+        \brief Runs \a function in the thread that runs the protocol.
+
+        Calls it right away unless the protocol runs on the decode scheduler,
+        where the client's strand keeps the calls in order.
     */
-    void parseServerMessages();
-    
+    template<class Function>
+    void toProtocol(Function &&function) {
+        if (strand)
+            strand->post(std::forward<Function>(function));
+        else
+            function();
+    }
+
     /*!
         \internal
-        \brief Processes a framebuffer update message.
-        
-        Reads the number of rectangles and processes each one based on its encoding type.
+        \brief Runs \a function in the thread of the QVncClient.
+
+        Used by the protocol to publish frames and property changes.
     */
-    void framebufferUpdate();
-    
+    template<class Function>
+    void toClient(Function &&function) {
+        if (strand)
+            QMetaObject::invokeMethod(q, std::forward<Function>(function), Qt::QueuedConnection);
+        else
+            function();
+    }
+
     /*!
         \internal
-        \brief Handles raw-encoded rectangle data.
-        \param rect The rectangle dimensions.
-        
-        Processes uncompressed pixel data for the specified rectangle.
+        \brief Follows the connection state and data of \a device.
     */
-    void handleRawEncoding(const Rectangle &rect);
-    
+    void watchDevice(QIODevice *device);
+
     /*!
         \internal
-        \brief Handles hextile-encoded rectangle data.
-        \param rect The rectangle dimensions.
-        
-        Processes hextile-encoded data for the specified rectangle, which divides
-        the rectangle into 16x16 tiles with various subencodings.
+        \brief Starts a session when the device has been opened or connected.
+        \param loopback Whether the server is on the local host.
     */
-    void handleHextileEncoding(const Rectangle &rect);
+    void deviceOpened(bool loopback);
+
+    /*!
+        \internal
+        \brief Ends the session when the device has been closed or disconnected.
+    */
+    void deviceClosed();
+
+    /*!
+        \internal
+        \brief Closes the connection, whatever it runs over.
+    */
+    void closeConnection();
+
+    /*!
+        \internal
+        \brief Starts TLS on the device, anonymous if \a anonymous is true.
+    */
+    void startTls(bool anonymous);
+
+    /*!
+        \internal
+        \brief Remembers the session ticket of the TLS connection for reconnects.
+    */
+    void storeTlsSession();
+
+    /*!
+        \internal
+        \brief Asks the server to switch the connection to WebSocket.
+    */
+    void startUpgrade();
+
+    /*!
+        \internal
+        \brief Checks the response to the WebSocket upgrade once it is complete.
+    */
+    void continueUpgrade();
+
+    /*!
+        \internal
+        \brief Returns \a payload in a masked WebSocket frame of type \a opcode.
+    */
+    static QByteArray webSocketFrame(quint8 opcode, const QByteArray &payload);
+
+    /*!
+        \internal
+        \brief Answers a WebSocket control frame of type \a opcode.
+    */
+    void answerWebSocketControl(quint8 opcode, const QByteArray &payload);
+
+    /*!
+        \internal
+        \brief Starts a session when the device has connected.
+        \param loopback Whether the server is on the local host.
+        \param webSocket Whether the data comes in WebSocket frames.
+    */
+    void startSession(bool loopback, bool webSocket = false);
+
+    /*!
+        \internal
+        \brief Ends the session when the device has disconnected.
+    */
+    void endSession();
+
+    /*!
+        \internal
+        \brief Appends received bytes and parses as many messages as they complete.
+        \param data The bytes read from the socket.
+    */
+    void receive(const QByteArray &data);
+
+    /*!
+        \internal
+        \brief Appends the payload of the WebSocket frames in \a data to the receive buffer.
+    */
+    void receiveWebSocket(const QByteArray &data);
+
+    /*!
+        \internal
+        \brief Sends the messages queued by the protocol.
+    */
+    void flush();
+
+    /*!
+        \internal
+        \brief Writes an input message to the socket right away.
+
+        Input is sent from the thread of the QVncClient, so it neither waits
+        for nor races with the protocol thread.
+    */
+    void sendInput(const QByteArray &message);
+
+    /*!
+        \internal
+        \brief Queues \a data in the output buffer of the connection.
+
+        The buffer goes out in one write at the end of the event loop turn,
+        or right away if \a urgent is true.
+    */
+    void send(const QByteArray &data, bool urgent = false);
+
+    /*!
+        \internal
+        \brief Writes the output buffer to the socket.
+    */
+    void writeOutput();
+
+    /*!
+        \internal
+        \brief Pushes data written to the device to the network.
+    */
+    void flushDevice();
+
+    /*!
+        \internal
+        \brief Clears the state of the application's side after a session.
+    */
+    void resetClient();
+
+    /*!
+        \internal
+        \brief Forgets the framebuffer the application sees.
+    */
+    void dropFramebuffer();
+
+    /*!
+        \internal
+        \brief Marks the framebuffer the application sees as out of date if \a stale is true.
+    */
+    void setStale(bool stale);
+
+    /*!
+        \internal
+        \brief Records that the connection has reached \a phase of the handshake.
+    */
+    void reachPhase(HandshakePhase phase);
+
+    /*!
+        \internal
+        \brief Runs the connection over the connected native socket \a fd.
+        \return false if \a fd cannot be used.
+    */
+    bool openNative(qintptr fd);
+
+    /*!
+        \internal
+        \brief Stops using the native socket, if any, and closes it.
+    */
+    void closeNative();
+
+#ifdef USE_EPOLL
+    /*!
+        \internal
+        \brief Runs \a task in the thread that runs the protocol.
+
+        Called on the threads of the native transports.
+    */
+    void fromTransport(QVncDecodeScheduler::Task task);
+
+    /*!
+        \internal
+        \brief Reads what the native socket has into the receive buffer and parses it.
+    */
+    void readNative(const QVncEpollTransport::Registration &registration);
+
+    /*!
+        \internal
+        \brief Writes as much of the output buffer to the native socket as it takes.
+    */
+    void writeNative();
+#endif
+#ifdef USE_IO_URING
+    /*!
+        \internal
+        \brief Queues \a chunk for the protocol thread.
+
+        Called on an io_uring thread.
+    */
+    void uringReceived(const QVncUringTransport::Registration &registration, const QVncUringTransport::Chunk &chunk);
+
+    /*!
+        \internal
+        \brief Parses the chunks received through io_uring and hands their buffers back.
+    */
+    void readUring(const QVncUringTransport::Registration &registration);
+#endif
+
+private:
+    /*!
+        \internal
+        \brief Clears the protocol state at the start or end of a session.
+    */
+    void reset();
+
+    /*!
+        \internal
+        \brief Parses messages from the receive buffer until it runs out of data.
+    */
+    void parse();
+    
+    /*!
+        \internal
+        \brief Parses one message, or one step of a long message, based on the current state.
+        \return false if more data is needed.
+        
+        This is the main state machine dispatcher that directs incoming data to the
+        appropriate parsing function based on the current protocol state.
+    */
+    bool parseMessage();
+
+    /*!
+        \internal
+        \brief Returns the number of received bytes not parsed yet.
+    */
+    qint64 available() const {
+        return rx.size() - rxPos;
+    }
+
+    /*!
+        \internal
+        \brief Marks everything parsed so far as consumed.
+
+        A message that runs out of data is parsed again from the last commit
+        once more data has arrived, so decoders commit whenever they have
+        finished a unit they do not want to decode twice.
+    */
+    void commit() {
+        bytesReceived += rxPos - checkpoint;
+        checkpoint = rxPos;
+    }
+    
+    /*!
+        \internal
+        \brief Reads a binary structure from the receive buffer.
+        \param out Pointer to the structure to be filled with data.
+        \tparam T The type of structure to read.
+        
+        Reads binary data directly into the provided structure.
+    */
+    template<class T>
+    void read(T *out) {
+        readData(reinterpret_cast<char *>(out), sizeof(T));
+    }
+
+    /*!
+        \internal
+        \brief Reads raw bytes from the receive buffer.
+        \param data Buffer receiving the bytes.
+        \param size The number of bytes to read.
+        \return false if fewer than \a size bytes have been received.
+        
+        When the data has not arrived yet, \a data is zeroed and the parser
+        is marked as starved, so that the current message is parsed again
+        from the last commit once more data has arrived.
+    */
+    bool readData(char *data, qint64 size) {
+        if (available() < size) {
+            starved = true;
+            memset(data, 0, size);
+            return false;
+        }
+        memcpy(data, rx.constData() + rxPos, size);
+        rxPos += size;
+        return true;
+    }
+
+    /*!
+        \internal
+        \brief Reads \a size bytes from the receive buffer.
+        \return The bytes, or an empty array if they have not been received yet.
+    */
+    QByteArray readBytes(qint64 size) {
+        if (available() < size) {
+            starved = true;
+            return QByteArray();
+        }
+        // A copy even if it is all of rx, which may point into a buffer
+        // the transport reuses
+        const QByteArray data(rx.constData() + rxPos, size);
+        rxPos += size;
+        return data;
+    }
+
+    /*!
+        \internal
+        \brief Appends binary data to \a buffer.
+    */
+    template<class T>
+    static void append(QByteArray *buffer, const T &out) {
+        buffer->append(reinterpret_cast<const char *>(&out), sizeof(T));
+    }
+    
+    /*!
+        \internal
+        \brief Queues a string for sending.
+        \param out The null-terminated string to write.
+    */
+    void write(const char *out) {
+        tx.append(out);
+    }
+    
+    /*!
+        \internal
+        \brief Queues binary data for sending.
+        \param out The binary data to write.
+        \param len The length of the data in bytes.
+    */
+    void write(const unsigned char *out, int len) {
+        tx.append(reinterpret_cast<const char *>(out), len);
+    }
+    
+    /*!
+        \internal
+        \brief Queues a binary structure for sending.
+        \param out The structure to write.
+        \tparam T The type of structure to write.
+        
+        Messages are sent by flush() once the current batch of received data
+        has been parsed.
+    */
+    template<class T>
+    void write(const T &out) {
+        append(&tx, out);
+    }
+
+    /// Handshaking Messages
+    
+    /*!
+        \internal
+        \brief Parses the protocol version from the server.
+        
+        Reads the RFB protocol version string from the server and sets the
+        appropriate version enum value.
+    */
+    bool parseProtocolVersion();
+    
+    /*!
+        \internal
+        \brief Handles protocol version changes.
+        \param protocolVersion The new protocol version.
+        
+        Called when the protocol version is set or changes. Responds to the
+        server with the appropriate version response and updates internal state.
+    */
+    void protocolVersionChanged(ProtocolVersion protocolVersion);
+    
+    /*!
+        \internal
+        \brief Dispatches to the appropriate security parsing function.
+        
+        Selects the security parsing method based on the negotiated protocol version.
+    */
+    bool parseSecurity();
+    
+    /*!
+        \internal
+        \brief Parses security data for protocol version 3.3.
+        
+        Handles the security type message format specific to VNC protocol version 3.3.
+    */
+    bool parseSecurity33();
+    
+    /*!
+        \internal
+        \brief Parses security data for protocol version 3.7 and later.
+        
+        Handles the security type message format for VNC protocol versions 3.7 and 3.8.
+    */
+    bool parseSecurity37();
+    
+    /*!
+        \internal
+        \brief Handles security type changes.
+        \param securityType The new security type.
+        
+        Called when the security type is set or changes. Responds to the server
+        with the appropriate security handshake and updates internal state.
+    */
+    void securityTypeChanged(SecurityType securityType);
+    
+    /*!
+        \internal
+        \brief Parses the reason for a security failure.
+        
+        Reads and logs the reason string provided by the server when security negotiation fails.
+    */
+    bool parseSecurityReason();
+
+    /*!
+        \internal
+        \brief Parses the result of the security handshake.
+    */
+    bool parseSecurityResult();
+
+    /*!
+        \internal
+        \brief Parses the VeNCrypt version of the server.
+    */
+    bool parseVeNCryptVersion();
+
+    /*!
+        \internal
+        \brief Parses the VeNCrypt subtypes offered by the server and picks one.
+    */
+    bool parseVeNCryptSubtypes();
+
+    /*!
+        \internal
+        \brief Parses whether the server accepted the VeNCrypt subtype.
+    */
+    bool parseVeNCryptAck();
+
+    /*!
+        \internal
+        \brief Continues the handshake once TLS is up.
+    */
+    void tlsEstablished();
+
+    // Initialisation Messages
+    
+    /*!
+        \internal
+        \brief Sends the client initialization message.
+        
+        Sends the client initialization message to the server, indicating whether
+        the connection will be shared.
+    */
+    void clientInit();
+    
+    /*!
+        \internal
+        \brief Parses the server initialization message.
+        
+        Processes the server initialization data, including framebuffer dimensions,
+        pixel format, and server name.
+    */
+    bool parserServerInit();
+
+    // Client to server messages
+    
+    /*!
+        \internal
+        \brief Sends a SetPixelFormat message to the server.
+        
+        Configures the pixel format that the server should use when sending
+        framebuffer updates.
+    */
+    void setPixelFormat();
+    
+    /*!
+        \internal
+        \brief Sends a SetEncodings message to the server.
+        \param encodings List of encoding types the client supports.
+        
+        Tells the server which encoding types the client prefers for framebuffer updates.
+    */
+    void setEncodings(const QList<qint32> &encodings);
+    
+    /*!
+        \internal
+        \brief Sends a FramebufferUpdateRequest message to the server.
+        \param incremental If true, only changed parts of the framebuffer are requested.
+        \param rect The rectangle to update, or empty for the entire framebuffer.
+        
+        Requests the server to send framebuffer updates for the specified region.
+    */
+    void framebufferUpdateRequest(bool incremental = true, const QRect &rect = QRect());
+
+    // Server to client messages
+    
+    /*!
+        \internal
+        \brief Parses and dispatches incoming server messages.
+        
+        Reads the message type from the socket and calls the appropriate handler.
+    */
+    bool parseServerMessages();
+    
+    /*!
+        \internal
+        \brief Processes the header of a framebuffer update message.
+        
+        Reads the number of rectangles, which parseRectangle() then decodes
+        one at a time.
+    */
+    bool framebufferUpdate();
+
+    /*!
+        \internal
+        \brief Decodes the next rectangle of the current framebuffer update.
+        \return false if more data is needed.
+    */
+    bool parseRectangle();
+
+    /*!
+        \internal
+        \brief Publishes a completed framebuffer update and requests the next one.
+    */
+    void finishUpdate();
+
+    /*!
+        \internal
+        \brief Moves the refresh of a resumed session on to its next pass.
+    */
+    bool continueResume();
+
+    /*!
+        \internal
+        \brief Records decode time and size of a rectangle for adaptive encoding.
+    */
+    void recordDecode(qint32 encoding, qint64 nsecs, qint64 bytes, qint64 pixels);
+
+    /*!
+        \internal
+        \brief Records the size and duration of a complete framebuffer update.
+    */
+    void recordUpdate(qint64 bytes, qint64 nsecs);
+
+    /*!
+        \internal
+        \brief Reorders the encodings based on measured costs if adaptive encoding is on.
+    */
+    void adaptEncodings();
+
+    /*!
+        \internal
+        \brief Returns the estimated link throughput in bytes per second.
+    */
+    double estimatedThroughput() const;
+
+    /*!
+        \internal
+        \brief Returns the estimated time per pixel of an encoding in nanoseconds.
+    */
+    double encodingCost(qint32 encoding) const;
+
+    /*!
+        \internal
+        \brief Clears the link statistics at the start or end of a connection.
+    */
+    void resetLinkStatistics();
+
+    /*!
+        \internal
+        \brief Records the arrival of a FramebufferUpdate for round trip estimation.
+    */
+    void recordUpdateArrival();
+
+    /*!
+        \internal
+        \brief Adds a decoded rectangle to the damage of the current update.
+        \param rect The rectangle in framebuffer coordinates.
+    */
+    void addDamage(const QRect &rect);
+
+    /*!
+        \internal
+        \brief Emits the damage of a completed update and clears it.
+    */
+    void flushDamage();
+
+    /*!
+        \internal
+        \brief Emits the change signals of the link statistics properties.
+    */
+    void publishLinkStatistics();
+
+    /*!
+        \internal
+        \brief Returns the network round trip in milliseconds, -1 if unknown.
+    */
+    double networkRoundTrip() const;
+
+    /*!
+        \internal
+        \brief Parses a Fence message from the server.
+    */
+    bool parseFence();
+
+    /*!
+        \internal
+        \brief Sends a Fence message to the server.
+        \param flags The fence flags.
+        \param payload Up to 64 bytes the server echoes back.
+    */
+    void sendFence(quint32 flags, const QByteArray &payload);
+
+    /*!
+        \internal
+        \brief Appends a Fence message with \a flags and \a payload to \a buffer.
+    */
+    static void appendFence(QByteArray *buffer, quint32 flags, const QByteArray &payload);
+
+    /*!
+        \internal
+        \brief Sends a Fence to measure the round trip if one is due.
+    */
+    void probeRoundTrip();
+
+    /*!
+        \internal
+        \brief Returns the supported encodings ordered by estimated cost.
+    */
+    QList<qint32> rankEncodings() const;
+    
+    /*!
+        \internal
+        \brief Handles raw-encoded rectangle data.
+        \param rect The rectangle dimensions.
+        
+        Processes uncompressed pixel data for the specified rectangle.
+    */
+    void handleRawEncoding(const Rectangle &rect);
+
+    /*!
+        \internal
+        \brief Converts rows of raw pixel data to the framebuffer.
+        \param rect The rectangle dimensions.
+        \param first The first row of \a rect to convert.
+        \param count The number of rows.
+        \param data The pixels of the rows, without padding.
+    */
+    void decodeRawRows(const Rectangle &rect, int first, int count, const char *data);
+
+    /*!
+        \internal
+        \brief Prepares the framebuffer for writing by the decoders.
+
+        Detaches the image at most once per update and caches its pixel
+        pointer, so that the decoders never trigger a copy of the whole
+        framebuffer.
+    */
+    void beginUpdate();
+
+    /*!
+        \internal
+        \brief Publishes the back buffer of a completed update when buffered.
+    */
+    void publishFrame();
+
+    /*!
+        \internal
+        \brief Writes one pixel of the framebuffer, ignoring positions outside of it.
+    */
+    inline void setPixel(int x, int y, QRgb color)
+    {
+        if (uint(x) < uint(frame->width()) && uint(y) < uint(frame->height()))
+            reinterpret_cast<QRgb *>(frameBits + y * frameBytesPerLine)[x] = color;
+    }
+
+    /*!
+        \internal
+        \brief Fills the part of \a area inside the framebuffer with \a color.
+    */
+    inline void fillRect(const QRect &area, QRgb color)
+    {
+        const QRect clipped = area & frame->rect();
+        for (int y = clipped.top(); y <= clipped.bottom(); y++) {
+            QRgb *line = reinterpret_cast<QRgb *>(frameBits + y * frameBytesPerLine);
+            std::fill(line + clipped.left(), line + clipped.left() + clipped.width(), color);
+        }
+    }
+    
+    /*!
+        \internal
+        \brief Handles hextile-encoded rectangle data.
+        \param rect The rectangle dimensions.
+        
+        Processes hextile-encoded data for the specified rectangle, which divides
+        the rectangle into 16x16 tiles with various subencodings.
+    */
+    void handleHextileEncoding(const Rectangle &rect);
+    
+#ifdef USE_ZLIB
+    /*!
+        \internal
+        \brief Handles tight-encoded rectangle data.
+        \param rect The rectangle dimensions.
+        
+        Processes Tight-encoded data for the specified rectangle, which may use
+        zlib compression, JPEG compression, or various other subencodings.
+    */
+    void handleTightEncoding(const Rectangle &rect);
+
+    /*!
+        \internal
+        \brief Ends the Tight zlib streams selected by the bits of \a streams.
+    */
+    void resetTightStreams(quint8 streams);
+
+    /*!
+        \internal
+        \brief Decodes the rows of a Tight rectangle using basic compression.
+        \return false if the inflated data ran out first.
+    */
+    bool decodeTightRows(const Rectangle &rect, ZlibRect *z);
+
+    /*!
+        \internal
+        \brief Returns the size of a TPIXEL, a pixel in Tight data.
+    */
+    int tightPixelSize() const;
+
+    /*!
+        \internal
+        \brief Converts the TPIXEL of \a size bytes at \a data to a colour.
+    */
+    QRgb tightColor(const uchar *data, int size) const;
+
+    /*!
+        \internal
+        \brief Returns zlib stream \a index, starting it if needed.
+
+        Tight uses streams 0 to 3 and ZRLE stream TightData::ZRLEIndex.
+    */
+    z_stream *zlibStream(int index);
+
+    /*!
+        \internal
+        \brief A decoder of zlib compressed rectangles.
+    */
+    using ZlibDecoder = bool (Private::*)(const Rectangle &, ZlibRect *);
+
+    /*!
+        \internal
+        \brief Feeds the received part of the current rectangle's payload to \a decode.
+
+        Marks the parser as starved until the whole payload has been consumed.
+    */
+    void streamZlibRect(ZlibDecoder decode);
+
+    /*!
+        \internal
+        \brief Hands a rectangle whose payload has been read completely to the decode threads.
+        \param z The state of the rectangle, with anything preceding the payload parsed.
+        \param payload The compressed payload.
+        \param streamIndex The zlib stream to inflate it with, or -1 if it is sent as is.
+        \param resets Tight streams to reset first.
+        \param decode The decoder.
+    */
+    void deferZlibRect(ZlibRect z, const QByteArray &payload, int streamIndex, quint8 resets, ZlibDecoder decode);
+#endif
+    
+    /*!
+        \internal
+        \brief Decodes a JPEG-compressed rectangle in Tight encoding.
+        \param rect The rectangle dimensions.
+        \param jpegData The JPEG data.
+        \return true if successful, false if there was an error.
+        
+        Decompresses JPEG image data for a rectangle in Tight encoding.
+    */
+    bool decodeTightJpeg(const Rectangle &rect, const QByteArray &jpegData);
+
+    /*!
+        \internal
+        \brief Reads a compact length field used by Tight encoding.
+        \param length Receives the decoded length.
+        \return true if successful, false if the data has not arrived yet.
+    */
+    bool readTightLength(int *length);
+
+#ifdef USE_ZLIB
+    /*!
+        \internal
+        \brief Handles ZRLE-encoded rectangle data.
+        \param rect The rectangle dimensions.
+        
+        Processes ZRLE (Zlib Run-Length Encoding) data for the specified rectangle.
+    */
+    void handleZRLEEncoding(const Rectangle &rect);
+
+    /*!
+        \internal
+        \brief Decodes the tiles of a ZRLE rectangle.
+        \return false if the inflated data ran out first.
+    */
+    bool decodeZRLETiles(const Rectangle &rect, ZlibRect *z);
+#endif
+
+    /*!
+        \internal
+        \brief Converts a pixel value in the server's pixel format to a colour.
+    */
+    inline QRgb toRgb(quint32 color) const
+    {
+        return qRgb((color >> pixelFormat.redShift) & pixelFormat.redMax,
+                    (color >> pixelFormat.greenShift) & pixelFormat.greenMax,
+                    (color >> pixelFormat.blueShift) & pixelFormat.blueMax);
+    }
+
+    /*!
+        \internal
+        \brief Handles a Cursor pseudo-encoding rectangle.
+        \param rect The hot spot and size of the new cursor shape.
+
+        Publishes the shape to the application, which draws it itself.
+    */
+    void handleCursor(const Rectangle &rect);
+
+    /*!
+        \internal
+        \brief Publishes the pointer position the server reported.
+
+        Positions the client sent itself are echoes and are dropped, so the
+        application only learns about moves it did not make, such as those
+        of a remote application warping the pointer.
+    */
+    void reportCursorPosition(const QPoint &position);
+
+    /*!
+        \internal
+        \brief Handles a CopyRect rectangle, which repeats another area of the framebuffer.
+        \param rect The rectangle dimensions.
+    */
+    void handleCopyRect(const Rectangle &rect);
+
+    /*!
+        \internal
+        \brief Copies \a source of the framebuffer to \a target, which may overlap it.
+    */
+    void copyRect(const QRect &source, const QPoint &target);
+
+    /*!
+        \internal
+        \brief Hands the decoding of the current rectangle to the decode threads.
+        \param source Area of the framebuffer the decoder reads, if any.
+        \param streams ZlibStream bits of the zlib streams the decoder uses.
+        \param decode Decodes the rectangle from data that has been read already.
+        
+        The decoder runs once all earlier rectangles it depends on are done:
+        those it overlaps, those writing its source, those reading what it
+        writes and those sharing one of its streams.
+    */
+    void defer(const QRect &source, quint8 streams, std::function<void()> decode);
+
+    /*!
+        \internal
+        \brief Waits for the deferred decoders reading or writing \a rect or
+        using one of the zlib \a streams.
+
+        Used before decoding into \a rect in the protocol thread.
+    */
+    void settle(const QRect &rect, quint8 streams = 0);
+
+    /*!
+        \internal
+        \brief Waits for all deferred decoders and records their cost.
+    */
+    void settle();
+
+private:
+    QVncClient *q;                              ///< Pointer to the public class
+    QIODevice *prev = nullptr;                  ///< Previous device for cleanup
+    std::unique_ptr<QVncDecodeScheduler::Strand> strand; ///< Runs the protocol in order, if threaded
+    QMutex strandMutex;                         ///< Guards strand against the epoll threads
+
+    // Protocol state, only used in the protocol thread
+    HandshakingState state = ProtocolVersionState; ///< Current protocol state
+    ProtocolVersion version = ProtocolVersionUnknown; ///< Negotiated protocol version
+    HandshakingState tlsNext = SecurityResultState; ///< State to continue in once TLS is up
+    quint32 veNCryptSubtype = 0;                ///< VeNCrypt subtype chosen
+    QByteArray serverName;                      ///< Name of the desktop of the last session
+    bool resumable = false;                     ///< Whether image is kept for the next session
+    ResumePass resumePass = ResumeNone;         ///< Pass of the refresh of a resumed session
+    bool resumeLossy = false;                   ///< Whether the coarse pass used JPEG
+    bool handshaking = true;                    ///< Whether the first update has yet to arrive
+    PixelFormat pixelFormat;                    ///< Current pixel format
+    Settings session;                           ///< Settings in effect for the protocol
+    bool loopback = false;                      ///< Whether the server is on the local host
+    bool webSocket = false;                     ///< Whether the data comes in WebSocket frames
+    /*!
+        \internal
+        \brief State of the WebSocket frame being received.
+    */
+    struct WebSocketFrame {
+        uchar header[14];                       ///< Header bytes received so far
+        int headerSize = 0;                     ///< Number of bytes in header
+        int headerNeeded = 2;                   ///< Header size known so far
+        bool inPayload = false;                 ///< Whether the header is complete
+        quint8 opcode = 0;                      ///< Type of the frame
+        bool masked = false;                    ///< Whether the payload is masked
+        uchar key[4] = {};                      ///< Masking key
+        quint64 keyOffset = 0;                  ///< Payload bytes unmasked so far
+        quint64 remaining = 0;                  ///< Payload bytes still to come
+        QByteArray control;                     ///< Payload of a control frame
+    } frameIn;                                  ///< WebSocket frame being received
+#ifdef USE_EPOLL
+    int protocolSocket = -1;                    ///< Native socket the protocol reads, or -1
+#endif
+    QByteArray rx;                              ///< Received data not consumed yet
+    qsizetype rxPos = 0;                        ///< Parse position in rx
+    qsizetype checkpoint = 0;                   ///< Position parsing resumes from when starved
+    bool starved = false;                       ///< A read ran past the received data
+    QByteArray tx;                              ///< Messages waiting to be sent
+    int rectsLeft = 0;                          ///< Rectangles left in the current update
+    bool inRectangle = false;                   ///< Whether the header of rectangle was read
+    Rectangle rectangle;                        ///< Rectangle being decoded
+    qint32 rectangleEncoding = 0;               ///< Encoding of rectangle
+    qint64 rectangleStart = 0;                  ///< bytesReceived at the start of rectangle
+    qint64 rectangleNsecs = 0;                  ///< Time spent decoding rectangle so far
+    int rawRow = 0;                             ///< Next raw row of rectangle
+    int hextileTile = 0;                        ///< Next Hextile tile of rectangle
+    quint32 hextileBackground = 0;              ///< Hextile background carried between tiles
+    quint32 hextileForeground = 0;              ///< Hextile foreground carried between tiles
+#ifdef USE_ZLIB
+    bool inflating = false;                     ///< Whether rectangle is inflated as its data arrives
+    ZlibRect zlibRect;                          ///< State of rectangle while inflating
+#endif
+    QElapsedTimer updateTimer;                  ///< Time since the current update started
+    qint64 updateStart = 0;                     ///< bytesReceived at the start of the update
+    qint64 progressAt = 0;                      ///< updateTimer time of the next partial publication
+public:
+    QIODevice *device = nullptr;                ///< Transport of the VNC connection
+    bool connected = false;                     ///< Whether device is connected
+#ifdef USE_ZLIB
+    QScopedPointer<TightData> tightData;        ///< Data for Tight encoding
+#endif
+    Settings settings;                          ///< Settings as set by the application
+
+    // Published state, only used in the thread of the QVncClient
+    ProtocolVersion protocolVersion = ProtocolVersionUnknown; ///< Current protocol version
+    SecurityType securityType = SecurityTypeUnknwon;         ///< Current security type
+    QSize framebufferSize = QSize(0, 0);        ///< Framebuffer size announced to the application
+    QImage published;                           ///< Last frame delivered when threaded
+    bool stale = false;                         ///< Whether the framebuffer shows a lost session
+    QElapsedTimer handshakeClock;               ///< Time since the device connected
+    std::array<qreal, FirstUpdatePhase + 1> handshakeTimes; ///< When each phase was reached, -1 if not yet
+    QByteArray output;                          ///< Messages waiting for the end of the event loop turn
+    QUrl webSocketUrl;                          ///< Endpoint of a WebSocket connection, empty for plain RFB
+    QByteArray upgradeKey;                      ///< Key of the WebSocket handshake
+    QByteArray upgradeResponse;                 ///< Response to the WebSocket upgrade received so far
+    bool upgrading = false;                     ///< Whether the WebSocket upgrade is in progress
+    bool upgradeLoopback = false;               ///< Whether the server of the upgrade is on the local host
+    bool webSocketOpen = false;                 ///< Whether output goes out in WebSocket frames
+    bool tlsStarting = false;                   ///< Whether the TLS handshake is in progress
+    QString tlsSessionKey;                      ///< Server the TLS session ticket belongs to, empty without TLS
+#ifdef USE_EPOLL
+    int nativeSocket = -1;                      ///< Native socket of the connection, or -1
+    QVncEpollTransport::Registration nativeRegistration; ///< Epoll watch of nativeSocket
+    std::unique_ptr<QSocketNotifier> writeNotifier; ///< Resumes writing to a full nativeSocket
+#endif
+#ifdef USE_IO_URING
+    QVncUringTransport::Registration uringRegistration; ///< Receives of nativeSocket, if through io_uring
+    QMutex incomingMutex;                       ///< Guards incoming against the io_uring threads
+    QList<QVncUringTransport::Chunk> incoming;  ///< Chunks received for the protocol
+    bool incomingScheduled = false;             ///< Whether readUring() is queued
+#endif
+    int pointerRate = 120;                      ///< Pointer motion messages per second, 0 for no limit
+    QTimer pointerTimer;                        ///< Sends the held back pointer position
+    QElapsedTimer pointerClock;                 ///< Time since the last pointer message
+    quint8 pointerButtons = 0;                  ///< Button mask of the last pointer message
+    QPoint pointerPosition;                     ///< Position of the last pointer event
+    /*!
+        \internal
+        \brief A key that is held down on the server.
+    */
+    struct PressedKey {
+        quint32 id;                             ///< Native scan code, or Qt key with the top bit set
+        quint32 keysym;                         ///< Keysym sent with the press
+        quint32 keycode;                        ///< XT scan code sent with the press
+    };
+    QVarLengthArray<PressedKey, 16> pressedKeys; ///< Keys to release with what they were pressed with
+    bool qemuKeyEvents = false;                 ///< Whether the server takes QEMU extended key events
+    bool serverFences = false;                  ///< Whether the server supports Fence
+    QList<quint32> typing;                      ///< Keysyms of the text being typed
+    qsizetype typingPos = 0;                    ///< Next keysym of typing to send
+    int typingRate = 0;                         ///< Characters per second to type, 0 for no limit
+    qsizetype typingInFlight = 0;               ///< Bytes of typed keys the server has not acknowledged
+    QList<qsizetype> typingChunks;              ///< Sizes of the chunks awaiting their Fence, in order
+    bool typingRequested = false;               ///< Whether textTyped() is still due
+    QTimer typingTimer;                         ///< Paces typing by time
+    QList<QPoint> sentPositions;                ///< Recently sent pointer positions the server may echo
+    QImage cursorShape;                         ///< Cursor shape sent by the server
+    QPoint cursorHotSpot;                       ///< Hot spot of cursorShape
+    QPoint cursorPosition;                      ///< Pointer position last moved by the server
+    bool pointerPending = false;                ///< Whether pointerPosition is still to be sent
+    bool outputScheduled = false;               ///< Whether writeOutput() is queued
+    qreal bandwidth = -1;                       ///< Published bandwidth estimate
+    qreal roundTripTime = -1;                   ///< Published round trip estimate
+    qreal serverLatency = -1;                   ///< Published server latency estimate
+
+    QImage image;                               ///< Image containing the published framebuffer
+    mutable QMutex imageMutex;                  ///< Guards publication of image
+    QList<BackBuffer> backBuffers;              ///< Buffers the decoders write to when buffered
+    int backBuffer = 0;                         ///< Index of the back buffer being written
+    QImage *frame = &image;                     ///< Image the decoders write to
+    int frameBufferWidth = 0;                   ///< Framebuffer width
+    int frameBufferHeight = 0;                  ///< Framebuffer height
+    EncodingStatistics statistics;              ///< Measurements for adaptive encoding
+    LinkStatistics link;                        ///< Throughput and latency estimates
+    QRegion damage;                             ///< Area changed by the update being decoded
+    uchar *frameBits = nullptr;                 ///< Pixels of image while an update is decoded
+    qsizetype frameBytesPerLine = 0;            ///< Stride of frameBits
+    qint64 bytesReceived = 0;                   ///< Bytes consumed from the socket
+    std::unique_ptr<QVncDecodeScheduler::Graph> decodeGraph; ///< Decoders of the current update, created on first use
+    std::deque<DeferredDecode> deferred;        ///< Rectangles of the current update handed to decodeGraph
+    bool rectangleDeferred = false;             ///< Whether rectangle was handed to decodeGraph
+    std::atomic<bool> decodeFailed { false };   ///< A deferred decoder could not decode its data
+};
+
+/*!
+    \internal
+    Constructs the private implementation with keyboard mapping and signal connections.
+    
+    \param parent The QVncClient instance that owns this implementation.
+*/
+QVncClient::Private::Private(QVncClient *parent)
+    : q(parent)
+#ifdef USE_ZLIB
+    , tightData(new TightData())
+#endif
+{
+    handshakeTimes.fill(-1);
+
+    typingTimer.setSingleShot(true);
+    typingTimer.setTimerType(Qt::PreciseTimer);
+    connect(&typingTimer, &QTimer::timeout, q, [this]() { typeMore(); });
+
+    pointerTimer.setSingleShot(true);
+    pointerTimer.setTimerType(Qt::PreciseTimer);
+    connect(&pointerTimer, &QTimer::timeout, q, [this]() { flushPointer(); });
+
+    connect(q, &QVncClient::deviceChanged, q, [this](QIODevice *device) {
+        if (prev) {
+            disconnect(prev, nullptr, q, nullptr);
+        }
+        closeNative();
+        if (std::exchange(connected, false))
+            emit q->connectionStateChanged(false);
+        toProtocol([this]() { endSession(); });
+        resetClient();
+        if (device)
+            watchDevice(device);
+        prev = device;
+    });
+}
+
+/*!
+    \internal
+    Connects to the signals telling when \a device connects, disconnects
+    and has data, and starts a session right away if it is connected
+    already.
+
+    Sockets and processes report their state with their own signals; any
+    other device counts as connected while it is open.
+*/
+void QVncClient::Private::watchDevice(QIODevice *device)
+{
+    bool ready = false;
+    if (auto *socket = qobject_cast<QAbstractSocket *>(device)) {
+        const auto opened = [this, socket]() {
+            // Messages are batched already, so Nagle's algorithm only
+            // delays input
+            if (socket->socketType() == QAbstractSocket::TcpSocket)
+                socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+            deviceOpened(socket->peerAddress().isLoopback());
+        };
+        connect(socket, &QAbstractSocket::connected, q, opened);
+        connect(socket, &QAbstractSocket::disconnected, q, [this]() { deviceClosed(); });
+#if QT_CONFIG(ssl)
+        if (auto *sslSocket = qobject_cast<QSslSocket *>(socket)) {
+            connect(sslSocket, &QSslSocket::encrypted, q, [this]() {
+                // Encryption the application started itself is its business
+                if (!std::exchange(tlsStarting, false))
+                    return;
+                reachPhase(TlsPhase);
+                storeTlsSession();
+                toProtocol([this]() { tlsEstablished(); });
+            });
+            // TLS 1.3 servers send tickets after the handshake
+            connect(sslSocket, &QSslSocket::newSessionTicketReceived, q, [this]() { storeTlsSession(); });
+        }
+#endif
+        if (socket->state() == QAbstractSocket::ConnectedState)
+            opened();
+    } else if (auto *socket = qobject_cast<QLocalSocket *>(device)) {
+        connect(socket, &QLocalSocket::connected, q, [this]() { deviceOpened(true); });
+        connect(socket, &QLocalSocket::disconnected, q, [this]() { deviceClosed(); });
+        ready = socket->state() == QLocalSocket::ConnectedState;
+    } else if (auto *process = qobject_cast<QProcess *>(device)) {
+        // A tunnel such as ssh may lead anywhere
+        connect(process, &QProcess::started, q, [this]() { deviceOpened(false); });
+        connect(process, &QProcess::finished, q, [this]() { deviceClosed(); });
+        ready = process->state() == QProcess::Running;
+    } else {
+        connect(device, &QIODevice::aboutToClose, q, [this]() { deviceClosed(); });
+        ready = device->isOpen();
+    }
+    if (ready)
+        deviceOpened(false);
+
+    const auto read = [this, device]() {
+        const QByteArray data = device->readAll();
+        if (upgrading) {
+            upgradeResponse += data;
+            continueUpgrade();
+            return;
+        }
+        toProtocol([this, data]() { receive(data); });
+    };
+    connect(device, &QIODevice::readyRead, q, read);
+    if (connected && device->bytesAvailable() > 0)
+        read();
+}
+
+void QVncClient::Private::deviceOpened(bool loopback)
+{
+    if (std::exchange(connected, true))
+        return;
+    handshakeClock.start();
+    handshakeTimes.fill(-1);
+    emit q->connectionStateChanged(true);
+    qCInfo(lcVncClient) << "Connected to VNC server";
+    q->setProtocolVersion(ProtocolVersionUnknown);
+    q->setSecurityType(SecurityTypeUnknwon);
+    // Native sockets speak plain RFB
+    if (device && !webSocketUrl.isEmpty()) {
+        upgradeLoopback = loopback;
+        startUpgrade();
+        return;
+    }
+    toProtocol([this, loopback]() { startSession(loopback); });
+}
+
+/*!
+    \internal
+    Sends the HTTP request that turns the connection into a WebSocket
+    carrying binary frames, as websockify and the consoles of hypervisors
+    such as Proxmox and OpenStack expect.
+*/
+void QVncClient::Private::startUpgrade()
+{
+    QByteArray key(16, Qt::Uninitialized);
+    QRandomGenerator::global()->fillRange(reinterpret_cast<quint32 *>(key.data()), key.size() / 4);
+    upgradeKey = key.toBase64();
+    upgradeResponse.clear();
+    upgrading = true;
+
+    QByteArray host = webSocketUrl.host(QUrl::FullyEncoded).toLatin1();
+    if (host.contains(':'))
+        host = '[' + host + ']';
+    if (webSocketUrl.port() >= 0)
+        host += ':' + QByteArray::number(webSocketUrl.port());
+    QByteArray path = webSocketUrl.path(QUrl::FullyEncoded).toLatin1();
+    if (path.isEmpty())
+        path = "/";
+    if (webSocketUrl.hasQuery())
+        path += '?' + webSocketUrl.query(QUrl::FullyEncoded).toLatin1();
+
+    QByteArray request;
+    request += "GET " + path + " HTTP/1.1\r\n";
+    request += "Host: " + host + "\r\n";
+    request += "Upgrade: websocket\r\n";
+    request += "Connection: Upgrade\r\n";
+    request += "Sec-WebSocket-Key: " + upgradeKey + "\r\n";
+    request += "Sec-WebSocket-Version: 13\r\n";
+    request += "Sec-WebSocket-Protocol: binary\r\n";
+    request += "\r\n";
+    device->write(request);
+    flushDevice();
+}
+
+/*!
+    \internal
+    Checks the response to the upgrade once its header is complete and
+    starts the session, passing on what the server sent after it. A server
+    that refuses the upgrade is disconnected.
+*/
+void QVncClient::Private::continueUpgrade()
+{
+    const qsizetype end = upgradeResponse.indexOf("\r\n\r\n");
+    if (end < 0 && upgradeResponse.size() < WebSocketMaxResponse)
+        return;
+    upgrading = false;
+
+    const QList<QByteArray> lines = upgradeResponse.left(qMax<qsizetype>(end, 0)).split('\n');
+    const QByteArray status = lines.value(0).trimmed();
+    const QByteArray accept = QCryptographicHash::hash(upgradeKey + WebSocketGuid, QCryptographicHash::Sha1).toBase64();
+    bool accepted = false;
+    QByteArray protocol;
+    for (qsizetype i = 1; i < lines.size(); i++) {
+        const qsizetype colon = lines.at(i).indexOf(':');
+        if (colon < 0)
+            continue;
+        const QByteArray name = lines.at(i).left(colon).trimmed().toLower();
+        const QByteArray value = lines.at(i).mid(colon + 1).trimmed();
+        if (name == "sec-websocket-accept")
+            accepted = value == accept;
+        else if (name == "sec-websocket-protocol")
+            protocol = value;
+    }
+    // Base64 framing of old websockify versions is not supported
+    if (end < 0 || !status.startsWith("HTTP/1.1 101") || !accepted || (!protocol.isEmpty() && protocol != "binary")) {
+        qCWarning(lcVncClient) << "WebSocket upgrade refused:" << status;
+        upgradeResponse.clear();
+        device->close();
+        return;
+    }
+
+    const QByteArray rest = upgradeResponse.mid(end + 4);
+    upgradeResponse.clear();
+    webSocketOpen = true;
+    reachPhase(WebSocketUpgradePhase);
+    toProtocol([this, loopback = upgradeLoopback]() { startSession(loopback, true); });
+    if (!rest.isEmpty())
+        toProtocol([this, rest]() { receive(rest); });
+    // Messages queued meanwhile
+    writeOutput();
+}
+
+void QVncClient::Private::deviceClosed()
+{
+    if (!std::exchange(connected, false))
+        return;
+    qCInfo(lcVncClient) << "Disconnected from VNC server";
+    emit q->connectionStateChanged(false);
+    toProtocol([this]() { endSession(); });
+    resetClient();
+}
+
+void QVncClient::Private::closeConnection()
+{
+    if (device) {
+        device->close();
+    } else {
+        deviceClosed();
+        closeNative();
+    }
+}
+
+/*!
+    \internal
+    Starts the TLS handshake of VeNCrypt or of the TLS security type on the
+    QSslSocket the connection runs over, offering the session ticket of an
+    earlier connection to the same server, if any, so the server can skip
+    the key exchange and certificate verification.
+
+    Anonymous TLS needs cipher suites without authentication, which only
+    exist up to TLS 1.2 and which OpenSSL disables unless its security level
+    is lowered.
+*/
+void QVncClient::Private::startTls(bool anonymous)
+{
+#if QT_CONFIG(ssl)
+    auto *socket = qobject_cast<QSslSocket *>(device);
+    if (!socket || socket->isEncrypted() || webSocketOpen) {
+        qCWarning(lcVncClient) << "TLS security needs an unencrypted QSslSocket as the device";
+        closeConnection();
+        return;
+    }
+    QSslConfiguration configuration = socket->sslConfiguration();
+    configuration.setSslOption(QSsl::SslOptionDisableSessionPersistence, false);
+    if (anonymous) {
+        configuration.setPeerVerifyMode(QSslSocket::VerifyNone);
+        configuration.setBackendConfigurationOption("MaxProtocol", QByteArray("TLSv1.2"));
+        configuration.setBackendConfigurationOption("CipherString", QByteArray("aNULL:@SECLEVEL=0"));
+    }
+    const QString host = socket->peerName().isEmpty() ? socket->peerAddress().toString() : socket->peerName();
+    tlsSessionKey = host + u':' + QString::number(socket->peerPort()) + (anonymous ? QStringLiteral("/anonymous") : QString());
+    {
+        TlsSessionCache *cache = tlsSessions();
+        QMutexLocker locker(&cache->mutex);
+        const auto it = cache->sessions.constFind(tlsSessionKey);
+        if (it != cache->sessions.constEnd() && !it->expiry.hasExpired())
+            configuration.setSessionTicket(it->ticket);
+    }
+    socket->setSslConfiguration(configuration);
+    tlsStarting = true;
+    socket->startClientEncryption();
+#else
+    Q_UNUSED(anonymous);
+    qCWarning(lcVncClient) << "TLS security is not available in this build";
+    closeConnection();
+#endif
+}
+
+void QVncClient::Private::storeTlsSession()
+{
+#if QT_CONFIG(ssl)
+    auto *socket = qobject_cast<QSslSocket *>(device);
+    if (!socket || tlsSessionKey.isEmpty())
+        return;
+    const QSslConfiguration configuration = socket->sslConfiguration();
+    if (configuration.sessionTicket().isEmpty())
+        return;
+    // Servers that give no lifetime usually keep tickets for a few hours
+    const int lifetime = configuration.sessionTicketLifeTimeHint();
+    TlsSessionCache *cache = tlsSessions();
+    QMutexLocker locker(&cache->mutex);
+    cache->sessions.insert(tlsSessionKey, TlsSession {
+        configuration.sessionTicket(),
+        QDeadlineTimer(std::chrono::seconds(lifetime > 0 ? lifetime : 3600)),
+    });
+#endif
+}
+
+/*!
+    \internal
+    Finishes the work queued on the scheduler, including the decoders of an
+    update in progress, before the state it works on goes away.
+*/
+QVncClient::Private::~Private()
+{
+    closeNative();
+    setThreaded(false);
+    settle();
+}
+
+/*!
+    \internal
+    Moves the protocol to the decode scheduler shared by all clients when
+    \a threaded is true, or back to the thread of the QVncClient otherwise.
+
+    The client gets a strand of its own, so its messages are still handled
+    one after the other while any number of clients share the scheduler's
+    workers. Work already queued on the strand is finished before it goes
+    away, so a session carries on seamlessly in either direction.
+*/
+void QVncClient::Private::setThreaded(bool threaded)
+{
+    if (threaded == isThreaded())
+        return;
+    QMutexLocker locker(&strandMutex);
+    if (threaded) {
+        strand = std::make_unique<QVncDecodeScheduler::Strand>();
+    } else {
+        // The queued work still has to see the strand to publish its results
+        strand->drain();
+        strand.reset();
+    }
+}
+
+/*!
+    \internal
+    Passes a copy of the application's settings to the protocol thread and
+    lets it react to whatever changed.
+*/
+void QVncClient::Private::applySettings()
+{
+    toProtocol([this, settings = settings]() {
+        const Settings previous = std::exchange(session, settings);
+        settingsChanged(previous);
+    });
+}
+
+/*!
+    \internal
+    Starts a new session on a freshly connected socket.
+*/
+void QVncClient::Private::startSession(bool loopback, bool webSocket)
+{
+    reset();
+    this->loopback = loopback;
+    this->webSocket = webSocket;
+}
+
+/*!
+    \internal
+    Ends the session and drops everything that belonged to it.
+*/
+void QVncClient::Private::endSession()
+{
+    // The last frame stays for a reconnect to the same server
+    resumable = session.sessionResume && !image.isNull();
+    reset();
+}
+
+void QVncClient::Private::reset()
+{
+    settle();
+    decodeFailed = false;
+    state = ProtocolVersionState;
+    version = ProtocolVersionUnknown;
+    tlsNext = SecurityResultState;
+    veNCryptSubtype = 0;
+    frameBufferWidth = 0;
+    frameBufferHeight = 0;
+    if (!resumable) {
+        QMutexLocker locker(&imageMutex);
+        image = QImage(); // Clear the image buffer
+    }
+    resumePass = ResumeNone;
+    resumeLossy = false;
+    handshaking = true;
+    backBuffers.clear();
+    frame = &image;
+    frameBits = nullptr;
+    damage = QRegion();
+    rx.clear();
+    rxPos = 0;
+    checkpoint = 0;
+    starved = false;
+    webSocket = false;
+    frameIn = WebSocketFrame();
+    tx.clear();
+    rectsLeft = 0;
+    inRectangle = false;
+#ifdef USE_ZLIB
+    inflating = false;
+    zlibRect = ZlibRect();
+    tightData->resetZlibStreams();
+#endif
+    resetLinkStatistics();
+}
+
+/*!
+    \internal
+    Clears what the application sees of a session that has ended.
+*/
+void QVncClient::Private::resetClient()
+{
+    q->setProtocolVersion(ProtocolVersionUnknown);
+    q->setSecurityType(SecurityTypeUnknwon);
+    output.clear();
+    pointerTimer.stop();
+    pointerPending = false;
+    pointerButtons = 0;
+    sentPositions.clear();
+    pressedKeys.clear();
+    qemuKeyEvents = false;
+    serverFences = false;
+    typing.clear();
+    typingPos = 0;
+    typingInFlight = 0;
+    typingChunks.clear();
+    typingRequested = false;
+    typingTimer.stop();
+    upgradeKey.clear();
+    upgradeResponse.clear();
+    upgrading = false;
+    webSocketOpen = false;
+    tlsStarting = false;
+    tlsSessionKey.clear();
+    if (!cursorShape.isNull()) {
+        cursorShape = QImage();
+        cursorHotSpot = QPoint();
+        emit q->cursorShapeChanged(cursorShape, cursorHotSpot);
+    }
+    // The last frame stays visible until the session is resumed or replaced
+    if (settings.sessionResume && !framebufferSize.isEmpty())
+        setStale(true);
+    else
+        dropFramebuffer();
+}
+
+void QVncClient::Private::dropFramebuffer()
+{
+    setStale(false);
+    published = QImage();
+    if (!framebufferSize.isEmpty()) {
+        framebufferSize = QSize(0, 0);
+        emit q->framebufferSizeChanged(0, 0);
+    }
+}
+
+void QVncClient::Private::setStale(bool stale)
+{
+    if (this->stale == stale)
+        return;
+    this->stale = stale;
+    emit q->framebufferStaleChanged(stale);
+}
+
+void QVncClient::Private::reachPhase(HandshakePhase phase)
+{
+    if (!connected || handshakeTimes[phase] >= 0)
+        return;
+    const qreal time = handshakeClock.nsecsElapsed() / 1e6;
+    handshakeTimes[phase] = time;
+    qCDebug(lcVncClient) << "Reached" << phase << "after" << time << "ms";
+    emit q->handshakePhaseReached(phase, time);
+}
+
+/*!
+    \internal
+    Appends \a data to the receive buffer and parses it.
+*/
+void QVncClient::Private::receive(const QByteArray &data)
+{
+    if (webSocket) {
+        receiveWebSocket(data);
+        return;
+    }
+    if (rx.isEmpty())
+        rx = data;
+    else
+        rx.append(data);
+    parse();
+}
+
+/*!
+    \internal
+    Takes the WebSocket frames apart as they arrive, in whatever pieces.
+
+    The payload of binary frames is unmasked while it is copied straight to
+    the end of the receive buffer, so the frames of a message cost no copy
+    over plain RFB. Pings are answered and a Close frame ends the session.
+*/
+void QVncClient::Private::receiveWebSocket(const QByteArray &data)
+{
+    WebSocketFrame &frame = frameIn;
+    const char *in = data.constData();
+    const char *const end = in + data.size();
+    // A frame without payload is complete as soon as its header is, even
+    // when that ends the data
+    while (in < end || (frame.inPayload && frame.remaining == 0)) {
+        if (!frame.inPayload) {
+            while (frame.headerSize < frame.headerNeeded && in < end)
+                frame.header[frame.headerSize++] = uchar(*in++);
+            if (frame.headerSize < frame.headerNeeded)
+                break;
+            const quint8 length = frame.header[1] & 0x7f;
+            frame.headerNeeded = 2 + (length == 126 ? 2 : length == 127 ? 8 : 0) + (frame.header[1] & 0x80 ? 4 : 0);
+            if (frame.headerSize < frame.headerNeeded)
+                continue;
+
+            frame.opcode = frame.header[0] & 0x0f;
+            frame.masked = frame.header[1] & 0x80;
+            const uchar *extended = frame.header + 2;
+            if (length == 126) {
+                frame.remaining = qFromBigEndian<quint16>(extended);
+                extended += 2;
+            } else if (length == 127) {
+                frame.remaining = qFromBigEndian<quint64>(extended);
+                extended += 8;
+            } else {
+                frame.remaining = length;
+            }
+            if (frame.masked)
+                memcpy(frame.key, extended, sizeof(frame.key));
+            frame.keyOffset = 0;
+            frame.headerSize = 0;
+            frame.headerNeeded = 2;
+            frame.inPayload = true;
+            frame.control.clear();
+            // Only binary messages carry RFB
+            const bool control = frame.opcode >= WebSocketClose;
+            const bool known = frame.opcode == WebSocketContinuation || frame.opcode == WebSocketBinary
+                    || frame.opcode == WebSocketClose || frame.opcode == WebSocketPing || frame.opcode == WebSocketPong;
+            if (!known || (control && frame.remaining > 125)) {
+                qCWarning(lcVncClient) << "Unsupported WebSocket frame" << frame.opcode;
+                toClient([this]() { closeConnection(); });
+                webSocket = false;
+                frame = WebSocketFrame();
+                return;
+            }
+        }
+
+        const qsizetype size = qsizetype(qMin<quint64>(frame.remaining, quint64(end - in)));
+        char *out = nullptr;
+        if (frame.opcode < WebSocketClose) {
+            const qsizetype used = rx.size();
+            rx.resize(used + size);
+            out = rx.data() + used;
+        } else {
+            const qsizetype used = frame.control.size();
+            frame.control.resize(used + size);
+            out = frame.control.data() + used;
+        }
+        if (frame.masked)
+            applyWebSocketMask(out, in, size, frame.key, frame.keyOffset);
+        else
+            memcpy(out, in, size);
+        in += size;
+        frame.keyOffset += size;
+        frame.remaining -= size;
+
+        if (frame.remaining == 0) {
+            frame.inPayload = false;
+            if (frame.opcode == WebSocketPing || frame.opcode == WebSocketClose) {
+                toClient([this, opcode = frame.opcode, payload = frame.control]() {
+                    answerWebSocketControl(opcode, payload);
+                });
+            }
+        }
+    }
+    parse();
+}
+
+/*!
+    \internal
+    Parses complete messages from the receive buffer.
+
+    A message that is not complete yet is rolled back to its last commit and
+    parsed again when more data arrives, so the parser never has to wait for
+    the socket.
+*/
+void QVncClient::Private::parse()
+{
+    while (available() > 0) {
+        starved = false;
+        if (!parseMessage() || starved) {
+            rxPos = checkpoint;
+            break;
+        }
+        commit();
+    }
+    starved = false;
+
+    // The application may access a single buffered frame once we return, so
+    // the decoders have to be done by then
+    if (frame == &image) {
+        settle();
+        // Show what a slow update has decoded so far rather than nothing
+        // until its last byte arrives
+        if (rectsLeft > 0 && updateTimer.elapsed() >= progressAt) {
+            flushDamage();
+            progressAt = updateTimer.elapsed() + 40;
+        }
+    }
+
+    // Drop what has been consumed, but avoid moving large partial messages
+    // around on every chunk
+    if (rxPos == rx.size()) {
+        // Keeps an allocation of its own, which native reads fill in place
+        if (rx.isDetached())
+            rx.resize(0);
+        else
+            rx.clear();
+        rxPos = 0;
+        checkpoint = 0;
+    } else if (rxPos > 64 * 1024 && rxPos > rx.size() / 2) {
+        rx.remove(0, rxPos);
+        rxPos = 0;
+        checkpoint = 0;
+    }
+    flush();
+}
+
+/*!
+    \internal
+    Hands the messages queued while parsing to the output buffer of the
+    socket, which lives in the thread of the QVncClient.
+*/
+void QVncClient::Private::flush()
+{
+    if (tx.isEmpty())
+        return;
+    // Each handshake message waits for the server's answer to the previous
+    // one, so they go out without waiting for the event loop
+    toClient([this, data = std::exchange(tx, QByteArray()), urgent = handshaking]() { send(data, urgent); });
+}
+
+void QVncClient::Private::sendInput(const QByteArray &message)
+{
+    send(message, true);
+}
+
+void QVncClient::Private::send(const QByteArray &data, bool urgent)
+{
+    if (!connected || upgrading)
+        return;
+    output.append(data);
+    if (urgent) {
+        // Anything queued before goes along in the same segment
+        writeOutput();
+    } else if (!std::exchange(outputScheduled, true)) {
+        QMetaObject::invokeMethod(q, [this]() {
+            outputScheduled = false;
+            writeOutput();
+        }, Qt::QueuedConnection);
+    }
+}
+
+/*!
+    \internal
+    Writes everything queued in the output buffer with a single write and
+    pushes it to the network without waiting for the event loop.
+*/
+void QVncClient::Private::writeOutput()
+{
+    if (output.isEmpty())
+        return;
+#ifdef USE_EPOLL
+    if (nativeSocket >= 0) {
+        writeNative();
+        return;
+    }
+#endif
+    if (connected && !upgrading) {
+        device->write(webSocketOpen ? webSocketFrame(WebSocketBinary, output) : output);
+        flushDevice();
+    }
+    output.clear();
+}
+
+void QVncClient::Private::flushDevice()
+{
+    if (auto *socket = qobject_cast<QAbstractSocket *>(device))
+        socket->flush();
+    else if (auto *socket = qobject_cast<QLocalSocket *>(device))
+        socket->flush();
+}
+
+/*!
+    \internal
+    Frames \a payload for sending to a WebSocket server, which requires the
+    data of clients to be masked with a random key.
+*/
+QByteArray QVncClient::Private::webSocketFrame(quint8 opcode, const QByteArray &payload)
+{
+    const qsizetype size = payload.size();
+    QByteArray frame;
+    frame.reserve(14 + size);
+    frame.append(char(0x80 | opcode));
+    if (size < 126) {
+        frame.append(char(0x80 | size));
+    } else if (size <= 0xffff) {
+        frame.append(char(0x80 | 126));
+        append(&frame, qToBigEndian<quint16>(quint16(size)));
+    } else {
+        frame.append(char(0x80 | 127));
+        append(&frame, qToBigEndian<quint64>(quint64(size)));
+    }
+    const quint32 random = QRandomGenerator::global()->generate();
+    uchar key[4];
+    memcpy(key, &random, sizeof(key));
+    frame.append(reinterpret_cast<const char *>(key), sizeof(key));
+    const qsizetype used = frame.size();
+    frame.resize(used + size);
+    applyWebSocketMask(frame.data() + used, payload.constData(), size, key, 0);
+    return frame;
+}
+
+/*!
+    \internal
+    Answers a Ping with a Pong, and a Close by closing the connection after
+    echoing the status code, as RFC 6455 asks for.
+*/
+void QVncClient::Private::answerWebSocketControl(quint8 opcode, const QByteArray &payload)
+{
+    if (!webSocketOpen || !device)
+        return;
+    // Whatever is queued goes first
+    writeOutput();
+    if (opcode == WebSocketPing) {
+        device->write(webSocketFrame(WebSocketPong, payload));
+        flushDevice();
+    } else {
+        device->write(webSocketFrame(WebSocketClose, payload.left(2)));
+        webSocketOpen = false;
+        device->close();
+    }
+}
+
+/*!
+    \internal
+    Runs the connection over the connected stream socket \a fd, which the
+    client owns from now on.
+
+    With the epoll transport, the socket is watched by one of the shared
+    epoll threads and read with readv() straight into the receive buffer on
+    the thread that runs the protocol, without the copies and the event loop
+    round trip of QTcpSocket. Writes stay on the thread of the QVncClient.
+    Elsewhere, the socket is wrapped in a QTcpSocket.
+*/
+bool QVncClient::Private::openNative(qintptr fd)
+{
+#ifdef USE_EPOLL
+    const int socket = int(fd);
+    const int flags = ::fcntl(socket, F_GETFL);
+    if (flags < 0 || ::fcntl(socket, F_SETFL, flags | O_NONBLOCK) < 0)
+        return false;
+    sockaddr_storage peer = {};
+    socklen_t peerSize = sizeof(peer);
+    if (::getpeername(socket, reinterpret_cast<sockaddr *>(&peer), &peerSize) < 0)
+        return false;
+    const bool loopback = peer.ss_family == AF_UNIX
+            || QHostAddress(reinterpret_cast<const sockaddr *>(&peer)).isLoopback();
+    // Messages are batched already, so Nagle's algorithm only delays input
+    const int one = 1;
+    ::setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    nativeSocket = socket;
+    writeNotifier = std::make_unique<QSocketNotifier>(socket, QSocketNotifier::Write);
+    writeNotifier->setEnabled(false);
+    connect(writeNotifier.get(), &QSocketNotifier::activated, q, [this]() { writeNative(); });
+    toProtocol([this, socket]() { protocolSocket = socket; });
+    deviceOpened(loopback);
+
+    // Watched only now, so that reads come after the start of the session
+#ifdef USE_IO_URING
+    QVncUringTransport *uring = qEnvironmentVariableIsSet("QT_VNCCLIENT_NO_IO_URING")
+            ? nullptr : QVncUringTransport::instance();
+    if (uring) {
+        uringRegistration = uring->add(socket, [this](const QVncUringTransport::Registration &registration,
+                                                      const QVncUringTransport::Chunk &chunk) {
+            uringReceived(registration, chunk);
+        });
+        return true;
+    }
+#endif
+    nativeRegistration = QVncEpollTransport::instance()->add(socket, [this](const QVncEpollTransport::Registration &registration) {
+        fromTransport([this, registration]() { readNative(registration); });
+    });
+    if (nativeRegistration.id == 0) {
+        deviceClosed();
+        closeNative();
+        return false;
+    }
+    return true;
+#else
+    auto *socket = new QTcpSocket(q);
+    if (!socket->setSocketDescriptor(fd)) {
+        delete socket;
+        return false;
+    }
+    q->setSocket(socket);
+    // Owned by the client until the connection moves on
+    connect(q, &QVncClient::deviceChanged, socket, &QObject::deleteLater);
+    return true;
+#endif
+}
+
+void QVncClient::Private::closeNative()
+{
+#ifdef USE_EPOLL
+    if (nativeSocket < 0)
+        return;
+#ifdef USE_IO_URING
+    if (uringRegistration.id != 0) {
+        QVncUringTransport *uring = QVncUringTransport::instance();
+        uring->remove(std::exchange(uringRegistration, {}));
+        QList<QVncUringTransport::Chunk> chunks;
+        {
+            QMutexLocker locker(&incomingMutex);
+            chunks = std::exchange(incoming, {});
+            incomingScheduled = false;
+        }
+        for (const auto &chunk : std::as_const(chunks))
+            uring->release(chunk);
+    }
+#endif
+    QVncEpollTransport::instance()->remove(std::exchange(nativeRegistration, {}));
+    // Also drops reads queued for the thread of the QVncClient
+    writeNotifier.reset();
+    // Closed behind the reads already queued on the strand
+    toProtocol([this, socket = std::exchange(nativeSocket, -1)]() {
+        protocolSocket = -1;
+        ::close(socket);
+    });
+#endif
+}
+
+#ifdef USE_EPOLL
+void QVncClient::Private::fromTransport(QVncDecodeScheduler::Task task)
+{
+    QMutexLocker locker(&strandMutex);
+    if (strand) {
+        strand->post(std::move(task));
+    } else {
+        // Through toProtocol() in case the protocol moves to the strand
+        // meanwhile; dropped with the notifier when the socket is closed
+        QMetaObject::invokeMethod(writeNotifier.get(), [this, task = std::move(task)]() { toProtocol(task); }, Qt::QueuedConnection);
+    }
+}
+
+/*!
+    \internal
+    Reads from the native socket of \a registration until it is empty or has
+    delivered NativeReadBudget bytes, parses what arrived, and asks for the
+    next notification.
+
+    The data goes into the spare room at the end of the receive buffer, so
+    apart from what spills over into the overflow buffer, it is copied only
+    once, by the kernel.
+*/
+void QVncClient::Private::readNative(const QVncEpollTransport::Registration &registration)
+{
+    // The socket may have been closed while this was queued
+    if (registration.fd != protocolSocket)
+        return;
+
+    qsizetype budget = NativeReadBudget;
+    for (;;) {
+        const qsizetype used = rx.size();
+        rx.resize(used + NativeReadChunk);
+        char overflow[NativeReadOverflow];
+        iovec vectors[2] = {
+            { rx.data() + used, size_t(NativeReadChunk) },
+            { overflow, sizeof(overflow) },
+        };
+        const ssize_t count = ::readv(protocolSocket, vectors, 2);
+        const int error = errno;
+        rx.resize(used + std::clamp<qsizetype>(count, 0, NativeReadChunk));
+        if (count > NativeReadChunk)
+            rx.append(overflow, count - NativeReadChunk);
+
+        if (count < 0 && error == EINTR)
+            continue;
+        if (count == 0 || (count < 0 && error != EAGAIN && error != EWOULDBLOCK)) {
+            parse();
+            toClient([this, socket = protocolSocket]() {
+                if (nativeSocket != socket)
+                    return;
+                deviceClosed();
+                closeNative();
+            });
+            return;
+        }
+        // A short read has most likely emptied the socket
+        if (count < 0 || count < NativeReadChunk + NativeReadOverflow)
+            break;
+        budget -= count;
+        if (budget <= 0)
+            break;
+    }
+    parse();
+    QVncEpollTransport::instance()->rearm(registration);
+}
+
+void QVncClient::Private::writeNative()
+{
+    while (!output.isEmpty()) {
+        const ssize_t count = ::send(nativeSocket, output.constData(), size_t(output.size()), MSG_NOSIGNAL);
+        const int error = errno;
+        if (count >= 0) {
+            output.remove(0, count);
+        } else if (error == EAGAIN || error == EWOULDBLOCK) {
+            break;
+        } else if (error != EINTR) {
+            // The reading side notices that the connection is gone
+            qCWarning(lcVncClient) << "Failed to write to VNC server:" << qt_error_string(error);
+            output.clear();
+        }
+    }
+    // Waits for room in the socket buffer before writing the rest
+    writeNotifier->setEnabled(!output.isEmpty());
+}
+#endif
+
+#ifdef USE_IO_URING
+void QVncClient::Private::uringReceived(const QVncUringTransport::Registration &registration, const QVncUringTransport::Chunk &chunk)
+{
+    bool schedule = false;
+    {
+        QMutexLocker locker(&incomingMutex);
+        incoming.append(chunk);
+        schedule = !std::exchange(incomingScheduled, true);
+    }
+    // One queued call takes all chunks that arrive meanwhile, in order
+    if (schedule)
+        fromTransport([this, registration]() { readUring(registration); });
+}
+
+/*!
+    \internal
+    Parses the chunks received for the socket of \a registration.
+
+    When no partial message is pending, the parser reads a chunk right
+    where the kernel put it and only the incomplete message at its end, if
+    any, is copied before the buffer goes back to the kernel. Otherwise the
+    chunk is appended to the receive buffer.
+*/
+void QVncClient::Private::readUring(const QVncUringTransport::Registration &registration)
+{
+    QList<QVncUringTransport::Chunk> chunks;
+    {
+        QMutexLocker locker(&incomingMutex);
+        chunks = std::exchange(incoming, {});
+        incomingScheduled = false;
+    }
+
+    QVncUringTransport *uring = QVncUringTransport::instance();
+    for (const auto &chunk : std::as_const(chunks)) {
+        // The socket may have been closed while this was queued
+        if (registration.fd != protocolSocket) {
+            uring->release(chunk);
+            continue;
+        }
+        if (chunk.size <= 0) {
+            uring->release(chunk);
+            toClient([this, socket = protocolSocket]() {
+                if (nativeSocket != socket)
+                    return;
+                deviceClosed();
+                closeNative();
+            });
+            // Anything after the end is dropped
+            protocolSocket = -1;
+            continue;
+        }
+
+        if (rx.isEmpty()) {
+            rx = QByteArray::fromRawData(chunk.data, chunk.size);
+            parse();
+            if (!rx.isEmpty() && !rx.isDetached()) {
+                rx = QByteArray(rx.constData() + rxPos, rx.size() - rxPos);
+                rxPos = 0;
+                checkpoint = 0;
+            }
+        } else {
+            rx.append(chunk.data, chunk.size);
+            parse();
+        }
+        uring->release(chunk);
+    }
+}
+#endif
+
+/*!
+    \internal
+    Drops all link measurements and restarts the clock, reporting the link
+    properties as unknown.
+*/
+void QVncClient::Private::resetLinkStatistics()
+{
+    link.clock.start();
+    link.throughput = 0;
+    link.fenceRoundTrip = -1;
+    link.updateRoundTrips.clear();
+    link.requestSentAt = -1;
+    link.fenceSupported = false;
+    link.fenceSentAt = -1;
+    link.lastFenceAt = -1;
+    publishLinkStatistics();
+}
+
+/*!
+    \internal
+    Main state machine dispatcher for handling incoming socket data based on the current protocol state.
+*/
+bool QVncClient::Private::parseMessage()
+{
+    switch (state) {
+    case ProtocolVersionState:
+        return parseProtocolVersion();
+    case SecurityState:
+        return parseSecurity();
+    case SecurityResultState:
+        return parseSecurityResult();
+    case VeNCryptVersionState:
+        return parseVeNCryptVersion();
+    case VeNCryptSubtypeState:
+        return parseVeNCryptSubtypes();
+    case VeNCryptAckState:
+        return parseVeNCryptAck();
+    case TlsHandshakeState:
+        // Nothing but the handshake goes over the wire until it is done
+        return false;
+    case ServerInitState:
+        return parserServerInit();
+    case WaitingState:
+        return parseServerMessages();
+    default:
+        qCWarning(lcVncClient) << "Unknown protocol state:" << Qt::hex << state;
+        rxPos = rx.size();
+        return true;
+    }
+}
+
+#ifdef USE_ZLIB
+/*!
+    \internal
+    Handles Tight-encoded rectangle data.
+    
+    \param rect The rectangle dimensions.
+    
+    Tight encoding is a complex encoding that can use zlib compression, JPEG compression,
+    or various subencodings for efficient representation of framebuffer data.
+*/
+void QVncClient::Private::handleTightEncoding(const Rectangle &rect)
+{
+    // Continue a rectangle whose data is inflated as it arrives
+    if (inflating) {
+        streamZlibRect(&Private::decodeTightRows);
+        return;
+    }
+
+    // Read the compression control byte
+    quint8 compControl = 0;
+    read(&compControl);
+    if (starved)
+        return;
+    
+    // Bits 0-3 ask us to reset the corresponding zlib streams, which has to
+    // happen in order with the rectangles using them
+    const quint8 resets = compControl & TightStreams;
+    
+    // Bits 4-7 select the compression type
+    const int compType = compControl >> 4;
+    const int pixelSize = tightPixelSize();
+    
+    // Check for fill compression (a single TPIXEL for the whole rectangle)
+    if (compType == 0x08) {
+        uchar pixel[4];
+        if (!readData(reinterpret_cast<char*>(pixel), pixelSize))
+            return;
+        const QRgb color = tightColor(pixel, pixelSize);
+        defer(QRect(), resets, [this, rect, resets, color]() {
+            resetTightStreams(resets);
+            fillRect(QRect(rect.x, rect.y, rect.w, rect.h), color);
+        });
+        return;
+    }
+    
+    // Check for JPEG compression
+    if (compType == 0x09) {
+        // Read the JPEG data length and data
+        int length = 0;
+        if (!readTightLength(&length))
+            return;
+        const QByteArray jpegData = readBytes(length);
+        if (starved)
+            return;
+        if (resumePass == ResumeLowQuality)
+            resumeLossy = true;
+        
+        defer(QRect(), resets, [this, rect, resets, jpegData]() {
+            resetTightStreams(resets);
+            // If JPEG handling fails, request a new update
+            if (!decodeTightJpeg(rect, jpegData))
+                decodeFailed = true;
+        });
+        return;
+    }
+
+    if (compType > 0x09) {
+        qCWarning(lcVncClient) << "Invalid Tight compression type" << compType;
+        decodeFailed = true;
+        return;
+    }
+    
+    // Basic compression, bits 4-5 carry the stream id and bit 6 says a
+    // filter id follows
+    const int streamId = compType & 0x03;
+    ZlibRect z;
+    if (compType & 0x04)
+        read(&z.filter);
+    if (starved)
+        return;
+
+    switch (z.filter) {
+    case TightCopyFilter:
+        z.rowBytes = qsizetype(rect.w) * pixelSize;
+        break;
+    case TightPaletteFilter: {
+        quint8 colors = 0;
+        read(&colors);
+        if (starved)
+            return;
+        const qsizetype count = colors + 1;
+        const QByteArray pixels = readBytes(count * pixelSize);
+        if (starved)
+            return;
+        for (qsizetype i = 0; i < count; i++)
+            z.palette.append(tightColor(reinterpret_cast<const uchar *>(pixels.constData()) + i * pixelSize, pixelSize));
+        // Two colours take a bit per pixel, more a byte
+        z.rowBytes = count == 2 ? (rect.w + 7) / 8 : rect.w;
+        break;
+    }
+    case TightGradientFilter:
+        z.rowBytes = qsizetype(rect.w) * pixelSize;
+        z.previous.fill(0, rect.w * 3);
+        break;
+    default:
+        qCWarning(lcVncClient) << "Invalid Tight filter" << z.filter;
+        decodeFailed = true;
+        return;
+    }
+
+    // Less than 12 bytes of data are sent as they are
+    const qsizetype dataSize = z.rowBytes * rect.h;
+    if (dataSize < 12) {
+        z.in.window = readBytes(dataSize);
+        if (starved)
+            return;
+        deferZlibRect(std::move(z), QByteArray(), -1, resets, &Private::decodeTightRows);
+        return;
+    }
+
+    int length = 0;
+    if (!readTightLength(&length))
+        return;
+
+    // A rectangle that has arrived completely is decoded concurrently with
+    // the others of its update
+    if (available() >= length) {
+        const QByteArray compressedData = readBytes(length);
+        deferZlibRect(std::move(z), compressedData, streamId, resets, &Private::decodeTightRows);
+        return;
+    }
+
+    // Otherwise it is inflated as it arrives, after the decoders still
+    // using its stream or area
+    commit();
+    settle(QRect(rect.x, rect.y, rect.w, rect.h), resets | (1 << streamId));
+    resetTightStreams(resets);
+    z.in.stream = zlibStream(streamId);
+    z.in.remaining = length;
+    zlibRect = std::move(z);
+    inflating = true;
+    streamZlibRect(&Private::decodeTightRows);
+}
+
+/*!
+    \internal
+    Ends the Tight zlib streams whose bits are set in \a streams, so that
+    they start over with the next rectangle using them.
+*/
+void QVncClient::Private::resetTightStreams(quint8 streams)
+{
+    for (int i = 0; i < 4; i++) {
+        if ((streams & (1 << i)) && tightData->zlibStreamActive[i]) {
+            inflateEnd(&tightData->zlibStream[i]);
+            tightData->zlibStreamActive[i] = false;
+        }
+    }
+}
+
+/*!
+    \internal
+    Returns zlib stream \a index, initializing it first if it is not active.
+*/
+z_stream *QVncClient::Private::zlibStream(int index)
+{
+    z_stream *stream = &tightData->zlibStream[index];
+    if (!tightData->zlibStreamActive[index]) {
+        stream->zalloc = Z_NULL;
+        stream->zfree = Z_NULL;
+        stream->opaque = Z_NULL;
+        stream->next_in = Z_NULL;
+        stream->avail_in = 0;
+        inflateInit(stream);
+        tightData->zlibStreamActive[index] = true;
+    }
+    return stream;
+}
+
+/*!
+    \internal
+    Returns the size of a TPIXEL. Pixels of a 24 bit deep true colour
+    format with 8 bits per channel are sent as three bytes, red first.
+*/
+int QVncClient::Private::tightPixelSize() const
+{
+    if (pixelFormat.bitsPerPixel == 32 && pixelFormat.depth == 24 && pixelFormat.trueColourFlag
+            && pixelFormat.redMax == 255 && pixelFormat.greenMax == 255 && pixelFormat.blueMax == 255)
+        return 3;
+    return pixelFormat.bitsPerPixel / 8;
+}
+
+/*!
+    \internal
+    Converts the TPIXEL of \a size bytes at \a data to a colour.
+*/
+QRgb QVncClient::Private::tightColor(const uchar *data, int size) const
+{
+    if (size == 3)
+        return qRgb(data[0], data[1], data[2]);
+    quint32 value = 0;
+    for (int i = 0; i < size; i++)
+        value |= quint32(data[i]) << (8 * i);
+    return toRgb(value);
+}
+
+/*!
+    \internal
+    Decodes the rows of a Tight rectangle using basic compression from the
+    data inflated by \a z, continuing at row \c{z->next}.
+
+    Returns false if the data ran out before the last row.
+*/
+bool QVncClient::Private::decodeTightRows(const Rectangle &rect, ZlibRect *z)
+{
+    Inflater &in = z->in;
+    const int pixelSize = tightPixelSize();
+
+    // Gradient filter predictions work on the channels of the pixels
+    const int maxes[3] = {
+        pixelSize == 3 ? 255 : int(pixelFormat.redMax),
+        pixelSize == 3 ? 255 : int(pixelFormat.greenMax),
+        pixelSize == 3 ? 255 : int(pixelFormat.blueMax),
+    };
+    const int shifts[3] = { pixelFormat.redShift, pixelFormat.greenShift, pixelFormat.blueShift };
+    QList<int> current;
+    if (z->filter == TightGradientFilter)
+        current.resize(rect.w * 3);
+
+    for (; z->next < rect.h; z->next++) {
+        if (!in.need(z->rowBytes))
+            return false;
+        const uchar *row = in.data();
+        const int y = rect.y + z->next;
+
+        switch (z->filter) {
+        case TightCopyFilter:
+            for (int x = 0; x < rect.w; x++)
+                setPixel(rect.x + x, y, tightColor(row + x * pixelSize, pixelSize));
+            break;
+        case TightPaletteFilter:
+            for (int x = 0; x < rect.w; x++) {
+                const int index = z->palette.size() == 2 ? (row[x / 8] >> (7 - x % 8)) & 1 : row[x];
+                if (index >= z->palette.size()) {
+                    qCWarning(lcVncClient) << "Tight palette index out of range";
+                    in.failed = true;
+                    return false;
+                }
+                setPixel(rect.x + x, y, z->palette.at(index));
+            }
+            break;
+        case TightGradientFilter:
+            for (int x = 0; x < rect.w; x++) {
+                const uchar *pixel = row + x * pixelSize;
+                quint32 value = 0;
+                if (pixelSize != 3) {
+                    for (int i = 0; i < pixelSize; i++)
+                        value |= quint32(pixel[i]) << (8 * i);
+                }
+                for (int c = 0; c < 3; c++) {
+                    const int delta = pixelSize == 3 ? pixel[c] : int((value >> shifts[c]) & maxes[c]);
+                    const int left = x > 0 ? current.at((x - 1) * 3 + c) : 0;
+                    const int up = z->previous.at(x * 3 + c);
+                    const int upLeft = x > 0 ? z->previous.at((x - 1) * 3 + c) : 0;
+                    const int estimate = qBound(0, left + up - upLeft, maxes[c]);
+                    current[x * 3 + c] = (estimate + delta) & maxes[c];
+                }
+                setPixel(rect.x + x, y, qRgb(current.at(x * 3), current.at(x * 3 + 1), current.at(x * 3 + 2)));
+            }
+            z->previous.swap(current);
+            break;
+        }
+        in.consume(z->rowBytes);
+        z->rowsDone = z->next + 1;
+    }
+    return true;
+}
+
+/*!
+    \internal
+    Makes sure the window holds at least \a size bytes past the consumed
+    ones, inflating more of the input if needed.
+
+    Returns false if the input at hand is not enough yet or the data turned
+    out to be corrupt, in which case \c failed is set.
+*/
+bool QVncClient::Private::Inflater::need(qsizetype size)
+{
+    if (window.size() - pos >= size)
+        return true;
+    if (failed)
+        return false;
+
+    // Drop the consumed bytes so the window does not grow with the rectangle
+    if (pos > 0) {
+        window.remove(0, pos);
+        pos = 0;
+    }
+    while (window.size() < size) {
+        if (!stream || remaining == 0) {
+            qCWarning(lcVncClient) << "Compressed data ended early";
+            failed = true;
+            return false;
+        }
+        if (inputSize == 0)
+            return false;
+        if (!inflateSome(qMax<qsizetype>(size - window.size(), 16384)))
+            return false;
+    }
+    return true;
+}
+
+/*!
+    \internal
+    Feeds the remaining input of the payload to the stream, so that its
+    state matches the server's for the next rectangle.
+
+    Returns true once the whole payload has gone through.
+*/
+bool QVncClient::Private::Inflater::finish()
+{
+    while (!failed && remaining > 0 && inputSize > 0) {
+        // The end of a payload holds little more than the flush marker
+        window.resize(0);
+        pos = 0;
+        inflateSome(4096);
+    }
+    return !failed && remaining == 0;
+}
+
+/*!
+    \internal
+    Inflates the input at hand into up to \a room more bytes of the window.
+*/
+bool QVncClient::Private::Inflater::inflateSome(qsizetype room)
+{
+    const qsizetype have = window.size();
+    window.resize(have + room);
+    stream->next_in = const_cast<Bytef *>(input);
+    stream->avail_in = uInt(inputSize);
+    stream->next_out = reinterpret_cast<Bytef *>(window.data() + have);
+    stream->avail_out = uInt(room);
+
+    const int result = inflate(stream, Z_SYNC_FLUSH);
+    const qint64 used = inputSize - stream->avail_in;
+    input += used;
+    inputSize -= used;
+    remaining -= used;
+    window.resize(have + room - stream->avail_out);
+
+    if ((result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR)
+            || (used == 0 && window.size() == have)) {
+        qCWarning(lcVncClient) << "Failed to inflate compressed data:" << result;
+        failed = true;
+        return false;
+    }
+    return true;
+}
+
+/*!
+    \internal
+    Hands the part of the current rectangle's payload that has been received
+    to \a decode and consumes what the stream took of it.
+
+    The area decoded so far is published with the next progressive update.
+*/
+void QVncClient::Private::streamZlibRect(ZlibDecoder decode)
+{
+    Inflater &in = zlibRect.in;
+    in.input = reinterpret_cast<const uchar *>(rx.constData()) + rxPos;
+    in.inputSize = qMin<qint64>(in.remaining, available());
+    const qint64 inputSize = in.inputSize;
+    const int rowsDone = zlibRect.rowsDone;
+
+    const bool done = (this->*decode)(rectangle, &zlibRect) && in.finish();
+    rxPos += inputSize - in.inputSize;
+    if (zlibRect.rowsDone > rowsDone)
+        addDamage(QRect(rectangle.x, rectangle.y + rowsDone, rectangle.w, zlibRect.rowsDone - rowsDone));
+
+    if (in.failed) {
+        // Skip the rest of the payload, the next update repairs the area
+        const qint64 skip = qMin<qint64>(in.remaining, available());
+        rxPos += skip;
+        in.remaining -= skip;
+        decodeFailed = true;
+    }
+    commit();
+
+    if (in.remaining > 0 || (!done && !in.failed)) {
+        starved = true;
+        return;
+    }
+    inflating = false;
+    zlibRect = ZlibRect();
+}
+
+/*!
+    \internal
+    Decodes a rectangle whose compressed \a payload has been read completely
+    on the decode threads, with zlib stream \a streamIndex after resetting
+    the Tight streams in \a resets. A \a streamIndex of -1 means the data
+    is already in the window of \a z.
+*/
+void QVncClient::Private::deferZlibRect(ZlibRect z, const QByteArray &payload, int streamIndex, quint8 resets, ZlibDecoder decode)
+{
+    const quint8 streams = resets | (streamIndex >= 0 ? 1 << streamIndex : 0);
+    defer(QRect(), streams, [this, rect = rectangle, z = std::move(z), payload, streamIndex, resets, decode]() mutable {
+        resetTightStreams(resets);
+        if (streamIndex >= 0) {
+            z.in.stream = zlibStream(streamIndex);
+            z.in.input = reinterpret_cast<const uchar *>(payload.constData());
+            z.in.inputSize = payload.size();
+            z.in.remaining = payload.size();
+        }
+        if (!(this->*decode)(rect, &z) || !z.in.finish())
+            decodeFailed = true;
+    });
+}
+#endif
+
+/*!
+    \internal
+    Decodes a JPEG-compressed rectangle in Tight encoding.
+    
+    \param rect The rectangle dimensions.
+    \param jpegData The JPEG data.
+    \return true if successful, false if there was an error.
+*/
+bool QVncClient::Private::decodeTightJpeg(const Rectangle &rect, const QByteArray &jpegData)
+{
+    // Decode JPEG image using Qt
+    QImage jpegImage;
+    if (!jpegImage.loadFromData(jpegData, "JPEG")) {
+        qCWarning(lcVncClient) << "Failed to decode JPEG data for Tight encoding";
+        return false;
+    }
+    
+    // Grayscale JPEGs (SubsamplingGray) decode to Format_Grayscale8 and
+    // chroma subsampled ones may come back as RGB32, so expand to our format
+    if (jpegImage.format() != frame->format())
+        jpegImage.convertTo(frame->format());
+    
+    // Copy the JPEG image to the framebuffer line by line
+    const QRect area = QRect(rect.x, rect.y, qMin<int>(rect.w, jpegImage.width()), qMin<int>(rect.h, jpegImage.height())) & frame->rect();
+    const int bytesPerPixel = frame->depth() / 8;
+    for (int y = area.top(); y <= area.bottom(); y++) {
+        memcpy(frameBits + y * frameBytesPerLine + area.left() * bytesPerPixel,
+               jpegImage.constScanLine(y - rect.y) + (area.left() - rect.x) * bytesPerPixel,
+               area.width() * bytesPerPixel);
+    }
+    
+    return true;
+}
+
+/*!
+    \internal
+    Reads a Tight compact length (1 to 3 bytes, 7 bits each, little end first).
+    
+    \param length Receives the decoded length.
+    \return true if successful, false if the data has not arrived yet.
+*/
+bool QVncClient::Private::readTightLength(int *length)
+{
+    *length = 0;
+    for (int i = 0; i < 3; i++) {
+        quint8 byte = 0;
+        if (!readData(reinterpret_cast<char*>(&byte), 1))
+            return false;
+        if (i == 2) {
+            *length |= byte << 14;
+            break;
+        }
+        *length |= (byte & 0x7f) << (7 * i);
+        if (!(byte & 0x80))
+            break;
+    }
+    return true;
+}
+
+/*!
+    \internal
+    Parses the RFB protocol version string sent by the server.
+    
+    The server sends a string like "RFB 003.008\n" indicating its supported protocol version.
+    This method reads this string and sets the appropriate protocol version enum value.
+*/
+bool QVncClient::Private::parseProtocolVersion()
+{
+    const auto value = readBytes(12);
+    if (starved)
+        return false;
+    if (value == "RFB 003.003\n")
+        protocolVersionChanged(ProtocolVersion33);
+    else if (value == "RFB 003.007\n")
+        protocolVersionChanged(ProtocolVersion37);
+    else if (value == "RFB 003.008\n")
+        protocolVersionChanged(ProtocolVersion38);
+    else
+        qCWarning(lcVncClient) << "Unsupported protocol version:" << value;
+    return true;
+}
+
+/*!
+    \internal
+    Handles protocol version changes by sending the appropriate response to the server.
+    
+    \param protocolVersion The new protocol version.
+*/
+void QVncClient::Private::protocolVersionChanged(ProtocolVersion protocolVersion)
+{
+    qCDebug(lcVncClient) << "Protocol version changed to:" << protocolVersion;
+    version = protocolVersion;
+    toClient([this, protocolVersion]() {
+        q->setProtocolVersion(protocolVersion);
+        reachPhase(ProtocolVersionPhase);
+    });
+    switch (protocolVersion) {
+    case ProtocolVersion33:
+        write("RFB 003.003\n");
+        state = SecurityState;
+        break;
+    case ProtocolVersion37:
+        write("RFB 003.007\n");
+        state = SecurityState;
+        break;
+    case ProtocolVersion38:
+        write("RFB 003.008\n");
+        state = SecurityState;
+        break;
+    default:
+        break;
+    }
+}
+
+/*!
+    \internal
+    Dispatches to the appropriate security parsing method based on the protocol version.
+*/
+bool QVncClient::Private::parseSecurity()
+{
+    switch (version) {
+    case ProtocolVersion33:
+        return parseSecurity33();
+    case ProtocolVersion37:
+    case ProtocolVersion38:
+        return parseSecurity37();
+    default:
+        return true;
+    }
+}
+
+/*!
+    \internal
+    Parses security data for protocol version 3.3.
+    
+    In RFB 3.3, the server directly sends a 32-bit security type value.
+*/
+bool QVncClient::Private::parseSecurity33()
+{
+    quint32_be data;
+    read(&data);
+    if (starved)
+        return false;
+    securityTypeChanged(static_cast<SecurityType>(static_cast<unsigned int>(data)));
+    return true;
+}
+
+/*!
+    \internal
+    Parses security data for protocol version 3.7 and later.
+    
+    In RFB 3.7+, the server sends a list of supported security types, and the client
+    chooses one.
+*/
+bool QVncClient::Private::parseSecurity37()
+{
+    quint8 numberOfSecurityTypes = 0;
+    read(&numberOfSecurityTypes);
+    if (starved)
+        return false;
+    if (numberOfSecurityTypes == 0)
+        return parseSecurityReason();
+    QList<quint8> securityTypes;
+    for (unsigned char i = 0; i < numberOfSecurityTypes; i++) {
+        quint8 securityType = 0;
+        read(&securityType);
+        securityTypes.append(securityType);
+    }
+    if (starved)
+        return false;
+    if (securityTypes.contains(SecurityTypeNone))
+        securityTypeChanged(SecurityTypeNone);
+    else if (securityTypes.contains(SecurityTypeVeNCrypt))
+        securityTypeChanged(SecurityTypeVeNCrypt);
+    else if (securityTypes.contains(SecurityTypeTLS))
+        securityTypeChanged(SecurityTypeTLS);
+    else
+        securityTypeChanged(SecurityTypeInvalid);
+    return !starved;
+}
+
+/*!
+    \internal
+    Handles security type changes by sending the appropriate response to the server.
+    
+    \param securityType The new security type.
+*/
+void QVncClient::Private::securityTypeChanged(SecurityType securityType)
+{
+    qCDebug(lcVncClient) << "Security type changed to:" << securityType;
+    toClient([this, securityType]() {
+        q->setSecurityType(securityType);
+        if (securityType > SecurityTypeInvalid)
+            reachPhase(SecurityPhase);
+    });
+    switch (securityType) {
+    case SecurityTypeUnknwon:
+        break;
+    case SecurityTypeInvalid:
+        parseSecurityReason();
+        break;
+    case SecurityTypeNone:
+        switch (version) {
+        case ProtocolVersion33:
+            state = ClientInitState;
+            clientInit();
+            break;
+        case ProtocolVersion37:
+            state = ClientInitState;
+            write(securityType);
+            clientInit();
+            break;
+        case ProtocolVersion38:
+            // ClientInit does not depend on the result, which saves a
+            // round trip
+            write(securityType);
+            clientInit();
+            state = SecurityResultState;
+            break;
+        default:
+            break;
+        }
+        break;
+    case SecurityTypeVeNCrypt:
+        // RFB 3.3 servers pick the type themselves
+        if (version != ProtocolVersion33)
+            write(securityType);
+        state = VeNCryptVersionState;
+        break;
+    case SecurityTypeTLS:
+        // Anonymous TLS, inside which the security types are negotiated
+        // again
+        if (version != ProtocolVersion33)
+            write(securityType);
+        state = TlsHandshakeState;
+        tlsNext = SecurityState;
+        // The chosen type has to reach the server ahead of the ClientHello
+        flush();
+        toClient([this]() { startTls(true); });
+        break;
+    default:
+        qCWarning(lcVncClient) << "Security type" << securityType << "not supported";
+        break;
+    }
+}
+
+/*!
+    \internal
+    Parses the result of the security handshake, which RFB 3.8 servers
+    explain if it failed.
+*/
+bool QVncClient::Private::parseSecurityResult()
+{
+    quint32_be result;
+    read(&result);
+    if (starved)
+        return false;
+    if (result == 0) {
+        // ClientInit went out with the last security message
+        state = ServerInitState;
+        toClient([this]() { reachPhase(SecurityResultPhase); });
+        return true;
+    }
+    if (version == ProtocolVersion38) {
+        if (!parseSecurityReason())
+            return false;
+    } else {
+        qCWarning(lcVncClient) << "Security handshake failed";
+    }
+    toClient([this]() { closeConnection(); });
+    return true;
+}
+
+/*!
+    \internal
+    Parses the VeNCrypt version of the server and answers with version 0.2,
+    the one all current servers speak.
+*/
+bool QVncClient::Private::parseVeNCryptVersion()
+{
+    quint8 major = 0;
+    read(&major);
+    quint8 minor = 0;
+    read(&minor);
+    if (starved)
+        return false;
+    if (major != 0 || minor < 2) {
+        qCWarning(lcVncClient) << "Unsupported VeNCrypt version" << major << minor;
+        toClient([this]() { closeConnection(); });
+        return true;
+    }
+    write(quint8(0));
+    write(quint8(2));
+    state = VeNCryptSubtypeState;
+    return true;
+}
+
+/*!
+    \internal
+    Parses the VeNCrypt subtypes of the server and picks one that needs no
+    password, preferring a checked server certificate over anonymous TLS.
+*/
+bool QVncClient::Private::parseVeNCryptSubtypes()
+{
+    quint8 status = 0;
+    read(&status);
+    if (starved)
+        return false;
+    if (status != 0) {
+        qCWarning(lcVncClient) << "Server refused VeNCrypt version 0.2";
+        toClient([this]() { closeConnection(); });
+        return true;
+    }
+    quint8 count = 0;
+    read(&count);
+    QList<quint32> subtypes;
+    for (int i = 0; i < count; i++) {
+        quint32_be subtype;
+        read(&subtype);
+        subtypes.append(subtype);
+    }
+    if (starved)
+        return false;
+
+    quint32 subtype = 0;
+    for (const quint32 candidate : { quint32(VeNCryptX509None), quint32(VeNCryptTLSNone) }) {
+        if (subtypes.contains(candidate)) {
+            subtype = candidate;
+            break;
+        }
+    }
+    if (subtype == 0) {
+        qCWarning(lcVncClient) << "No supported VeNCrypt subtype in" << subtypes;
+        toClient([this]() { closeConnection(); });
+        return true;
+    }
+    write(quint32_be(subtype));
+    veNCryptSubtype = subtype;
+    state = VeNCryptAckState;
+    // The subtypes without a password end like security type None
+    tlsNext = SecurityResultState;
+    return true;
+}
+
+/*!
+    \internal
+    Parses whether the server accepted the chosen subtype and starts TLS if
+    it did.
+*/
+bool QVncClient::Private::parseVeNCryptAck()
+{
+    quint8 accepted = 0;
+    read(&accepted);
+    if (starved)
+        return false;
+    if (accepted != 1) {
+        qCWarning(lcVncClient) << "Server refused the VeNCrypt subtype";
+        toClient([this]() { closeConnection(); });
+        return true;
+    }
+    state = TlsHandshakeState;
+    toClient([this, anonymous = veNCryptSubtype == VeNCryptTLSNone]() { startTls(anonymous); });
+    return true;
+}
+
+void QVncClient::Private::tlsEstablished()
+{
+    if (state != TlsHandshakeState)
+        return;
+    if (tlsNext == SecurityResultState) {
+        // The subtypes without a password have nothing more to say than
+        // ClientInit, which need not wait for the result
+        clientInit();
+    }
+    state = tlsNext;
+    parse();
+}
+
+/*!
+    \internal
+    Parses and logs the reason for a security failure sent by the server.
+*/
+bool QVncClient::Private::parseSecurityReason()
+{
+    quint32_be reasonLength;
+    read(&reasonLength);
+    const QByteArray reason = readBytes(reasonLength);
+    if (starved)
+        return false;
+    qCWarning(lcVncClient) << "Security failure reason:" << reason;
+    return true;
+}
+
+/*!
+    \internal
+    Sends the client initialization message to the server.
+    
+    This message indicates whether the connection will be shared with other clients.
+*/
+void QVncClient::Private::clientInit()
+{
+    quint8 sharedFlag = 1;
+    write(sharedFlag);
+    state = ServerInitState;
+}
+
+/*!
+    \internal
+    Parses the server initialization message containing framebuffer dimensions,
+    pixel format, and the server name.
+*/
+bool QVncClient::Private::parserServerInit()
+{
+    quint16_be framebufferWidth;
+    read(&framebufferWidth);
+    quint16_be framebufferHeight;
+    read(&framebufferHeight);
+    PixelFormat format;
+    read(&format);
+    quint32_be nameLength;
+    read(&nameLength);
+    const auto nameString = readBytes(nameLength);
+    if (starved)
+        return false;
+
+    qCDebug(lcVncClient) << "Framebuffer size:" << framebufferWidth << "x" << framebufferHeight;
+    frameBufferWidth = framebufferWidth;
+    frameBufferHeight = framebufferHeight;
+
+    // The same desktop again, whose last frame is still on screen
+    const bool resume = std::exchange(resumable, false)
+            && image.size() == QSize(frameBufferWidth, frameBufferHeight) && serverName == nameString;
+    serverName = nameString;
+    toClient([this]() { reachPhase(ServerInitPhase); });
+    backBuffers.clear();
+    frame = &image;
+    if (resume) {
+        qCDebug(lcVncClient) << "Resuming the previous session";
+        resumePass = ResumeLowQuality;
+        resumeLossy = false;
+    } else {
+        QImage initial(framebufferWidth, framebufferHeight, QImage::Format_ARGB32);
+        initial.fill(Qt::white);
+        {
+            QMutexLocker locker(&imageMutex);
+            image = initial;
+        }
+        toClient([this, initial, width = frameBufferWidth, height = frameBufferHeight]() {
+            setStale(false);
+            framebufferSize = QSize(width, height);
+            if (isThreaded())
+                published = initial;
+            emit q->framebufferSizeChanged(width, height);
+        });
+    }
+
+    pixelFormat = format;
+    qCDebug(lcVncClient) << "Pixel format:";
+    qCDebug(lcVncClient) << "  Bits per pixel:" << pixelFormat.bitsPerPixel;
+    qCDebug(lcVncClient) << "  Depth:" << pixelFormat.depth;
+    qCDebug(lcVncClient) << "  Big endian:" << pixelFormat.bigEndianFlag;
+    qCDebug(lcVncClient) << "  True color:" << pixelFormat.trueColourFlag;
+    qCDebug(lcVncClient) << "  Red:" << pixelFormat.redMax << pixelFormat.redShift;
+    qCDebug(lcVncClient) << "  Green:" << pixelFormat.greenMax << pixelFormat.greenShift;
+    qCDebug(lcVncClient) << "  Blue:" << pixelFormat.blueMax << pixelFormat.blueShift;
+
+    qCDebug(lcVncClient) << "Server name:" << nameString;
+    state = WaitingState;
+
+    resetStatistics();
+    setPixelFormat();
+    
+    setEncodings(encodings());
+    framebufferUpdateRequest(false);
+    return true;
+}
+
+/*!
+    \internal
+    Sends a SetPixelFormat message to the server.
+    
+    This message configures the pixel format that the server should use when
+    sending framebuffer updates.
+*/
+void QVncClient::Private::setPixelFormat()
+{
+    write(SetPixelFormat);
+    write("   "); // padding
+    write(pixelFormat);
+}
+
+/*!
+    \internal
+    Sends a SetEncodings message to the server.
     
+    \param encodings List of encoding types the client supports, in order of preference.
+*/
+void QVncClient::Private::setEncodings(const QList<qint32> &encodings)
+{
+    write(SetEncodings);
+    write(" "); // padding
+    write(quint16_be(encodings.length()));
+    for (const auto encoding : encodings)
+        write(qint32_be(encoding));
+}
+
+/*!
+    \internal
+    Returns the encodings supported by the client followed by the
+    pseudo-encodings for the configured quality and compression levels.
+    Raw leads the list on loopback and comes last otherwise.
+*/
+QList<qint32> QVncClient::Private::encodings() const
+{
+    // Set supported encodings based on available libraries. Raw only beats
+    // the others when the link is as fast as the local host.
+    QList<qint32> encodings {
+        Hextile,
 #ifdef USE_ZLIB
-    /*!
-        \internal
-        \brief Handles tight-encoded rectangle data.
-        \param rect The rectangle dimensions.
-        
-        Processes Tight-encoded data for the specified rectangle, which may use
-        zlib compression, JPEG compression, or various other subencodings.
-    */
-    void handleTightEncoding(const Rectangle &rect);
+        ZRLE,
+        Tight,
 #endif
-    
-    /*!
-        \internal
-        \brief Processes a JPEG-compressed rectangle in Tight encoding.
-        \param rect The rectangle dimensions.
-        \param dataLength The length of the JPEG data in bytes.
-        \return true if successful, false if there was an error.
-        
-        Reads and decompresses JPEG image data for a rectangle in Tight encoding.
-    */
-    bool handleTightJpeg(const Rectangle &rect, int dataLength);
-    
+    };
+    if (loopback)
+        encodings.prepend(RawEncoding);
+    else
+        encodings.append(RawEncoding);
+    if (session.adaptiveEncoding && !statistics.order.isEmpty())
+        encodings = statistics.order;
 #ifdef USE_ZLIB
-    /*!
-        \internal
-        \brief Decompresses zlib data for Tight encoding.
-        \param rect The rectangle dimensions.
-        \param stream The zlib stream to use.
-        \param data The compressed data.
-        \param dataLength The length of the compressed data.
-        \param expectedBytes The expected size of the decompressed data.
-        \return The decompressed data, or an empty array on error.
-        
-        Decompresses zlib-compressed data for a Tight-encoded rectangle.
-    */
-    QByteArray decompressTightData(int streamId, const QByteArray &data, int expectedBytes);
+    // Only Tight can send the coarse first refresh of a resumed session
+    if (resumePass == ResumeLowQuality) {
+        encodings.removeOne(Tight);
+        encodings.prepend(Tight);
+    }
 #endif
-
-    /*!
-        \internal
-        \brief Handles ZRLE-encoded rectangle data.
-        \param rect The rectangle dimensions.
-        
-        Processes ZRLE (Zlib Run-Length Encoding) data for the specified rectangle.
-    */
-    void handleZRLEEncoding(const Rectangle &rect);
-
-private:
-    QVncClient *q;                              ///< Pointer to the public class
-    QTcpSocket *prev = nullptr;                 ///< Previous socket for cleanup
-    HandshakingState state = ProtocolVersionState; ///< Current protocol state
-    PixelFormat pixelFormat;                    ///< Current pixel format
-    QMap<int, quint32> keyMap;                  ///< Map from Qt keys to VNC key codes
-public:
-    QTcpSocket *socket = nullptr;               ///< Socket for VNC communication
+    encodings.append(CopyRect);
+    encodings.append(FencePseudoEncoding);
+    encodings.append(QemuExtendedKeyEventPseudoEncoding);
+    // The refresh of a resumed session goes from coarse JPEG to lossless,
+    // whatever the application chose
+    if (resumePass == ResumeLowQuality)
+        encodings.append(QualityLevel0 + ResumeQualityLevel);
+    else if (resumePass == ResumeNone && session.qualityLevel >= 0)
+        encodings.append(QualityLevel0 + session.qualityLevel);
 #ifdef USE_ZLIB
-    QScopedPointer<TightData> tightData;        ///< Data for Tight encoding
+    // Let Tight use JPEG on slow links unless the application chose a quality
+    else if (resumePass == ResumeNone && session.adaptiveEncoding && session.fineQualityLevel < 0 && encodings.first() == Tight
+             && estimatedThroughput() < 2e6)
+        encodings.append(QualityLevel0 + 6);
 #endif
-    ProtocolVersion protocolVersion = ProtocolVersionUnknown; ///< Current protocol version
-    SecurityType securityType = SecurityTypeUnknwon;         ///< Current security type
-    QImage image;                               ///< Image containing the framebuffer
-    int frameBufferWidth = 0;                   ///< Framebuffer width
-    int frameBufferHeight = 0;                  ///< Framebuffer height
-};
+    if (session.compressionLevel >= 0)
+        encodings.append(CompressionLevel0 + session.compressionLevel);
+    // TurboVNC/TigerVNC extensions, the fine level overrides the coarse one
+    if (resumePass == ResumeNone && session.fineQualityLevel >= 0)
+        encodings.append(FineQualityLevel0 + session.fineQualityLevel);
+    if (resumePass == ResumeLowQuality)
+        encodings.append(JpegSubsampling1X + Subsampling4X);
+    else if (resumePass == ResumeNone && session.subsampling != SubsamplingDefault)
+        encodings.append(JpegSubsampling1X + session.subsampling);
+    if (session.localCursor) {
+        encodings.append(CursorPseudoEncoding);
+        encodings.append(PointerPosPseudoEncoding);
+    }
+    return encodings;
+}
 
 /*!
     \internal
-    Constructs the private implementation with keyboard mapping and signal connections.
-    
-    \param parent The QVncClient instance that owns this implementation.
+    Forgets all measurements and seeds the cost model with typical values
+    for each encoding, so the first decision already has something to go on.
 */
-QVncClient::Private::Private(QVncClient *parent)
-    : q(parent)
+void QVncClient::Private::resetStatistics()
+{
+    statistics = EncodingStatistics();
+    const double rawBytesPerPixel = qMax(1, pixelFormat.bitsPerPixel / 8);
+    statistics.costs.insert(RawEncoding, { 1.5, rawBytesPerPixel });
+    statistics.costs.insert(Hextile, { 6.0, 1.0 });
 #ifdef USE_ZLIB
-    , tightData(new TightData())
+    statistics.costs.insert(ZRLE, { 12.0, 0.25 });
+    statistics.costs.insert(Tight, { 20.0, 0.2 });
 #endif
-{
-    const QList<quint32> keyList {
-        // Key mappings
-        Qt::Key_Backspace, 0xff08,
-        Qt::Key_Tab, 0xff09,
-        Qt::Key_Return, 0xff0d,
-        Qt::Key_Enter, 0xff0d,
-        Qt::Key_Insert, 0xff63,
-        Qt::Key_Delete, 0xffff,
-        Qt::Key_Home, 0xff50,
-        Qt::Key_End, 0xff57,
-        Qt::Key_PageUp, 0xff55,
-        Qt::Key_PageDown, 0xff56,
-        Qt::Key_Left, 0xff51,
-        Qt::Key_Up, 0xff52,
-        Qt::Key_Right, 0xff53,
-        Qt::Key_Down, 0xff54,
-        Qt::Key_F1, 0xffbe,
-        Qt::Key_F2, 0xffbf,
-        Qt::Key_F3, 0xffc0,
-        Qt::Key_F4, 0xffc1,
-        Qt::Key_F5, 0xffc2,
-        Qt::Key_F6, 0xffc3,
-        Qt::Key_F7, 0xffc4,
-        Qt::Key_F8, 0xffc5,
-        Qt::Key_F9, 0xffc6,
-        Qt::Key_F10, 0xffc7,
-        Qt::Key_F11, 0xffc8,
-        Qt::Key_F12, 0xffc9,
-        Qt::Key_Shift, 0xffe1,
-        Qt::Key_Control, 0xffe3,
-        Qt::Key_Meta, 0xffe7,
-        Qt::Key_Alt, 0xffe9
-    };
-    for (int i = 0; i < keyList.length(); i+=2) {
-        keyMap.insert(static_cast<int>(keyList.at(i)), keyList.at(i+1));
-    }
-
-    connect(q, &QVncClient::socketChanged, q, [this](QTcpSocket *socket) {
-        if (prev) {
-            disconnect(prev, nullptr, q, nullptr);
-        }
-        reset ();
-
-        if (socket) {
-            connect(socket, &QTcpSocket::connected, q, [this]() {
-                emit q->connectionStateChanged(true);
-                qCInfo(lcVncClient) << "Connected to VNC server";
-                state = ProtocolVersionState;
-                q->setProtocolVersion(ProtocolVersionUnknown);
-                q->setSecurityType(SecurityTypeUnknwon);
-                read();
-            });
-            connect(socket, &QTcpSocket::disconnected, q, [this, socket]() {
-                qCInfo(lcVncClient) << "Disconnected from VNC server";
-                emit q->connectionStateChanged(false);
-                
-                reset();
-            });
-            connect(socket, &QTcpSocket::readyRead, q, [this]() {
-                read();
-            });
-        }
-        prev = socket;
-    });
-
-    connect(q, &QVncClient::protocolVersionChanged, q, [this](ProtocolVersion protocolVersion) {
-        protocolVersionChanged(protocolVersion);
-    });
-    connect(q, &QVncClient::securityTypeChanged, q, [this](SecurityType securityType) {
-        securityTypeChanged(securityType);
-    });
+    statistics.order = rankEncodings();
 }
 
-void QVncClient::Private::reset()
+/*!
+    \internal
+    Announces the current encoding list again so that quality and compression
+    changes take effect without reconnecting.
+*/
+void QVncClient::Private::updateEncodings()
 {
-    state = ProtocolVersionState;
-    q->setProtocolVersion(ProtocolVersionUnknown);
-    q->setSecurityType(SecurityTypeUnknwon);
-    frameBufferWidth = 0;
-    frameBufferHeight = 0;
-    image = QImage(); // Clear the image buffer
-    emit q->framebufferSizeChanged(0, 0);
+    if (state != WaitingState)
+        return;
+    setEncodings(encodings());
 }
 
 /*!
     \internal
-    Main state machine dispatcher for handling incoming socket data based on the current protocol state.
+    Applies the settings that differ from \a previous to the running session.
 */
-void QVncClient::Private::read()
+void QVncClient::Private::settingsChanged(const Settings &previous)
 {
-    switch (state) {
-    case ProtocolVersionState:
-        parseProtocolVersion();
-        break;
-    case SecurityState:
-        parseSecurity();
-        break;
-    case ServerInitState:
-        parserServerInit();
-        break;
-    case WaitingState:
-        parseServerMessages();
-        break;
-    default:
-        qDebug() << socket->readAll();
-        break;
+    if (session.qualityLevel != previous.qualityLevel
+            || session.compressionLevel != previous.compressionLevel
+            || session.fineQualityLevel != previous.fineQualityLevel
+            || session.subsampling != previous.subsampling
+            || session.adaptiveEncoding != previous.adaptiveEncoding
+            || session.localCursor != previous.localCursor)
+        updateEncodings();
+    if (session.regionOfInterest != previous.regionOfInterest)
+        regionOfInterestChanged(previous.regionOfInterest);
+    // The frame kept for a reconnect is not wanted anymore
+    if (!session.sessionResume && std::exchange(resumable, false)) {
+        QMutexLocker locker(&imageMutex);
+        image = QImage();
     }
+    // The buffering mode is read when the next update starts; only the
+    // requests queued above need to go out now
+    flush();
 }
 
-#ifdef USE_ZLIB
 /*!
     \internal
-    Handles Tight-encoded rectangle data.
-    
-    \param rect The rectangle dimensions.
+    Sends a FramebufferUpdateRequest message to the server.
     
-    Tight encoding is a complex encoding that can use zlib compression, JPEG compression,
-    or various subencodings for efficient representation of framebuffer data.
+    \param incremental If true, only changed parts of the framebuffer are requested.
+    \param rect The rectangle to update, or empty for the entire framebuffer.
 */
-void QVncClient::Private::handleTightEncoding(const Rectangle &rect)
+void QVncClient::Private::framebufferUpdateRequest(bool incremental, const QRect &rect)
 {
-    // Read the compression control byte
-    quint8 compControl = 0;
-    if (socket->bytesAvailable() < 1) {
-        if (!socket->waitForReadyRead(1000)) {
-            qCWarning(lcVncClient) << "Timeout waiting for Tight compression control byte";
-            framebufferUpdateRequest();
+    const QRect framebufferRect(0, 0, frameBufferWidth, frameBufferHeight);
+    QRect area = rect;
+    if (area.isEmpty()) {
+        area = session.regionOfInterest.isNull() ? framebufferRect : session.regionOfInterest & framebufferRect;
+        // Nothing of interest is visible, the next request follows a change of the region
+        if (area.isEmpty())
             return;
-        }
     }
-    socket->read(reinterpret_cast<char*>(&compControl), 1);
-    
-    // Check for basic compression type
-    bool resetStream = (compControl & 0x80) != 0;
-    int streamId = compControl & 0x03;
-    
-    // Check for JPEG compression
-    if ((compControl & 0x0F) == 0x09) {
-        int length = 0;
-        quint8 lenByte = 0;
-        
-        // Read the JPEG data length
-        if (socket->bytesAvailable() < 1) {
-            if (!socket->waitForReadyRead(1000)) {
-                qCWarning(lcVncClient) << "Timeout waiting for JPEG length byte";
-                framebufferUpdateRequest();
-                return;
-            }
-        }
-        socket->read(reinterpret_cast<char*>(&lenByte), 1);
-        
-        if (lenByte & 0x80) {
-            // 3-byte length
-            quint8 lenMid, lenLow;
-            if (socket->bytesAvailable() < 2) {
-                socket->waitForReadyRead();
-            }
-            socket->read(reinterpret_cast<char*>(&lenMid), 1);
-            socket->read(reinterpret_cast<char*>(&lenLow), 1);
-            length = ((lenByte & 0x7F) << 16) | (lenMid << 8) | lenLow;
-        } else {
-            // 1-byte length
-            length = lenByte;
-        }
-        
-        // Handle JPEG compression
-        if (!handleTightJpeg(rect, length)) {
-            // If JPEG handling fails, request a new update
-            framebufferUpdateRequest();
-        }
+
+    probeRoundTrip();
+    if (link.requestSentAt < 0)
+        link.requestSentAt = link.clock.nsecsElapsed();
+    write(FramebufferUpdateRequest);
+    write(quint8(incremental ? 1 : 0));
+    Rectangle rectangle;
+    rectangle.x = area.x();
+    rectangle.y = area.y();
+    rectangle.w = area.width();
+    rectangle.h = area.height();
+    write(rectangle);
+}
+
+/*!
+    \internal
+    Requests a full update of the parts of the region of interest that were
+    not covered by \a previous, since changes there were not sent.
+*/
+void QVncClient::Private::regionOfInterestChanged(const QRect &previous)
+{
+    if (state != WaitingState)
         return;
+
+    const QRect framebufferRect(0, 0, frameBufferWidth, frameBufferHeight);
+    const QRect before = previous.isNull() ? framebufferRect : previous & framebufferRect;
+    const QRect rect = session.regionOfInterest;
+    const QRect after = rect.isNull() ? framebufferRect : rect & framebufferRect;
+    const QRegion exposed = QRegion(after) - before;
+    if (exposed.rectCount() > 4) {
+        framebufferUpdateRequest(false, exposed.boundingRect());
+    } else {
+        for (const QRect &r : exposed)
+            framebufferUpdateRequest(false, r);
     }
+}
+
+/*!
+    \internal
+    Parses and dispatches incoming server messages.
     
-    // Non-JPEG compression
-    // Reset the zlib stream if requested
-    if (resetStream && tightData->zlibStreamActive[streamId]) {
-        inflateEnd(&tightData->zlibStream[streamId]);
-        tightData->zlibStreamActive[streamId] = false;
+    Reads the message type from the socket and calls the appropriate handler.
+*/
+bool QVncClient::Private::parseServerMessages()
+{
+    if (rectsLeft > 0)
+        return parseRectangle();
+
+    quint8 messageType = 0;
+    read(&messageType);
+    switch (messageType) {
+    case FramebufferUpdate:
+        return framebufferUpdate();
+    case ServerFence:
+        return parseFence();
+    default:
+        qCWarning(lcVncClient) << "Unknown message type:" << messageType;
+        return true;
     }
+}
+
+/*!
+    \internal
+    Processes the header of a framebuffer update message.
     
-    // Initialize stream if not active
-    if (!tightData->zlibStreamActive[streamId]) {
-        tightData->zlibStream[streamId].zalloc = Z_NULL;
-        tightData->zlibStream[streamId].zfree = Z_NULL;
-        tightData->zlibStream[streamId].opaque = Z_NULL;
-        inflateInit(&tightData->zlibStream[streamId]);
-        tightData->zlibStreamActive[streamId] = true;
+    Reads the number of rectangles, which are then decoded one message step
+    at a time, so that a large update does not have to arrive in one piece.
+*/
+bool QVncClient::Private::framebufferUpdate()
+{
+    quint8 padding;
+    read(&padding);
+    quint16_be numberOfRectangles;
+    read(&numberOfRectangles);
+    if (starved)
+        return false;
+
+    recordUpdateArrival();
+    updateTimer.start();
+    updateStart = bytesReceived;
+    progressAt = 40;
+    beginUpdate();
+    rectsLeft = numberOfRectangles;
+    inRectangle = false;
+    if (rectsLeft == 0)
+        finishUpdate();
+    return true;
+}
+
+/*!
+    \internal
+    Decodes the next rectangle of the current framebuffer update.
+
+    The rectangle header is committed once read; decoders may commit further
+    progress, e.g. after each Hextile tile, and are otherwise restarted from
+    the last commit when their data is incomplete.
+*/
+bool QVncClient::Private::parseRectangle()
+{
+    if (!inRectangle) {
+        read(&rectangle);
+        qint32_be encodingType;
+        read(&encodingType);
+        if (starved)
+            return false;
+        rectangleEncoding = encodingType;
+        inRectangle = true;
+        rectangleDeferred = false;
+        rectangleNsecs = 0;
+        rawRow = 0;
+#ifdef USE_ZLIB
+        inflating = false;
+#endif
+        hextileTile = 0;
+        hextileBackground = 0;
+        hextileForeground = 0;
+        commit();
+        rectangleStart = bytesReceived;
     }
-    
-    // Read the uncompressed length
-    int length = 0;
-    if ((compControl & 0x80) == 0) {
-        quint8 len;
-        if (socket->bytesAvailable() < 1) {
-            socket->waitForReadyRead();
-        }
-        socket->read(reinterpret_cast<char*>(&len), 1);
-        length = len;
-    } else {
-        quint8 lenHigh, lenMid, lenLow;
-        if (socket->bytesAvailable() < 3) {
-            socket->waitForReadyRead();
-        }
-        socket->read(reinterpret_cast<char*>(&lenHigh), 1);
-        socket->read(reinterpret_cast<char*>(&lenMid), 1);
-        socket->read(reinterpret_cast<char*>(&lenLow), 1);
-        length = (lenHigh << 16) | (lenMid << 8) | lenLow;
+
+    // The application may have taken a copy of the image since the last
+    // chunk; deferred decoders only run while it cannot
+    if (deferred.empty()) {
+        frameBits = frame->bits();
+        frameBytesPerLine = frame->bytesPerLine();
     }
-    
-    // Read compressed data
-    QByteArray compressedData;
-    compressedData.resize(length);
-    
-    int totalRead = 0;
-    while (totalRead < length) {
-        if (socket->bytesAvailable() < 1 && totalRead < length) {
-            socket->waitForReadyRead();
-        }
-        int bytesRead = socket->read(compressedData.data() + totalRead, length - totalRead);
-        if (bytesRead <= 0) {
-            qCWarning(lcVncClient) << "Failed to read compressed data for Tight encoding";
-            framebufferUpdateRequest(); // Request a new frame
-            return;
+
+    QElapsedTimer decodeTimer;
+    decodeTimer.start();
+    bool supported = true;
+    bool pseudo = false;
+    switch (rectangleEncoding) {
+#ifdef USE_ZLIB
+        case ZRLE:
+            handleZRLEEncoding(rectangle);
+            break;
+        case Tight:
+            handleTightEncoding(rectangle);
+            break;
+#endif
+        case Hextile:
+            handleHextileEncoding(rectangle);
+            break;
+        case RawEncoding:
+            handleRawEncoding(rectangle);
+            break;
+        case CopyRect:
+            handleCopyRect(rectangle);
+            break;
+        case CursorPseudoEncoding:
+            handleCursor(rectangle);
+            pseudo = true;
+            break;
+        case QemuExtendedKeyEventPseudoEncoding:
+            // The server acknowledges the extension with an empty rectangle
+            toClient([this]() { qemuKeyEvents = true; });
+            pseudo = true;
+            break;
+        case PointerPosPseudoEncoding: {
+            const QPoint position(rectangle.x, rectangle.y);
+            toClient([this, position]() { reportCursorPosition(position); });
+            pseudo = true;
+            break;
         }
-        totalRead += bytesRead;
-    }
-    
-    // Calculate expected uncompressed size
-    int expectedBytes = rect.w * rect.h * (pixelFormat.bitsPerPixel / 8);
-    
-    // Decompress data
-    QByteArray uncompressedData = decompressTightData(streamId, compressedData, expectedBytes);
-    if (uncompressedData.isEmpty()) {
-        qCWarning(lcVncClient) << "Failed to decompress Tight encoded data, requesting new update";
-        framebufferUpdateRequest(); // Request a new frame
-        return;
+        default:
+            qCWarning(lcVncClient) << "Unsupported encoding:" << rectangleEncoding;
+            // Skip this rectangle as we don't understand the encoding
+            supported = false;
+            break;
     }
-    
-    // Update the framebuffer with the decompressed data
-    const unsigned char* data = reinterpret_cast<const unsigned char*>(uncompressedData.constData());
-    
-    for (int y = 0; y < rect.h; y++) {
-        for (int x = 0; x < rect.w; x++) {
-            int offset = (y * rect.w + x) * (pixelFormat.bitsPerPixel / 8);
-            quint32 color = 0;
-            
-            // Read pixel data according to bpp
-            if (pixelFormat.bitsPerPixel == 32) {
-                color = *reinterpret_cast<const quint32*>(data + offset);
-            } else if (pixelFormat.bitsPerPixel == 24) {
-                color = data[offset] | (data[offset + 1] << 8) | (data[offset + 2] << 16);
-            } else if (pixelFormat.bitsPerPixel == 16) {
-                color = *reinterpret_cast<const quint16*>(data + offset);
-            } else if (pixelFormat.bitsPerPixel == 8) {
-                color = data[offset];
-            }
-            
-            // Convert to RGB and set pixel
-            const auto r = (color >> pixelFormat.redShift) & pixelFormat.redMax;
-            const auto g = (color >> pixelFormat.greenShift) & pixelFormat.greenMax;
-            const auto b = (color >> pixelFormat.blueShift) & pixelFormat.blueMax;
-            image.setPixel(rect.x + x, rect.y + y, qRgb(r, g, b));
-        }
+    rectangleNsecs += decodeTimer.nsecsElapsed();
+    if (starved)
+        return false;
+
+    commit();
+    inRectangle = false;
+    if (rectangleDeferred) {
+        // Recorded once its decoder is done
+        deferred.back().bytes = bytesReceived - rectangleStart;
+        deferred.back().readNsecs = rectangleNsecs;
+    } else if (supported && !pseudo) {
+        recordDecode(rectangleEncoding, rectangleNsecs, bytesReceived - rectangleStart, qint64(rectangle.w) * rectangle.h);
     }
+    if (supported && !pseudo)
+        addDamage(QRect(rectangle.x, rectangle.y, rectangle.w, rectangle.h));
+    if (--rectsLeft == 0)
+        finishUpdate();
+    return true;
 }
-#endif
 
 /*!
     \internal
-    Processes a JPEG-compressed rectangle in Tight encoding.
-    
-    \param rect The rectangle dimensions.
-    \param dataLength The length of the JPEG data in bytes.
-    \return true if successful, false if there was an error.
+    Publishes the completed update, feeds the statistics and asks for the next one.
 */
-bool QVncClient::Private::handleTightJpeg(const Rectangle &rect, int dataLength)
+void QVncClient::Private::finishUpdate()
 {
-    // Read JPEG data
-    QByteArray jpegData;
-    jpegData.resize(dataLength);
-    
-    int totalRead = 0;
-    while (totalRead < dataLength) {
-        if (socket->bytesAvailable() < 1 && totalRead < dataLength) {
-            socket->waitForReadyRead();
+    settle();
+    commit();
+    flushDamage();
+    recordUpdate(bytesReceived - updateStart, updateTimer.nsecsElapsed());
+    adaptEncodings();
+    if (std::exchange(handshaking, false))
+        toClient([this]() { reachPhase(FirstUpdatePhase); });
+    if (resumePass != ResumeNone && continueResume())
+        return;
+    // Repair what a decoder failed on with a full update
+    framebufferUpdateRequest(!decodeFailed.exchange(false));
+}
+
+/*!
+    \internal
+    Follows the coarse refresh of a resumed session, which brings the whole
+    framebuffer up to date with little data, with a lossless one if the
+    server used JPEG, and then goes back to the encodings of the session.
+    Returns true if the next update has been requested.
+*/
+bool QVncClient::Private::continueResume()
+{
+    if (resumePass == ResumeLowQuality) {
+        toClient([this]() { setStale(false); });
+        if (resumeLossy) {
+            resumePass = ResumeLossless;
+            setEncodings(encodings());
+            framebufferUpdateRequest(false);
+            return true;
+        }
+    }
+    resumePass = ResumeNone;
+    setEncodings(encodings());
+    return false;
+}
+
+void QVncClient::Private::defer(const QRect &source, quint8 streams, std::function<void()> decode)
+{
+    if (!decodeGraph)
+        decodeGraph = std::make_unique<QVncDecodeScheduler::Graph>();
+
+    const QRect target(rectangle.x, rectangle.y, rectangle.w, rectangle.h);
+    QList<int> dependencies;
+    for (const auto &other : deferred) {
+        if (target.intersects(other.target) || source.intersects(other.target)
+                || target.intersects(other.source) || (streams & other.streams))
+            dependencies.append(other.node);
+    }
+
+    DeferredDecode &entry = deferred.emplace_back();
+    entry.target = target;
+    entry.source = source;
+    entry.streams = streams;
+    entry.encoding = rectangleEncoding;
+    entry.node = decodeGraph->add([decode = std::move(decode), nsecs = &entry.nsecs]() {
+        QElapsedTimer timer;
+        timer.start();
+        decode();
+        *nsecs = timer.nsecsElapsed();
+    }, dependencies);
+    rectangleDeferred = true;
+}
+
+void QVncClient::Private::settle(const QRect &rect, quint8 streams)
+{
+    for (const auto &other : deferred) {
+        if (rect.intersects(other.target) || rect.intersects(other.source) || (streams & other.streams))
+            decodeGraph->wait(other.node);
+    }
+}
+
+void QVncClient::Private::settle()
+{
+    if (deferred.empty())
+        return;
+    decodeGraph->wait();
+    for (const auto &entry : deferred)
+        recordDecode(entry.encoding, entry.readNsecs + entry.nsecs, entry.bytes, qint64(entry.target.width()) * entry.target.height());
+    deferred.clear();
+}
+
+void QVncClient::Private::beginUpdate()
+{
+    // The application reads frames from another thread then, so never
+    // decode into the one it sees. It still holds the previous frame until
+    // the queued signals reach it, so a single back buffer would be shared
+    // and copied on every write.
+    BufferingMode mode = session.bufferingMode;
+    if (isThreaded())
+        mode = TripleBuffering;
+
+    if (mode == SingleBuffering) {
+        frame = &image;
+        backBuffers.clear();
+    } else {
+        const int count = mode == TripleBuffering ? 2 : 1;
+        if (backBuffers.size() != count || backBuffers.first().image.size() != image.size()) {
+            backBuffers.clear();
+            for (int i = 0; i < count; i++)
+                backBuffers.append({image.copy(), QRegion()});
+            backBuffer = 0;
+        }
+
+        // Writing to a buffer someone else still holds would copy it first,
+        // so prefer one that is not shared
+        if (!backBuffers.at(backBuffer).image.isDetached()) {
+            for (int i = 0; i < backBuffers.size(); i++) {
+                if (backBuffers.at(i).image.isDetached()) {
+                    backBuffer = i;
+                    break;
+                }
+            }
         }
-        int bytesRead = socket->read(jpegData.data() + totalRead, dataLength - totalRead);
-        if (bytesRead <= 0) {
-            qCWarning(lcVncClient) << "Failed to read JPEG data for Tight encoding";
-            return false;
+
+        // Bring the back buffer up to date with the published frame, copying
+        // only what was published since it was last written
+        BackBuffer &back = backBuffers[backBuffer];
+        const int bytesPerPixel = image.depth() / 8;
+        for (const QRect &rect : std::as_const(back.stale)) {
+            for (int y = rect.top(); y <= rect.bottom(); y++) {
+                memcpy(back.image.scanLine(y) + rect.left() * bytesPerPixel,
+                       image.constScanLine(y) + rect.left() * bytesPerPixel,
+                       rect.width() * bytesPerPixel);
+            }
         }
-        totalRead += bytesRead;
-    }
-    
-    // Decode JPEG image using Qt
-    QImage jpegImage;
-    if (!jpegImage.loadFromData(jpegData, "JPEG")) {
-        qCWarning(lcVncClient) << "Failed to decode JPEG data for Tight encoding";
-        return false;
+        back.stale = QRegion();
+        frame = &back.image;
     }
-    
-    // Copy the JPEG image to the framebuffer
-    QPainter painter(&image);
-    painter.drawImage(rect.x, rect.y, jpegImage);
-    
-    return true;
+    frameBits = frame->bits();
+    frameBytesPerLine = frame->bytesPerLine();
 }
 
-#ifdef USE_ZLIB
 /*!
     \internal
-    Decompresses zlib data for Tight encoding.
-    
-    \param streamId The zlib stream ID (0-3).
-    \param data The compressed data.
-    \param expectedBytes The expected size of the decompressed data.
-    \return The decompressed data, or an empty array on error.
+    Makes the back buffer holding the completed update the published frame.
+
+    The previous frame becomes a back buffer that lacks the damage of this
+    update, as do all other back buffers.
 */
-QByteArray QVncClient::Private::decompressTightData(int streamId, const QByteArray &data, int expectedBytes)
+void QVncClient::Private::publishFrame()
 {
-    QByteArray uncompressedData;
-    uncompressedData.resize(expectedBytes);
-    
-    tightData->zlibStream[streamId].next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
-    tightData->zlibStream[streamId].avail_in = data.size();
-    tightData->zlibStream[streamId].next_out = reinterpret_cast<Bytef*>(uncompressedData.data());
-    tightData->zlibStream[streamId].avail_out = uncompressedData.size();
-    
-    // Perform decompression
-    int result = inflate(&tightData->zlibStream[streamId], Z_SYNC_FLUSH);
-    if (result != Z_OK && result != Z_STREAM_END) {
-        qCWarning(lcVncClient) << "Zlib inflation failed with error code:" << result;
-        return QByteArray();
+    if (frame == &image)
+        return;
+    {
+        QMutexLocker locker(&imageMutex);
+        image.swap(*frame);
     }
-    
-    int uncompressedSize = uncompressedData.size() - tightData->zlibStream[streamId].avail_out;
-    uncompressedData.resize(uncompressedSize);
-    
-    return uncompressedData;
+    for (auto &back : backBuffers)
+        back.stale += damage;
+    backBuffer = (backBuffer + 1) % backBuffers.size();
+    frame = &image;
+}
+
+void QVncClient::Private::addDamage(const QRect &rect)
+{
+    damage += rect & image.rect();
 }
-#endif
 
 /*!
     \internal
-    Parses the RFB protocol version string sent by the server.
-    
-    The server sends a string like "RFB 003.008\n" indicating its supported protocol version.
-    This method reads this string and sets the appropriate protocol version enum value.
+    Emits framebufferUpdated() once for the whole update and imageChanged()
+    once per rectangle of the coalesced damage, so that overlapping or
+    adjacent rectangles are repainted only once.
 */
-void QVncClient::Private::parseProtocolVersion()
+void QVncClient::Private::flushDamage()
 {
-    if (socket->bytesAvailable() < 12) {
-        qCDebug(lcVncClient) << "Waiting for more protocol version data:" << socket->peek(12);
+    if (damage.isEmpty())
         return;
-    }
-    const auto value = socket->read(12);
-    if (value == "RFB 003.003\n")
-        q->setProtocolVersion(ProtocolVersion33);
-    else if (value == "RFB 003.007\n")
-        q->setProtocolVersion(ProtocolVersion33); // we don't support 3.7 yet
-    else if (value == "RFB 003.008\n")
-        q->setProtocolVersion(ProtocolVersion33); // we don't support 3.7 yet
-    else
-        qCWarning(lcVncClient) << "Unsupported protocol version:" << value;
+    publishFrame();
+    const QRegion region = std::exchange(damage, QRegion());
+    const QImage delivered = isThreaded() ? image : QImage();
+    toClient([this, region, delivered]() {
+        if (isThreaded())
+            published = delivered;
+        for (const QRect &rect : region)
+            emit q->imageChanged(rect);
+        emit q->framebufferUpdated(region);
+    });
 }
 
 /*!
     \internal
-    Handles protocol version changes by sending the appropriate response to the server.
+    Accumulates the cost of decoding one rectangle with \a encoding.
     
-    \param protocolVersion The new protocol version.
+    \param encoding The encoding of the rectangle.
+    \param nsecs The time spent decoding it.
+    \param bytes The number of bytes it occupied on the wire.
+    \param pixels The number of pixels it covered.
 */
-void QVncClient::Private::protocolVersionChanged(ProtocolVersion protocolVersion)
+void QVncClient::Private::recordDecode(qint32 encoding, qint64 nsecs, qint64 bytes, qint64 pixels)
 {
-    qCDebug(lcVncClient) << "Protocol version changed to:" << protocolVersion;
-    switch (protocolVersion) {
-    case ProtocolVersion33:
-        socket->write("RFB 003.003\n");
-        state = SecurityState;
-        break;
-    case ProtocolVersion37:
-        socket->write("RFB 003.007\n");
-        state = SecurityState;
-        break;
-    case ProtocolVersion38:
-        socket->write("RFB 003.008\n");
-        state = SecurityState;
-        break;
-    default:
-        break;
-    }
+    if (pixels < 256 || !statistics.costs.contains(encoding))
+        return; // tiny rects are dominated by per-rect overhead
+    auto &cost = statistics.costs[encoding];
+    cost.nsecsPerPixel = cost.nsecsPerPixel * 0.75 + (double(nsecs) / pixels) * 0.25;
+    cost.bytesPerPixel = cost.bytesPerPixel * 0.75 + (double(bytes) / pixels) * 0.25;
 }
 
 /*!
     \internal
-    Dispatches to the appropriate security parsing method based on the protocol version.
+    Updates the link throughput estimate from a completed update.
+    
+    \param bytes The size of the update on the wire.
+    \param nsecs The time from its first to its last byte being processed.
 */
-void QVncClient::Private::parseSecurity()
+void QVncClient::Private::recordUpdate(qint64 bytes, qint64 nsecs)
 {
-    switch (protocolVersion) {
-    case ProtocolVersion33:
-        parseSecurity33();
-        break;
-    case ProtocolVersion37:
-    case ProtocolVersion38:
-        parseSecurity37();
-        break;
-    default:
-        break;
+    statistics.updates++;
+    // Small updates say more about latency than about throughput
+    if (bytes >= 16 * 1024 && nsecs > 0) {
+        const double sample = bytes * 1e9 / nsecs;
+        link.throughput = link.throughput > 0
+                ? link.throughput * 0.75 + sample * 0.25
+                : sample;
     }
+    publishLinkStatistics();
 }
 
 /*!
     \internal
-    Parses security data for protocol version 3.3.
-    
-    In RFB 3.3, the server directly sends a 32-bit security type value.
+    Records the time between the oldest unanswered FramebufferUpdateRequest
+    and the arrival of a FramebufferUpdate.
 */
-void QVncClient::Private::parseSecurity33()
+void QVncClient::Private::recordUpdateArrival()
 {
-    if (socket->bytesAvailable() < 4) {
-        qCDebug(lcVncClient) << "Waiting for more security data:" << socket->peek(4);
+    if (link.requestSentAt < 0)
         return;
-    }
-    quint32_be data;
-    read(&data);
-    q->setSecurityType(static_cast<SecurityType>(static_cast<unsigned int>(data)));
+    link.updateRoundTrips.append((link.clock.nsecsElapsed() - link.requestSentAt) / 1e6);
+    if (link.updateRoundTrips.size() > 16)
+        link.updateRoundTrips.removeFirst();
+    link.requestSentAt = -1;
 }
 
 /*!
     \internal
-    Parses security data for protocol version 3.7 and later.
-    
-    In RFB 3.7+, the server sends a list of supported security types, and the client
-    chooses one.
+    Emits the change signals of the link properties whose value moved by more
+    than a few percent since they were last published.
 */
-void QVncClient::Private::parseSecurity37()
+void QVncClient::Private::publishLinkStatistics()
 {
-    if (socket->bytesAvailable() < 1) {
-        qCDebug(lcVncClient) << "Waiting for security type count:" << socket->peek(1);
-        return;
+    auto changed = [](double current, double published, double minimum) {
+        return qAbs(current - published) > qMax(qAbs(published) * 0.05, minimum);
+    };
+
+    const double bandwidth = link.throughput > 0 ? link.throughput : -1;
+    if (changed(bandwidth, link.bandwidth, 1)) {
+        link.bandwidth = bandwidth;
+        toClient([this, bandwidth]() {
+            this->bandwidth = bandwidth;
+            emit q->bandwidthChanged(bandwidth);
+        });
     }
-    quint8 numberOfSecurityTypes = 0;
-    read(&numberOfSecurityTypes);
-    if (numberOfSecurityTypes == 0) {
-        parseSecurityReason();
-        return;
+
+    const double roundTripTime = networkRoundTrip();
+    if (changed(roundTripTime, link.roundTripTime, 0.1)) {
+        link.roundTripTime = roundTripTime;
+        toClient([this, roundTripTime]() {
+            this->roundTripTime = roundTripTime;
+            emit q->roundTripTimeChanged(roundTripTime);
+        });
     }
-    if (socket->bytesAvailable() < numberOfSecurityTypes) {
-        qCDebug(lcVncClient) << "Waiting for security types:" << socket->peek(numberOfSecurityTypes);
-        return;
+
+    double serverLatency = -1;
+    if (roundTripTime >= 0 && !link.updateRoundTrips.isEmpty()) {
+        const double fastest = *std::min_element(link.updateRoundTrips.cbegin(), link.updateRoundTrips.cend());
+        serverLatency = qMax(0.0, fastest - roundTripTime);
     }
-    QList<quint8> securityTypes;
-    for (unsigned char i = 0; i < numberOfSecurityTypes; i++) {
-        quint8 securityType = 0;
-        read(&securityType);
-        securityTypes.append(securityType);
+    if (changed(serverLatency, link.serverLatency, 0.1)) {
+        link.serverLatency = serverLatency;
+        toClient([this, serverLatency]() {
+            this->serverLatency = serverLatency;
+            emit q->serverLatencyChanged(serverLatency);
+        });
     }
-    if (securityTypes.contains(SecurityTypeNone))
-        q->setSecurityType(SecurityTypeNone);
-    else
-        q->setSecurityType(SecurityTypeInvalid);
 }
 
 /*!
     \internal
-    Handles security type changes by sending the appropriate response to the server.
-    
-    \param securityType The new security type.
+    Returns the network round trip in milliseconds: the Fence round trip when
+    the server supports Fence, otherwise the fastest recent update round trip.
+    Returns -1 while nothing has been measured.
 */
-void QVncClient::Private::securityTypeChanged(SecurityType securityType)
+double QVncClient::Private::networkRoundTrip() const
 {
-    qCDebug(lcVncClient) << "Security type changed to:" << securityType;
-    switch (securityType) {
-    case SecurityTypeUnknwon:
-        break;
-    case SecurityTypeInvalid:
-        parseSecurityReason();
-        break;
-    case SecurityTypeNone:
-        switch (protocolVersion) {
-        case ProtocolVersion33:
-            state = ClientInitState;
-            clientInit();
-            break;
-        case ProtocolVersion37:
-            state = ClientInitState;
-            write(securityType);
-            clientInit();
-            break;
-        case ProtocolVersion38:
-            write(securityType);
-            state = SecurityResultState;
-            break;
-        default:
-            break;
-        }
-        break;
-    default:
-        qCWarning(lcVncClient) << "Security type" << securityType << "not supported";
-        break;
-    }
+    if (link.fenceRoundTrip >= 0)
+        return link.fenceRoundTrip;
+    if (link.updateRoundTrips.isEmpty())
+        return -1;
+    return *std::min_element(link.updateRoundTrips.cbegin(), link.updateRoundTrips.cend());
 }
 
 /*!
     \internal
-    Parses and logs the reason for a security failure sent by the server.
+    Parses a Fence message from the server.
+    
+    A Fence with the request flag must be echoed back; one without it is the
+    answer to our own probe and yields a round trip sample.
 */
-void QVncClient::Private::parseSecurityReason()
+bool QVncClient::Private::parseFence()
 {
-    if (socket->bytesAvailable() < 4) {
-        qCDebug(lcVncClient) << "Waiting for reason length:" << socket->peek(4);
-        return;
+    quint8 padding[3];
+    read(&padding);
+    quint32_be flags;
+    read(&flags);
+    quint8 length = 0;
+    read(&length);
+    const QByteArray payload = readBytes(length);
+    if (starved)
+        return false;
+
+    if (!std::exchange(link.fenceSupported, true))
+        toClient([this]() { serverFences = true; });
+    if (flags & FenceRequest) {
+        // Only echo the flags we understand
+        sendFence(flags & (FenceBlockBefore | FenceBlockAfter | FenceSyncNext), payload);
+        return true;
     }
-    quint32_be reasonLength;
-    read(&reasonLength);
-    if (socket->bytesAvailable() < reasonLength) {
-        qCDebug(lcVncClient) << "Waiting for reason data:" << socket->peek(reasonLength);
-        return;
+
+    // Typed text is paced by the client's thread
+    if (payload == TypingFence) {
+        toClient([this]() {
+            if (!typingChunks.isEmpty())
+                typingInFlight -= typingChunks.takeFirst();
+            typeMore();
+        });
+        return true;
+    }
+
+    if (link.fenceSentAt >= 0 && payload.size() == sizeof(quint32)
+            && qFromBigEndian<quint32>(payload.constData()) == link.fenceSequence) {
+        const double sample = (link.clock.nsecsElapsed() - link.fenceSentAt) / 1e6;
+        link.fenceRoundTrip = link.fenceRoundTrip >= 0
+                ? link.fenceRoundTrip * 0.75 + sample * 0.25
+                : sample;
+        link.fenceSentAt = -1;
+        publishLinkStatistics();
     }
-    qCWarning(lcVncClient) << "Security failure reason:" << socket->read(reasonLength);
+    return true;
 }
 
 /*!
     \internal
-    Sends the client initialization message to the server.
-    
-    This message indicates whether the connection will be shared with other clients.
+    Sends a Fence message with \a flags and \a payload (at most 64 bytes).
 */
-void QVncClient::Private::clientInit()
+void QVncClient::Private::sendFence(quint32 flags, const QByteArray &payload)
 {
-    quint8 sharedFlag = 1;
-    write(sharedFlag);
-    state = ServerInitState;
+    appendFence(&tx, flags, payload);
+}
+
+void QVncClient::Private::appendFence(QByteArray *buffer, quint32 flags, const QByteArray &payload)
+{
+    append(buffer, ClientFence);
+    buffer->append("   "); // padding
+    append(buffer, quint32_be(flags));
+    append(buffer, quint8(payload.size()));
+    buffer->append(payload);
 }
 
 /*!
     \internal
-    Parses the server initialization message containing framebuffer dimensions,
-    pixel format, and the server name.
+    Sends a Fence round trip probe if the server supports Fence and no probe
+    has been sent during the last second.
 */
-void QVncClient::Private::parserServerInit()
+void QVncClient::Private::probeRoundTrip()
 {
-    if (socket->bytesAvailable() < 2 + 2 + 16 + 4) {
-        qCDebug(lcVncClient) << "Waiting for server init data:" << socket->peek(2 + 2 + 16 + 4);
+    if (!link.fenceSupported)
+        return;
+    const qint64 now = link.clock.nsecsElapsed();
+    if (link.fenceSentAt >= 0) {
+        // An unanswered probe blocks the next one, unless it is long lost
+        if (now - link.fenceSentAt < 10 * 1000000000LL)
+            return;
+    } else if (link.lastFenceAt >= 0 && now - link.lastFenceAt < 1000000000LL) {
         return;
     }
+    link.fenceSequence++;
+    link.fenceSentAt = now;
+    link.lastFenceAt = now;
+    QByteArray payload(sizeof(quint32), Qt::Uninitialized);
+    qToBigEndian(link.fenceSequence, payload.data());
+    sendFence(FenceRequest, payload);
+}
 
-    quint16_be framebufferWidth;
-    read(&framebufferWidth);
-    quint16_be framebufferHeight;
-    read(&framebufferHeight);
-    qCDebug(lcVncClient) << "Framebuffer size:" << framebufferWidth << "x" << framebufferHeight;
-    
-    frameBufferWidth = framebufferWidth;
-    frameBufferHeight = framebufferHeight;
-    emit q->framebufferSizeChanged(frameBufferWidth, frameBufferHeight);
+/*!
+    \internal
+    Reorders the encoding list by the estimated cost of a pixel and re-sends
+    SetEncodings when the preferred encoding changes.
     
-    image = QImage(framebufferWidth, framebufferHeight, QImage::Format_ARGB32);
-    image.fill(Qt::white);
-
-    read(&pixelFormat);
-    qCDebug(lcVncClient) << "Pixel format:";
-    qCDebug(lcVncClient) << "  Bits per pixel:" << pixelFormat.bitsPerPixel;
-    qCDebug(lcVncClient) << "  Depth:" << pixelFormat.depth;
-    qCDebug(lcVncClient) << "  Big endian:" << pixelFormat.bigEndianFlag;
-    qCDebug(lcVncClient) << "  True color:" << pixelFormat.trueColourFlag;
-    qCDebug(lcVncClient) << "  Red:" << pixelFormat.redMax << pixelFormat.redShift;
-    qCDebug(lcVncClient) << "  Green:" << pixelFormat.greenMax << pixelFormat.greenShift;
-    qCDebug(lcVncClient) << "  Blue:" << pixelFormat.blueMax << pixelFormat.blueShift;
+    The cost of an encoding is its decode time per pixel plus the time its
+    bytes per pixel take on the link. Raw wins on loopback, ZRLE on fast
+    networks and Tight (with JPEG) on slow links.
+*/
+void QVncClient::Private::adaptEncodings()
+{
+    if (!session.adaptiveEncoding)
+        return;
+    if (statistics.updates < 5 || (statistics.lastDecision.isValid() && statistics.lastDecision.elapsed() < 2000))
+        return;
 
-    quint32_be nameLength;
-    read(&nameLength);
-    qCDebug(lcVncClient) << "Name length:" << nameLength;
-    if (socket->bytesAvailable() < nameLength) {
-        qCDebug(lcVncClient) << "Waiting for name data:" << socket->peek(nameLength);
+    statistics.updates = 0;
+    statistics.lastDecision.start();
+    const QList<qint32> order = rankEncodings();
+    // Require a clear win before switching to avoid flapping
+    if (order.first() == statistics.order.first()
+            || encodingCost(order.first()) > encodingCost(statistics.order.first()) * 0.8)
         return;
-    }
-    const auto nameString = socket->read(nameLength);
-    qCDebug(lcVncClient) << "Server name:" << nameString;
-    state = WaitingState;
 
-    setPixelFormat();
-    
-    // Set supported encodings based on available libraries
-    const QList<qint32> encodings {
-        RawEncoding,
-        Hextile,
-        ZRLE,
-#ifdef USE_ZLIB
-        Tight,
-#endif
-    };
-    setEncodings(encodings);
-    framebufferUpdateRequest(false);
+    qCDebug(lcVncClient) << "Adapting encodings to" << order << "at" << estimatedThroughput() << "bytes/s";
+    statistics.order = order;
+    setEncodings(encodings());
 }
 
 /*!
     \internal
-    Sends a SetPixelFormat message to the server.
-    
-    This message configures the pixel format that the server should use when
-    sending framebuffer updates.
+    Returns the estimated time in nanoseconds to receive and decode one pixel
+    with \a encoding on the current link.
 */
-void QVncClient::Private::setPixelFormat()
+double QVncClient::Private::encodingCost(qint32 encoding) const
 {
-    write(SetPixelFormat);
-    write("   "); // padding
-    write(pixelFormat);
+    const auto cost = statistics.costs.value(encoding);
+    return cost.nsecsPerPixel + cost.bytesPerPixel * 1e9 / estimatedThroughput();
 }
 
 /*!
     \internal
-    Sends a SetEncodings message to the server.
-    
-    \param encodings List of encoding types the client supports, in order of preference.
+    Returns the supported encodings sorted from cheapest to most expensive.
 */
-void QVncClient::Private::setEncodings(const QList<qint32> &encodings)
+QList<qint32> QVncClient::Private::rankEncodings() const
 {
-    write(SetEncodings);
-    write(" "); // padding
-    write(quint16_be(encodings.length()));
-    for (const auto encoding : encodings)
-        write(qint32_be(encoding));
+    QList<qint32> order = statistics.costs.keys();
+    std::sort(order.begin(), order.end(), [this](qint32 a, qint32 b) {
+        return encodingCost(a) < encodingCost(b);
+    });
+    return order;
 }
 
 /*!
     \internal
-    Sends a FramebufferUpdateRequest message to the server.
-    
-    \param incremental If true, only changed parts of the framebuffer are requested.
-    \param rect The rectangle to update, or empty for the entire framebuffer.
+    Returns the measured link throughput in bytes per second, or a guess
+    based on the peer address while nothing has been measured yet.
 */
-void QVncClient::Private::framebufferUpdateRequest(bool incremental, const QRect &rect)
+double QVncClient::Private::estimatedThroughput() const
 {
-    write(FramebufferUpdateRequest);
-    write(quint8(incremental ? 1 : 0));
-    Rectangle rectangle;
-    if (rect.isEmpty()) {
-        rectangle.x = 0;
-        rectangle.y = 0;
-        rectangle.w = frameBufferWidth;
-        rectangle.h = frameBufferHeight;
-    } else {
-        rectangle.x = rect.x();
-        rectangle.y = rect.y();
-        rectangle.w = rect.width();
-        rectangle.h = rect.height();
-    }
-    write(rectangle);
+    if (link.throughput > 0)
+        return link.throughput;
+    return loopback ? 1e9 : 4e6;
 }
 
 /*!
     \internal
-    Parses and dispatches incoming server messages.
+    Handles raw-encoded rectangle data.
     
-    Reads the message type from the socket and calls the appropriate handler.
+    \param rect The rectangle dimensions.
+    
+    Raw encoding sends uncompressed pixel data for each pixel in the rectangle.
 */
-void QVncClient::Private::parseServerMessages()
+void QVncClient::Private::handleRawEncoding(const Rectangle &rect)
 {
-    if (socket->bytesAvailable() < 1) return;
-    quint8 messageType = 0;
-    read(&messageType);
-    switch (messageType) {
-    case FramebufferUpdate:
-        framebufferUpdate();
-        break;
-    default:
-        qCWarning(lcVncClient) << "Unknown message type:" << messageType;
+    const qint64 rowBytes = qint64(rect.w) * pixelFormat.bitsPerPixel / 8;
+
+    // A rectangle that has arrived completely is decoded concurrently
+    // with the others of its update
+    if (rawRow == 0 && available() >= rowBytes * rect.h) {
+        const QByteArray data = readBytes(rowBytes * rect.h);
+        defer(QRect(), 0, [this, rect, data]() { decodeRawRows(rect, 0, rect.h, data.constData()); });
+        return;
+    }
+
+    // Otherwise rows are decoded as they arrive, so that a large rectangle
+    // on a slow link shows up progressively
+    settle(QRect(rect.x, rect.y, rect.w, rect.h));
+    while (rawRow < rect.h) {
+        const int rows = rowBytes > 0 ? int(qMin<qint64>(rect.h - rawRow, available() / rowBytes)) : rect.h - rawRow;
+        if (rows == 0) {
+            starved = true;
+            return;
+        }
+        decodeRawRows(rect, rawRow, rows, rx.constData() + rxPos);
+        rxPos += rows * rowBytes;
+        addDamage(QRect(rect.x, rect.y + rawRow, rect.w, rows));
+        rawRow += rows;
+        commit();
     }
 }
 
 /*!
     \internal
-    Processes a framebuffer update message.
-    
-    Reads the number of rectangles and processes each one based on its encoding type.
+    Converts \a count rows of raw pixel \a data to the framebuffer, starting
+    at row \a first of \a rect.
 */
-void QVncClient::Private::framebufferUpdate()
+void QVncClient::Private::decodeRawRows(const Rectangle &rect, int first, int count, const char *data)
 {
-    if (socket->bytesAvailable() < 3) return;
-    socket->read(1); // padding
-    quint16_be numberOfRectangles;
-    read(&numberOfRectangles);
-    for (int i = 0; i < numberOfRectangles; i++) {
-        if (socket->bytesAvailable() < 12) return;
-        Rectangle rect;
-        read(&rect);
-        qint32_be encodingType;
-        read(&encodingType);
-
-        switch (static_cast<int>(encodingType)) {
-            case ZRLE:
-                handleZRLEEncoding(rect);
-                break;
-#ifdef USE_ZLIB
-            case Tight:
-                handleTightEncoding(rect);
-                break;
-#endif
-            case Hextile:
-                handleHextileEncoding(rect);
-                break;
-            case RawEncoding:
-                handleRawEncoding(rect);
-                break;
-            default:
-                qCWarning(lcVncClient) << "Unsupported encoding:" << encodingType;
-                // Skip this rectangle as we don't understand the encoding
-                continue; // Use continue instead of return to process remaining rectangles
+    if (pixelFormat.bitsPerPixel != 32) {
+        qCWarning(lcVncClient) << pixelFormat.bitsPerPixel << "bits per pixel not supported";
+        // Skip this pixel format as we don't support it
+        return;
+    }
+    const quint32_le *pixels = reinterpret_cast<const quint32_le *>(data);
+    for (int y = first; y < first + count; y++) {
+        for (int x = 0; x < rect.w; x++) {
+            const quint32 color = *pixels++;
+            const auto r = (color >> pixelFormat.redShift) & pixelFormat.redMax;
+            const auto g = (color >> pixelFormat.greenShift) & pixelFormat.greenMax;
+            const auto b = (color >> pixelFormat.blueShift) & pixelFormat.blueMax;
+            setPixel(rect.x + x, rect.y + y, qRgb(r, g, b));
         }
-        emit q->imageChanged(QRect(rect.x, rect.y, rect.w, rect.h));
     }
-    framebufferUpdateRequest();
 }
 
 /*!
     \internal
-    Handles raw-encoded rectangle data.
-    
+    Handles a CopyRect rectangle, which gives the position of an area of the
+    framebuffer to copy to the rectangle.
+
     \param rect The rectangle dimensions.
-    
-    Raw encoding sends uncompressed pixel data for each pixel in the rectangle.
 */
-void QVncClient::Private::handleRawEncoding(const Rectangle &rect)
+void QVncClient::Private::handleCopyRect(const Rectangle &rect)
 {
-    while (socket->bytesAvailable() < rect.w * rect.h * pixelFormat.bitsPerPixel / 8) {
-        socket->waitForReadyRead();
-    }
-    
-    for (int y = 0; y < rect.h; y++) {
-        for (int x = 0; x < rect.w; x++) {
-            switch (pixelFormat.bitsPerPixel) {
-            case 32: {
-                quint32_le color;
-                read(&color);
-                const auto r = (color >> pixelFormat.redShift) & pixelFormat.redMax;
-                const auto g = (color >> pixelFormat.greenShift) & pixelFormat.greenMax;
-                const auto b = (color >> pixelFormat.blueShift) & pixelFormat.blueMax;
-                image.setPixel(rect.x + x, rect.y + y, qRgb(r, g, b));
-                break; }
-            default:
-                qCWarning(lcVncClient) << pixelFormat.bitsPerPixel << "bits per pixel not supported";
-                // Skip this pixel format as we don't support it
-                return;
-            }
-        }
-        emit q->imageChanged(QRect(rect.x, rect.y, rect.w, rect.h));
+    quint16_be sourceX;
+    read(&sourceX);
+    quint16_be sourceY;
+    read(&sourceY);
+    if (starved)
+        return;
+
+    const QRect source(sourceX, sourceY, rect.w, rect.h);
+    const QPoint target(rect.x, rect.y);
+    defer(source, 0, [this, source, target]() { copyRect(source, target); });
+}
+
+void QVncClient::Private::copyRect(const QRect &source, const QPoint &target)
+{
+    // Clip both areas to the framebuffer
+    const QPoint offset = target - source.topLeft();
+    const QRect from = (QRect(target, source.size()) & frame->rect()).translated(-offset) & frame->rect();
+    if (from.isEmpty())
+        return;
+    const QRect to = from.translated(offset);
+
+    // Go against the direction of the move, so that overlapping rows are
+    // read before they are overwritten
+    const int bytesPerPixel = frame->depth() / 8;
+    const qsizetype length = qsizetype(to.width()) * bytesPerPixel;
+    const bool downwards = to.top() > from.top();
+    for (int i = 0; i < to.height(); i++) {
+        const int row = downwards ? to.height() - 1 - i : i;
+        memmove(frameBits + (to.top() + row) * frameBytesPerLine + to.left() * bytesPerPixel,
+                frameBits + (from.top() + row) * frameBytesPerLine + from.left() * bytesPerPixel,
+                length);
     }
-    framebufferUpdateRequest();
 }
 
 /*!
@@ -1308,38 +4683,47 @@ void QVncClient::Private::handleHextileEncoding(const Rectangle &rect)
 {
     const int tileWidth = 16;
     const int tileHeight = 16;
+    const int tilesPerRow = (rect.w + tileWidth - 1) / tileWidth;
+    const int tileCount = tilesPerRow * ((rect.h + tileHeight - 1) / tileHeight);
+
+    // Decoded right here, after the deferred rectangles it depends on
+    settle(QRect(rect.x, rect.y, rect.w, rect.h));
     
-    quint32 backgroundColor = 0;
-    quint32 foregroundColor = 0;
-    
-    // Process the rectangle tile by tile
-    for (int ty = 0; ty < rect.h; ty += tileHeight) {
+    // Process the rectangle tile by tile, committing after each one so that a
+    // large rectangle arriving in many chunks is decoded only once
+    for (; hextileTile < tileCount; hextileTile++) {
+        const int tx = (hextileTile % tilesPerRow) * tileWidth;
+        const int ty = (hextileTile / tilesPerRow) * tileHeight;
+        const int tw = qMin(tileWidth, rect.w - tx);
         const int th = qMin(tileHeight, rect.h - ty);
+        quint32 backgroundColor = hextileBackground;
+        quint32 foregroundColor = hextileForeground;
         
-        for (int tx = 0; tx < rect.w; tx += tileWidth) {
-            const int tw = qMin(tileWidth, rect.w - tx);
-            
-            // Read the subencoding mask
-            quint8 subencoding;
-            read(&subencoding);
-            
+        // Read the subencoding mask
+        quint8 subencoding;
+        read(&subencoding);
+        if (starved)
+            return;
+        
+        if (subencoding & HextileSubencoding::RawSubencoding) {
             // If raw bit is set, the tile is sent in raw encoding
-            if (subencoding & HextileSubencoding::RawSubencoding) {
-                for (int y = 0; y < th; y++) {
-                    for (int x = 0; x < tw; x++) {
-                        if (pixelFormat.bitsPerPixel == 32) {
-                            quint32_le color;
-                            read(&color);
-                            const auto r = (color >> pixelFormat.redShift) & pixelFormat.redMax;
-                            const auto g = (color >> pixelFormat.greenShift) & pixelFormat.greenMax;
-                            const auto b = (color >> pixelFormat.blueShift) & pixelFormat.blueMax;
-                            image.setPixel(rect.x + tx + x, rect.y + ty + y, qRgb(r, g, b));
-                        }
+            if (available() < qint64(tw) * th * pixelFormat.bitsPerPixel / 8) {
+                starved = true;
+                return;
+            }
+            for (int y = 0; y < th; y++) {
+                for (int x = 0; x < tw; x++) {
+                    if (pixelFormat.bitsPerPixel == 32) {
+                        quint32_le color;
+                        read(&color);
+                        const auto r = (color >> pixelFormat.redShift) & pixelFormat.redMax;
+                        const auto g = (color >> pixelFormat.greenShift) & pixelFormat.greenMax;
+                        const auto b = (color >> pixelFormat.blueShift) & pixelFormat.blueMax;
+                        setPixel(rect.x + tx + x, rect.y + ty + y, qRgb(r, g, b));
                     }
                 }
-                continue;
             }
-            
+        } else {
             // Background specified
             if (subencoding & HextileSubencoding::BackgroundSpecified) {
                 if (pixelFormat.bitsPerPixel == 32) {
@@ -1355,7 +4739,7 @@ void QVncClient::Private::handleHextileEncoding(const Rectangle &rect)
                     const auto r = (backgroundColor >> pixelFormat.redShift) & pixelFormat.redMax;
                     const auto g = (backgroundColor >> pixelFormat.greenShift) & pixelFormat.greenMax;
                     const auto b = (backgroundColor >> pixelFormat.blueShift) & pixelFormat.blueMax;
-                    image.setPixel(rect.x + tx + x, rect.y + ty + y, qRgb(r, g, b));
+                    setPixel(rect.x + tx + x, rect.y + ty + y, qRgb(r, g, b));
                 }
             }
             
@@ -1375,7 +4759,7 @@ void QVncClient::Private::handleHextileEncoding(const Rectangle &rect)
                 read(&numSubrects);
                 
                 // Process each subrectangle
-                for (int i = 0; i < numSubrects; i++) {
+                for (int i = 0; i < numSubrects && !starved; i++) {
                     quint32 color = foregroundColor;
                     
                     // If colored subrects, read the color
@@ -1403,15 +4787,79 @@ void QVncClient::Private::handleHextileEncoding(const Rectangle &rect)
                             const auto r = (color >> pixelFormat.redShift) & pixelFormat.redMax;
                             const auto g = (color >> pixelFormat.greenShift) & pixelFormat.greenMax;
                             const auto b = (color >> pixelFormat.blueShift) & pixelFormat.blueMax;
-                            image.setPixel(rect.x + tx + sx + x, rect.y + ty + sy + y, qRgb(r, g, b));
+                            setPixel(rect.x + tx + sx + x, rect.y + ty + sy + y, qRgb(r, g, b));
                         }
                     }
                 }
             }
         }
+        if (starved)
+            return;
+
+        // The tile is complete, colours carry over to the next one
+        hextileBackground = backgroundColor;
+        hextileForeground = foregroundColor;
+        commit();
+    }
+}
+
+/*!
+    \internal
+    Handles a Cursor pseudo-encoding rectangle.
+
+    \param rect The hot spot in x and y and the size of the shape.
+
+    The pixels of the shape are followed by a bitmask with a bit per pixel,
+    rows padded to whole bytes, that marks the opaque ones.
+*/
+void QVncClient::Private::handleCursor(const Rectangle &rect)
+{
+    const int bytesPerPixel = pixelFormat.bitsPerPixel / 8;
+    const qsizetype maskBytesPerLine = (rect.w + 7) / 8;
+    const qsizetype pixelBytes = qsizetype(rect.w) * rect.h * bytesPerPixel;
+    const QByteArray data = readBytes(pixelBytes + maskBytesPerLine * rect.h);
+    if (starved)
+        return;
+
+    QImage shape;
+    if (rect.w > 0 && rect.h > 0) {
+        shape = QImage(rect.w, rect.h, QImage::Format_ARGB32);
+        const uchar *pixels = reinterpret_cast<const uchar *>(data.constData());
+        const uchar *mask = pixels + pixelBytes;
+        for (int y = 0; y < rect.h; y++) {
+            QRgb *line = reinterpret_cast<QRgb *>(shape.scanLine(y));
+            for (int x = 0; x < rect.w; x++) {
+                quint32 value = 0;
+                for (int i = 0; i < bytesPerPixel; i++)
+                    value |= quint32(*pixels++) << (8 * i);
+                const bool opaque = mask[y * maskBytesPerLine + x / 8] & (0x80 >> (x % 8));
+                line[x] = opaque ? toRgb(value) : 0;
+            }
+        }
+    }
+    const QPoint hotSpot(rect.x, rect.y);
+    toClient([this, shape, hotSpot]() {
+        cursorShape = shape;
+        cursorHotSpot = hotSpot;
+        emit q->cursorShapeChanged(shape, hotSpot);
+    });
+}
+
+void QVncClient::Private::reportCursorPosition(const QPoint &position)
+{
+    const qsizetype echo = sentPositions.indexOf(position);
+    if (echo >= 0) {
+        // Everything sent before has been handled by the server as well
+        sentPositions.remove(0, echo + 1);
+        return;
     }
+    if (cursorPosition == position)
+        return;
+    cursorPosition = position;
+    emit q->cursorPositionChanged(position);
 }
 
+#ifdef USE_ZLIB
 /*!
     \internal
     Handles ZRLE-encoded rectangle data.
@@ -1423,259 +4871,406 @@ void QVncClient::Private::handleHextileEncoding(const Rectangle &rect)
 */
 void QVncClient::Private::handleZRLEEncoding(const Rectangle &rect)
 {
+    // Continue a rectangle whose data is inflated as it arrives
+    if (inflating) {
+        streamZlibRect(&Private::decodeZRLETiles);
+        return;
+    }
+
     // First read the length of the zlib-compressed data
-    if (socket->bytesAvailable() < 4) return;
     quint32_be zlibDataLength;
     read(&zlibDataLength);
-
-    if (zlibDataLength == 0)
+    if (starved || zlibDataLength == 0)
         return; // No data for this rectangle
 
-    // Read the compressed data
-    if (socket->bytesAvailable() < zlibDataLength) {
-        // Wait for more data
-        while (socket->bytesAvailable() < zlibDataLength) {
-            if (!socket->waitForReadyRead(5000)) {
-                qCWarning(lcVncClient) << "Timeout waiting for ZRLE data";
-                break; // Break out but don't return - allows more frames to be processed
-            }
-        }
-    }
-    
-    QByteArray compressedData = socket->read(zlibDataLength);
-    
-    // Use Qt's own QByteArray-based zlib decompression
-    QByteArray uncompressedData = qUncompress(compressedData);
-    if (uncompressedData.isEmpty()) {
-        qCWarning(lcVncClient) << "Failed to decompress ZRLE data, requesting new update";
-        // Request a new frame instead of returning
-        framebufferUpdateRequest();
+    // A rectangle that has arrived completely is decoded concurrently with
+    // the others of its update
+    if (available() >= qint64(zlibDataLength)) {
+        const QByteArray compressedData = readBytes(zlibDataLength);
+        deferZlibRect(ZlibRect(), compressedData, TightData::ZRLEIndex, 0, &Private::decodeZRLETiles);
         return;
     }
-    
-    // Process the decompressed data
-    int dataOffset = 0;
-    
-    // Each tile is 64x64 pixels
-    const int tileWidth = 64;
-    const int tileHeight = 64;
-    
-    // Determine bytes per pixel (always 1 in ZRLE)
-    const int bytesPerPixel = pixelFormat.bitsPerPixel / 8;
-    
-    // Process each tile
-    for (int ty = 0; ty < rect.h; ty += tileHeight) {
-        const int th = qMin(tileHeight, rect.h - ty);
-        
-        for (int tx = 0; tx < rect.w; tx += tileWidth) {
-            const int tw = qMin(tileWidth, rect.w - tx);
 
-            // Read subencoding type (one byte) 
-            // 0=raw, 1=solid, 2=packed palette, 3=RLE palette, 8-127=plain RLE
-            if (dataOffset >= uncompressedData.size()) {
-                qCWarning(lcVncClient) << "ZRLE data truncated (subencoding)";
-                return;
+    // Otherwise it is inflated as it arrives, after the decoders still
+    // using the stream or the area
+    commit();
+    settle(QRect(rect.x, rect.y, rect.w, rect.h), ZRLEStream);
+    zlibRect = ZlibRect();
+    zlibRect.in.stream = zlibStream(TightData::ZRLEIndex);
+    zlibRect.in.remaining = zlibDataLength;
+    inflating = true;
+    streamZlibRect(&Private::decodeZRLETiles);
+}
+
+/*!
+    \internal
+    Decodes the 64x64 tiles of a ZRLE rectangle from the data inflated by
+    \a z, continuing at tile \c{z->next}.
+
+    A tile is decoded once all of its data has been inflated, so the window
+    never holds much more than one tile. Returns false if the data ran out
+    before the last tile.
+*/
+bool QVncClient::Private::decodeZRLETiles(const Rectangle &rect, ZlibRect *z)
+{
+    Inflater &in = z->in;
+    const int tileSize = 64;
+    const int columns = (rect.w + tileSize - 1) / tileSize;
+    const int tiles = columns * ((rect.h + tileSize - 1) / tileSize);
+
+    // A CPIXEL leaves out the unused byte of 32 bit true colour pixels
+    int pixelSize = pixelFormat.bitsPerPixel / 8;
+    int pixelShift = 0;
+    if (pixelFormat.trueColourFlag && pixelFormat.bitsPerPixel == 32 && pixelFormat.depth <= 24) {
+        const quint32 mask = (quint32(pixelFormat.redMax) << pixelFormat.redShift)
+                | (quint32(pixelFormat.greenMax) << pixelFormat.greenShift)
+                | (quint32(pixelFormat.blueMax) << pixelFormat.blueShift);
+        if (!(mask & 0xff000000)) {
+            pixelSize = 3;
+        } else if (!(mask & 0x000000ff)) {
+            pixelSize = 3;
+            pixelShift = 8;
+        }
+    }
+    const auto color = [&](const uchar *data) {
+        quint32 value = 0;
+        for (int i = 0; i < pixelSize; i++)
+            value |= quint32(data[i]) << (8 * i);
+        return toRgb(value << pixelShift);
+    };
+
+    QRgb palette[128];
+    for (; z->next < tiles; z->next++) {
+        const int tx = (z->next % columns) * tileSize;
+        const int ty = (z->next / columns) * tileSize;
+        const int tw = qMin(tileSize, rect.w - tx);
+        const int th = qMin(tileSize, rect.h - ty);
+        const int left = rect.x + tx;
+        const int top = rect.y + ty;
+
+        // Bytes are taken relative to the start of the tile, which is
+        // decoded again from there if its data runs out
+        qsizetype at = 0;
+        const auto take = [&](qsizetype size) -> const uchar * {
+            if (!in.need(at + size))
+                return nullptr;
+            const uchar *data = in.data() + at;
+            at += size;
+            return data;
+        };
+        // Run lengths are one more than the sum of their bytes, the last of
+        // which is not 255
+        const auto runLength = [&]() {
+            int length = 1;
+            for (;;) {
+                const uchar *byte = take(1);
+                if (!byte)
+                    return 0;
+                length += *byte;
+                if (*byte != 255)
+                    return length;
             }
-            
-            quint8 subencoding = static_cast<quint8>(uncompressedData.at(dataOffset++));
-            
-            // Handle the different subencodings
-            if (subencoding == 0) { // Raw pixels
-                // Raw pixel data
-                int expectedBytes = tw * th * 4; // ZRLE always uses 32bpp
-                
-                if (dataOffset + expectedBytes > uncompressedData.size()) {
-                    qCWarning(lcVncClient) << "ZRLE data truncated (raw data)";
-                    continue;
-                }
-                
-                for (int y = 0; y < th; y++) {
-                    for (int x = 0; x < tw; x++) {
-                        quint32 color = 0;
-                        
-                        // Read pixel data according to bpp
-                        if (bytesPerPixel == 4) {
-                            color = *reinterpret_cast<const quint32*>(uncompressedData.constData() + dataOffset);
-                            dataOffset += 4;
-                        } else if (bytesPerPixel == 3) {
-                            color = *reinterpret_cast<const quint8*>(uncompressedData.constData() + dataOffset) |
-                                   (*reinterpret_cast<const quint8*>(uncompressedData.constData() + dataOffset + 1) << 8) |
-                                   (*reinterpret_cast<const quint8*>(uncompressedData.constData() + dataOffset + 2) << 16);
-                            dataOffset += 3;
-                        } else if (bytesPerPixel == 2) {
-                            color = *reinterpret_cast<const quint16*>(uncompressedData.constData() + dataOffset);
-                            dataOffset += 2;
-                        } else if (bytesPerPixel == 1) {
-                            color = *reinterpret_cast<const quint8*>(uncompressedData.constData() + dataOffset);
-                            dataOffset += 1;
-                        }
-                        
-                        // Convert to RGB and set pixel
-                        const auto r = (color >> pixelFormat.redShift) & pixelFormat.redMax;
-                        const auto g = (color >> pixelFormat.greenShift) & pixelFormat.greenMax;
-                        const auto b = (color >> pixelFormat.blueShift) & pixelFormat.blueMax;
-                        image.setPixel(rect.x + tx + x, rect.y + ty + y, qRgb(r, g, b));
-                    }
-                }
-            } else if (subencoding == 1) {
-                // Solid tile - single color for all pixels
-                if (dataOffset + bytesPerPixel > uncompressedData.size()) {
-                    qCWarning(lcVncClient) << "ZRLE data truncated (solid color)";
-                    continue;
-                }
-                
-                quint32 color = *reinterpret_cast<const quint32*>(uncompressedData.constData() + dataOffset);
-                dataOffset += 4;
-                
-                const auto r = (color >> pixelFormat.redShift) & pixelFormat.redMax;
-                const auto g = (color >> pixelFormat.greenShift) & pixelFormat.greenMax;
-                const auto b = (color >> pixelFormat.blueShift) & pixelFormat.blueMax;
-                QRgb rgbColor = qRgb(r, g, b);
-                
-                // Fill the entire tile with this color
-                for (int y = 0; y < th; y++) {
-                    for (int x = 0; x < tw; x++) {
-                        image.setPixel(rect.x + tx + x, rect.y + ty + y, rgbColor);
-                    }
-                }
-            } else if (subencoding == 2) {
-                // Packed Palette encoding
-                // First byte is the palette size (1-127)
-                if (dataOffset >= uncompressedData.size()) {
-                    qCWarning(lcVncClient) << "ZRLE data truncated (palette size)";
-                    continue;
-                }
-                
-                quint8 paletteSize = static_cast<quint8>(uncompressedData.at(dataOffset++));
-                if (paletteSize == 0 || dataOffset + (paletteSize * 4) > uncompressedData.size()) {
-                    qCWarning(lcVncClient) << "ZRLE data truncated (palette colors)";
-                    continue;
+        };
+
+        const uchar *data = take(1);
+        if (!data)
+            return false;
+        const int subencoding = *data;
+        const int paletteSize = subencoding >= 130 ? subencoding - 128 : subencoding <= 16 ? subencoding : 0;
+        if (paletteSize > 1) {
+            if (!(data = take(paletteSize * pixelSize)))
+                return false;
+            for (int i = 0; i < paletteSize; i++)
+                palette[i] = color(data + i * pixelSize);
+        }
+
+        if (subencoding == 0) {
+            // Raw pixels
+            if (!(data = take(qsizetype(tw) * th * pixelSize)))
+                return false;
+            for (int y = 0; y < th; y++) {
+                for (int x = 0; x < tw; x++) {
+                    setPixel(left + x, top + y, color(data));
+                    data += pixelSize;
                 }
-                
-                // Read the palette
-                QVector<QRgb> palette(paletteSize);
-                for (int i = 0; i < paletteSize; i++) {
-                    quint32 color = *reinterpret_cast<const quint32*>(uncompressedData.constData() + dataOffset);
-                    dataOffset += 4;
-                    
-                    const auto r = (color >> pixelFormat.redShift) & pixelFormat.redMax;
-                    const auto g = (color >> pixelFormat.greenShift) & pixelFormat.greenMax;
-                    const auto b = (color >> pixelFormat.blueShift) & pixelFormat.blueMax;
-                    palette[i] = qRgb(r, g, b);
+            }
+        } else if (subencoding == 1) {
+            // Solid tile
+            if (!(data = take(pixelSize)))
+                return false;
+            fillRect(QRect(left, top, tw, th), color(data));
+        } else if (subencoding <= 16) {
+            // Packed palette indices, rows start at byte boundaries
+            const int bits = paletteSize == 2 ? 1 : paletteSize <= 4 ? 2 : 4;
+            const int rowBytes = (tw * bits + 7) / 8;
+            if (!(data = take(qsizetype(rowBytes) * th)))
+                return false;
+            for (int y = 0; y < th; y++) {
+                const uchar *row = data + y * rowBytes;
+                for (int x = 0; x < tw; x++) {
+                    const int bit = x * bits;
+                    const int index = (row[bit / 8] >> (8 - bits - bit % 8)) & ((1 << bits) - 1);
+                    setPixel(left + x, top + y, palette[qMin(index, paletteSize - 1)]);
                 }
-                
-                // Determine bits per palette entry
-                int bitsPerPaletteEntry;
-                if (paletteSize <= 2) {
-                    bitsPerPaletteEntry = 1;
-                } else if (paletteSize <= 4) {
-                    bitsPerPaletteEntry = 2;
-                } else if (paletteSize <= 16) {
-                    bitsPerPaletteEntry = 4;
+            }
+        } else if (subencoding == 128 || subencoding >= 130) {
+            // Plain or palette run-length encoding
+            const int count = tw * th;
+            for (int done = 0; done < count;) {
+                QRgb runColor = 0;
+                int length = 1;
+                if (subencoding == 128) {
+                    if (!(data = take(pixelSize)))
+                        return false;
+                    runColor = color(data);
+                    length = runLength();
                 } else {
-                    bitsPerPaletteEntry = 8;
-                }
-                
-                // Calculate bytes needed for packed palette data
-                int bytesPerLine = (tw * bitsPerPaletteEntry + 7) / 8;
-                int totalBytes = bytesPerLine * th;
-                
-                if (dataOffset + totalBytes > uncompressedData.size()) {
-                    qCWarning(lcVncClient) << "ZRLE data truncated (packed data)";
-                    continue;
-                }
-                
-                // Process each pixel
-                int byteOffset = 0;
-                for (int y = 0; y < th; y++) {
-                    int bitOffset = 0;
-                    
-                    for (int x = 0; x < tw; x++) {
-                        // Extract palette index from packed data
-                        int index = 0;
-                        
-                        if (bitsPerPaletteEntry == 1) {
-                            // 1 bit per entry (palette size <= 2)
-                            quint8 byte = static_cast<quint8>(uncompressedData.at(dataOffset + byteOffset));
-                            index = (byte >> (7 - bitOffset)) & 0x01;
-                            bitOffset++;
-                            if (bitOffset == 8) {
-                                bitOffset = 0;
-                                byteOffset++;
-                            }
-                        } else if (bitsPerPaletteEntry == 2) {
-                            // 2 bits per entry (palette size <= 4)
-                            quint8 byte = static_cast<quint8>(uncompressedData.at(dataOffset + byteOffset));
-                            index = (byte >> (6 - bitOffset)) & 0x03;
-                            bitOffset += 2;
-                            if (bitOffset == 8) {
-                                bitOffset = 0;
-                                byteOffset++;
-                            }
-                        } else if (bitsPerPaletteEntry == 4) {
-                            // 4 bits per entry (palette size <= 16)
-                            quint8 byte = static_cast<quint8>(uncompressedData.at(dataOffset + byteOffset));
-                            index = (byte >> (4 - bitOffset)) & 0x0f;
-                            bitOffset += 4;
-                            if (bitOffset == 8) {
-                                bitOffset = 0;
-                                byteOffset++;
-                            }
-                        } else { // bitsPerPaletteEntry == 8
-                            // 8 bits per entry (palette size <= 127)
-                            index = static_cast<quint8>(uncompressedData.at(dataOffset + byteOffset++)) & 0x7f;
-                        }
-                        
-                        // Set the pixel color from the palette
-                        if (index < paletteSize) {
-                            image.setPixel(rect.x + tx + x, rect.y + ty + y, palette[index]);
-                        }
-                    }
-                    
-                    // Move to the next complete line
-                    if (bitsPerPaletteEntry < 8 && bitOffset > 0) {
-                        byteOffset++;
-                        bitOffset = 0;
+                    if (!(data = take(1)))
+                        return false;
+                    const int index = *data & 0x7f;
+                    if (index >= paletteSize) {
+                        qCWarning(lcVncClient) << "ZRLE palette index out of range";
+                        in.failed = true;
+                        return false;
                     }
+                    runColor = palette[index];
+                    if (*data & 0x80)
+                        length = runLength();
                 }
-                
-                dataOffset += totalBytes;
-            } else if (subencoding == 3) {
-                // RLE Palette encoding - skip for now
-                qCWarning(lcVncClient) << "RLE Palette encoding (type 3) not fully implemented";
-                continue;
-            } else {
-                // Plain RLE (8-127) - skip for now
-                qCWarning(lcVncClient) << "Plain RLE encoding (types 8-127) not implemented";
-                continue;
+                if (length == 0)
+                    return false;
+                if (length > count - done) {
+                    qCWarning(lcVncClient) << "ZRLE run exceeds its tile";
+                    in.failed = true;
+                    return false;
+                }
+                for (int i = done; i < done + length; i++)
+                    setPixel(left + i % tw, top + i / tw, runColor);
+                done += length;
             }
+        } else {
+            qCWarning(lcVncClient) << "Invalid ZRLE subencoding" << subencoding;
+            in.failed = true;
+            return false;
         }
+
+        in.consume(at);
+        z->rowsDone = qMin<int>(rect.h, (z->next + 1) / columns * tileSize);
     }
+    return true;
 }
+#endif
 
 /*!
     \internal
     Translates Qt key events to VNC key events and sends them to the server.
     
     \param e The keyboard event to be processed and sent.
+
+    A release sends the keysym its press sent, even if modifiers changed in
+    between, so that no key stays down on the server.
 */
 void QVncClient::Private::keyEvent(QKeyEvent *e)
 {
-    if (!socket) return;
-    const quint8 messageType = 0x04;
-    write(messageType);
-    const quint8 downFlag = e->type() == QEvent::KeyPress ? 1 : 0;
-    write(downFlag);
-    socket->write("  "); // padding
+    if (!connected) return;
+    const bool down = e->type() == QEvent::KeyPress;
+    const quint32 id = e->nativeScanCode() ? e->nativeScanCode() : quint32(e->key()) | 0x80000000;
+
+    qsizetype index = 0;
+    while (index < pressedKeys.size() && pressedKeys.at(index).id != id)
+        index++;
+
+    PressedKey pressed { id, 0, 0 };
+    if (index < pressedKeys.size()) {
+        pressed = pressedKeys.at(index);
+        if (!down)
+            pressedKeys.remove(index);
+    } else {
+        pressed.keysym = keysym(e->key(), e->modifiers(), e->text());
+        pressed.keycode = xtKeycode(e->nativeScanCode());
+        if (down)
+            pressedKeys.append(pressed);
+    }
+
+    qCDebug(lcVncClient) << "Key event:" << e->type() << e->key() << Qt::hex << pressed.keysym << pressed.keycode;
+    if (pressed.keysym == 0 && (pressed.keycode == 0 || !qemuKeyEvents))
+        return;
+    sendKey(down, pressed.keysym, pressed.keycode);
+}
+
+void QVncClient::Private::sendKey(bool down, quint32 keysym, quint32 keycode)
+{
+    QByteArray message;
+    if (qemuKeyEvents && keycode) {
+        append(&message, QemuClientMessage);
+        append(&message, quint8(0)); // extended key event
+        append(&message, quint16_be(down ? 1 : 0));
+        append(&message, quint32_be(keysym));
+        append(&message, quint32_be(keycode));
+    } else {
+        const quint8 messageType = 0x04;
+        append(&message, messageType);
+        append(&message, quint8(down ? 1 : 0));
+        message.append("  "); // padding
+        append(&message, quint32_be(keysym));
+    }
+    sendInput(message);
+}
+
+quint32 QVncClient::Private::keysym(int key, Qt::KeyboardModifiers modifiers, const QString &text)
+{
+    if (modifiers & Qt::KeypadModifier) {
+        if (key >= Qt::Key_0 && key <= Qt::Key_9)
+            return 0xffb0 + (key - Qt::Key_0);
+        for (const auto &mapping : keypadKeys) {
+            if (mapping.key == key)
+                return mapping.keysym;
+        }
+    }
+
+    if (key >= Qt::Key_Escape && key < Qt::Key_Escape + SpecialKeyCount) {
+        if (const quint32 keysym = specialKeyTable[key - Qt::Key_Escape])
+            return keysym;
+    }
+    if (key == Qt::Key_AltGr)
+        return 0xfe03; // ISO_Level3_Shift
+    // Input method and dead keys follow the order of the keysyms
+    if (key >= Qt::Key_Multi_key && key <= Qt::Key_Hangul_Special)
+        return 0xff20 + (key - Qt::Key_Multi_key);
+    if (key >= Qt::Key_Dead_Grave && key <= Qt::Key_Dead_Horn)
+        return 0xfe50 + (key - Qt::Key_Dead_Grave);
+
+    // The text carries the character the layout and Shift produced
+    char32_t ucs = 0;
+    if (!text.isEmpty()) {
+        ucs = text.at(0).unicode();
+        if (text.at(0).isHighSurrogate() && text.size() > 1)
+            ucs = QChar::surrogateToUcs4(text.at(0), text.at(1));
+    }
+    // Control characters come with Ctrl held, send the key itself then
+    if (ucs < 0x20 || ucs == 0x7f) {
+        if (key >= Qt::Key_A && key <= Qt::Key_Z)
+            return key - Qt::Key_A + 'a';
+        if (key < Qt::Key_Escape)
+            ucs = char32_t(key);
+        else
+            return 0;
+    }
+    return characterKeysym(ucs);
+}
+
+quint32 QVncClient::Private::characterKeysym(char32_t ucs)
+{
+    // Latin-1 keysyms equal their code points, the rest are offset
+    if ((ucs >= 0x20 && ucs <= 0x7e) || (ucs >= 0xa0 && ucs <= 0xff))
+        return ucs;
+    return 0x01000000 | ucs;
+}
+
+/*!
+    \internal
+    Queues the keysyms typing \a text and starts sending them.
+*/
+void QVncClient::Private::typeText(const QString &text, int rate)
+{
+    typingRate = rate;
+    const QList<uint> codePoints = text.toUcs4();
+    typing.reserve(typing.size() + codePoints.size());
+    for (qsizetype i = 0; i < codePoints.size(); i++) {
+        const char32_t ucs = codePoints.at(i);
+        if (ucs == '\r' && i + 1 < codePoints.size() && codePoints.at(i + 1) == '\n')
+            continue;
+        if (ucs == '\n' || ucs == '\r')
+            typing.append(0xff0d); // Return
+        else if (ucs == '\t')
+            typing.append(0xff09); // Tab
+        else if (ucs >= 0x20 && ucs != 0x7f)
+            typing.append(characterKeysym(ucs));
+    }
+    typingRequested = true;
+    typeMore();
+}
+
+/*!
+    \internal
+    Sends the next chunks of the text being typed as far as the pacing
+    allows.
+
+    Each chunk is a press and a release per character followed by a Fence
+    the server answers only once it has processed the keys before it, so
+    that no more than TypingWindow bytes of keys are queued on the server.
+    Servers without Fence get a chunk per tick of typingTimer instead.
+*/
+void QVncClient::Private::typeMore()
+{
+    if (!connected) {
+        typing.clear();
+        typingPos = 0;
+        typingRequested = false;
+        typingTimer.stop();
+        return;
+    }
+
+    while (typingPos < typing.size() && !typingTimer.isActive()
+           && (!serverFences || typingInFlight < TypingWindow)) {
+        // The rate is met with a chunk per tick
+        int chunk = TypingChunk;
+        int interval = TypingInterval;
+        if (typingRate > 0) {
+            chunk = qBound(1, typingRate * TypingInterval / 1000, TypingChunk);
+            interval = chunk * 1000 / typingRate;
+        }
+        chunk = int(qMin<qsizetype>(chunk, typing.size() - typingPos));
+
+        QByteArray batch;
+        batch.reserve(chunk * 16 + 16);
+        for (qsizetype i = typingPos; i < typingPos + chunk; i++) {
+            for (const quint8 down : { 1, 0 }) {
+                append(&batch, quint8(0x04));
+                append(&batch, down);
+                batch.append("  "); // padding
+                append(&batch, quint32_be(typing.at(i)));
+            }
+        }
+        typingPos += chunk;
+        if (serverFences) {
+            appendFence(&batch, FenceBlockBefore | FenceRequest, QByteArray::fromRawData(TypingFence, sizeof(TypingFence) - 1));
+            typingInFlight += batch.size();
+            typingChunks.append(batch.size());
+        }
+        send(batch, true);
+        if (typingRate > 0 || !serverFences)
+            typingTimer.start(interval);
+    }
 
-    const auto key = e->key();
-    quint32_be code;
-    if (keyMap.contains(key))
-        code = keyMap.value(key);
-    else if (!e->text().isEmpty())
-        code = e->text().at(0).unicode();
-    qCDebug(lcVncClient) << "Key event:" << e->type() << key << code;
-    write(code);
+    if (typingRequested && typingPos == typing.size() && typingInFlight == 0 && !typingTimer.isActive()) {
+        typing.clear();
+        typingPos = 0;
+        typingRequested = false;
+        emit q->textTyped();
+    }
+}
+
+quint32 QVncClient::Private::xtKeycode(quint32 nativeScanCode)
+{
+#if defined(Q_OS_WIN)
+    // Set 1 make code with the extended (0xe0 prefix) flag in bit 8
+    const quint32 code = nativeScanCode & 0x7f;
+    return code ? code | ((nativeScanCode & 0x100) ? 0x80 : 0) : 0;
+#elif defined(Q_OS_UNIX) && !defined(Q_OS_DARWIN)
+    // X11 and Wayland key codes are Linux input event codes plus 8
+    if (nativeScanCode <= 8)
+        return 0;
+    const quint32 code = nativeScanCode - 8;
+    if (code < 89)
+        return code;
+    if (code - 89 < sizeof(evdevExtendedKeycodes))
+        return evdevExtendedKeycodes[code - 89];
+    return 0;
+#else
+    Q_UNUSED(nativeScanCode);
+    return 0;
+#endif
 }
 
 /*!
@@ -1683,23 +5278,60 @@ void QVncClient::Private::keyEvent(QKeyEvent *e)
     Translates Qt mouse events to VNC pointer events and sends them to the server.
     
     \param e The mouse event to be processed and sent.
+
+    Motion is limited to pointerRate messages per second; only the latest
+    position of each interval is sent. Button changes are never held back.
 */
 void QVncClient::Private::pointerEvent(QMouseEvent *e)
 {
-    if (!socket) return;
-    const quint8 messageType = 0x05;
-    write(messageType);
+    if (!connected) return;
 
     quint8 buttonMask = 0;
     if (e->buttons() & Qt::LeftButton) buttonMask |= 1;
     if (e->buttons() & Qt::MiddleButton) buttonMask |= 2;
     if (e->buttons() & Qt::RightButton) buttonMask |= 4;
-    write(buttonMask);
+    pointerPosition = e->position().toPoint();
+
+    // Presses and releases go out right away, at the position they
+    // happened at, so that clicks and drags stay exact
+    const qint64 interval = pointerRate > 0 ? 1000 / pointerRate : 0;
+    if (buttonMask != pointerButtons || !pointerClock.isValid() || pointerClock.elapsed() >= interval) {
+        pointerTimer.stop();
+        sendPointer(buttonMask, pointerPosition.x(), pointerPosition.y());
+        return;
+    }
+
+    // Motion within the interval only moves the position that is sent
+    // when it is over
+    pointerPending = true;
+    if (!pointerTimer.isActive())
+        pointerTimer.start(int(interval - pointerClock.elapsed()));
+}
 
-    quint16_be x(qRound(e->position().x()));
-    write(x);
-    quint16_be y(qRound(e->position().y()));
-    write(y);
+void QVncClient::Private::sendPointer(quint8 buttonMask, int x, int y)
+{
+    QByteArray message;
+    const quint8 messageType = 0x05;
+    append(&message, messageType);
+    append(&message, buttonMask);
+    append(&message, quint16_be(qBound(0, x, 0xffff)));
+    append(&message, quint16_be(qBound(0, y, 0xffff)));
+    sendInput(message);
+
+    pointerButtons = buttonMask;
+    pointerPending = false;
+    pointerClock.start();
+    if (settings.localCursor) {
+        if (sentPositions.size() == 32)
+            sentPositions.removeFirst();
+        sentPositions.append(QPoint(x, y));
+    }
+}
+
+void QVncClient::Private::flushPointer()
+{
+    if (pointerPending)
+        sendPointer(pointerButtons, pointerPosition.x(), pointerPosition.y());
 }
 
 /*!
@@ -1715,43 +5347,155 @@ void QVncClient::Private::pointerEvent(QMouseEvent *e)
 */
 
 /*!
-    Constructs a VNC client with the given \a parent object.
+    Constructs a VNC client with the given \a parent object.
+*/
+QVncClient::QVncClient(QObject *parent)
+    : QObject(parent)
+    , d(new Private(this))
+{
+}
+
+/*!
+    Destroys the VNC client and frees its resources.
+*/
+QVncClient::~QVncClient() = default;
+
+/*!
+    Returns the TCP socket used for the VNC connection, or \nullptr if the
+    connection uses another kind of device.
+    
+    \sa setSocket(), device()
+*/
+QTcpSocket *QVncClient::socket() const
+{
+    return qobject_cast<QTcpSocket *>(d->device);
+}
+
+/*!
+    Sets the socket used for VNC communication to \a socket.
+    
+    \note The socket should be created and connected by the caller.
+    The VNC protocol handshake will start automatically once the
+    socket is connected.
+
+    This is the same as setDevice() with a socket.
+    
+    \sa socket(), setDevice()
+*/
+void QVncClient::setSocket(QTcpSocket *socket)
+{
+    setDevice(socket);
+}
+
+/*!
+    Returns the device the VNC connection runs over.
+
+    \sa setDevice()
+*/
+QIODevice *QVncClient::device() const
+{
+    return d->device;
+}
+
+/*!
+    Runs the VNC connection over \a device, which may be any sequential
+    QIODevice.
+
+    Besides a QTcpSocket, this can be a QLocalSocket connected to a Unix
+    domain socket, such as the one of \c{qemu -vnc unix:path}, which
+    avoids the loopback TCP stack, a QProcess whose standard input and
+    output tunnel the connection, or a custom transport.
+
+    The handshake starts when a QAbstractSocket or QLocalSocket connects,
+    when a QProcess has started, or right away for other devices that are
+    open. The session ends when the device disconnects, finishes or is
+    closed.
+
+    \sa device(), isConnected()
+*/
+void QVncClient::setDevice(QIODevice *device)
+{
+    if (d->device == device) return;
+    const bool wasSocket = qobject_cast<QTcpSocket *>(d->device) || qobject_cast<QTcpSocket *>(device);
+    d->device = device;
+    emit deviceChanged(device);
+    if (wasSocket)
+        emit socketChanged(qobject_cast<QTcpSocket *>(device));
+}
+
+/*!
+    Returns whether the device of the connection is connected.
+
+    \sa connectionStateChanged()
 */
-QVncClient::QVncClient(QObject *parent)
-    : QObject(parent)
-    , d(new Private(this))
+bool QVncClient::isConnected() const
 {
+    return d->connected;
 }
 
 /*!
-    Destroys the VNC client and frees its resources.
+    Runs the VNC connection over \a socketDescriptor, a native stream socket
+    that is already connected to the server. The client takes ownership of
+    the descriptor and closes it when the connection ends or moves to another
+    device. Returns false if the descriptor cannot be used.
+
+    On Linux, the socket bypasses QTcpSocket: a few epoll threads shared by
+    all clients watch the sockets, and data is read with \c readv() directly
+    into the receive buffer of the parser, on the decode threads if the
+    client is threaded. This saves a copy of every received byte and the
+    event loop round trip for each read, which matters with many busy
+    connections. On kernels from 6.0 on, io_uring is used instead of epoll
+    when available: the kernel receives into a ring of buffers shared by the
+    connections without a system call per read, and the parser reads these
+    buffers in place. Setting the \c QT_VNCCLIENT_NO_IO_URING environment
+    variable keeps new connections on epoll. Elsewhere, the descriptor is
+    wrapped in a QTcpSocket owned by the client.
+
+    \sa setDevice(), threaded
 */
-QVncClient::~QVncClient() = default;
+bool QVncClient::setSocketDescriptor(qintptr socketDescriptor)
+{
+    setDevice(nullptr);
+    // Ends a session on a previous descriptor
+    d->deviceClosed();
+    d->closeNative();
+    return d->openNative(socketDescriptor);
+}
 
 /*!
-    Returns the TCP socket used for the VNC connection.
-    
-    \sa setSocket()
+    Returns the WebSocket endpoint the connection is upgraded to, or an
+    empty URL if the device carries plain RFB.
+
+    \sa setWebSocketUrl()
 */
-QTcpSocket *QVncClient::socket() const
+QUrl QVncClient::webSocketUrl() const
 {
-    return d->socket;
+    return d->webSocketUrl;
 }
 
 /*!
-    Sets the socket used for VNC communication to \a socket.
-    
-    \note The socket should be created and connected by the caller.
-    The VNC protocol handshake will start automatically once the
-    socket is connected.
-    
-    \sa socket()
+    Runs the VNC connection in WebSocket frames to \a webSocketUrl, such as
+    \c{ws://host:6080/websockify}, as websockify, noVNC deployments and the
+    consoles of Proxmox VE or OpenStack expect.
+
+    Connect the device to the host and port of the URL; for \c wss URLs use
+    a QSslSocket and start its encryption. Once the device is connected, the
+    client sends the HTTP upgrade request with the path and query of the
+    URL, checks the response and then speaks RFB in binary frames. The
+    frames are taken apart in place as they arrive, writing their unmasked
+    payload straight into the receive buffer of the parser, so they add no
+    copy of the data over plain RFB.
+
+    The URL takes effect with the next connection and applies to devices
+    only; native sockets given to setSocketDescriptor() carry plain RFB.
+
+    \sa webSocketUrl(), setDevice()
 */
-void QVncClient::setSocket(QTcpSocket *socket)
+void QVncClient::setWebSocketUrl(const QUrl &webSocketUrl)
 {
-    if (d->socket == socket) return;
-    d->socket = socket;
-    emit socketChanged(socket);
+    if (d->webSocketUrl == webSocketUrl) return;
+    d->webSocketUrl = webSocketUrl;
+    emit webSocketUrlChanged(webSocketUrl);
 }
 
 /*!
@@ -1804,6 +5548,478 @@ void QVncClient::setSecurityType(QVncClient::SecurityType securityType)
     emit securityTypeChanged(securityType);
 }
 
+/*!
+    Returns the JPEG quality level requested from the server.
+
+    The level ranges from 0 (lowest quality, smallest size) to 9 (highest
+    quality). A value of -1 means no quality level is sent and the server
+    uses its default, which for Tight usually means lossless compression.
+
+    \sa setQualityLevel(), compressionLevel()
+*/
+int QVncClient::qualityLevel() const
+{
+    return d->settings.qualityLevel;
+}
+
+/*!
+    Sets the JPEG quality level to \a qualityLevel.
+
+    The value is sent as one of the -32 to -23 pseudo-encodings. Values
+    outside 0-9 are clamped, except -1 which removes the pseudo-encoding.
+    Changing the level while connected re-sends SetEncodings, so it takes
+    effect without reconnecting.
+
+    \sa qualityLevel()
+*/
+void QVncClient::setQualityLevel(int qualityLevel)
+{
+    qualityLevel = qBound(-1, qualityLevel, 9);
+    if (d->settings.qualityLevel == qualityLevel) return;
+    d->settings.qualityLevel = qualityLevel;
+    d->applySettings();
+    emit qualityLevelChanged(qualityLevel);
+}
+
+/*!
+    Returns the compression level requested from the server.
+
+    The level ranges from 0 (fastest, least compression) to 9 (best
+    compression, most CPU). A value of -1 means the server default is used.
+
+    \sa setCompressionLevel(), qualityLevel()
+*/
+int QVncClient::compressionLevel() const
+{
+    return d->settings.compressionLevel;
+}
+
+/*!
+    Sets the compression level to \a compressionLevel.
+
+    The value is sent as one of the -256 to -247 pseudo-encodings. Values
+    outside 0-9 are clamped, except -1 which removes the pseudo-encoding.
+    Changing the level while connected re-sends SetEncodings, so it takes
+    effect without reconnecting.
+
+    \sa compressionLevel()
+*/
+void QVncClient::setCompressionLevel(int compressionLevel)
+{
+    compressionLevel = qBound(-1, compressionLevel, 9);
+    if (d->settings.compressionLevel == compressionLevel) return;
+    d->settings.compressionLevel = compressionLevel;
+    d->applySettings();
+    emit compressionLevelChanged(compressionLevel);
+}
+
+/*!
+    Returns the fine-grained JPEG quality requested from the server.
+
+    The value ranges from 1 to 100, or -1 when only the coarse
+    qualityLevel() is used.
+
+    \sa setFineQualityLevel(), qualityLevel()
+*/
+int QVncClient::fineQualityLevel() const
+{
+    return d->settings.fineQualityLevel;
+}
+
+/*!
+    Sets the fine-grained JPEG quality to \a fineQualityLevel.
+
+    The value is sent as one of the -512 to -412 pseudo-encodings understood
+    by TurboVNC and TigerVNC, which take it in preference to qualityLevel().
+    Values outside 1-100 are clamped, except -1 which removes the
+    pseudo-encoding. Servers without the extension ignore it.
+
+    \sa fineQualityLevel(), setSubsampling()
+*/
+void QVncClient::setFineQualityLevel(int fineQualityLevel)
+{
+    fineQualityLevel = fineQualityLevel < 0 ? -1 : qBound(1, fineQualityLevel, 100);
+    if (d->settings.fineQualityLevel == fineQualityLevel) return;
+    d->settings.fineQualityLevel = fineQualityLevel;
+    d->applySettings();
+    emit fineQualityLevelChanged(fineQualityLevel);
+}
+
+/*!
+    Returns the JPEG chroma subsampling requested from the server.
+
+    \sa setSubsampling()
+*/
+QVncClient::ChromaSubsampling QVncClient::subsampling() const
+{
+    return d->settings.subsampling;
+}
+
+/*!
+    Sets the JPEG chroma subsampling to \a subsampling.
+
+    The value is sent as one of the -768 to -763 pseudo-encodings understood
+    by TurboVNC and TigerVNC. SubsamplingGray makes the server send grayscale
+    JPEG, which is expanded to the framebuffer format on decoding.
+
+    \sa subsampling(), setFineQualityLevel()
+*/
+void QVncClient::setSubsampling(ChromaSubsampling subsampling)
+{
+    if (d->settings.subsampling == subsampling) return;
+    d->settings.subsampling = subsampling;
+    d->applySettings();
+    emit subsamplingChanged(subsampling);
+}
+
+/*!
+    Returns whether the encoding order adapts to the measured link.
+
+    \sa setAdaptiveEncoding()
+*/
+bool QVncClient::adaptiveEncoding() const
+{
+    return d->settings.adaptiveEncoding;
+}
+
+/*!
+    Enables or disables adaptive encoding selection according to \a adaptiveEncoding.
+
+    When enabled, the client measures the bytes and decode time per pixel of
+    each encoding together with the link throughput, and reorders and re-sends
+    SetEncodings when another encoding becomes clearly cheaper. Raw is then
+    preferred on loopback, ZRLE on fast networks and Tight on slow links,
+    where JPEG is also requested unless qualityLevel or fineQualityLevel is set.
+
+    \sa adaptiveEncoding()
+*/
+void QVncClient::setAdaptiveEncoding(bool adaptiveEncoding)
+{
+    if (d->settings.adaptiveEncoding == adaptiveEncoding) return;
+    d->settings.adaptiveEncoding = adaptiveEncoding;
+    d->applySettings();
+    emit adaptiveEncodingChanged(adaptiveEncoding);
+}
+
+/*!
+    Returns how many framebuffers the client keeps.
+
+    \sa setBufferingMode()
+*/
+QVncClient::BufferingMode QVncClient::bufferingMode() const
+{
+    return d->settings.bufferingMode;
+}
+
+/*!
+    Sets the number of framebuffers the client keeps to \a bufferingMode.
+
+    With SingleBuffering, the default, updates are decoded straight into
+    the image returned by image(), which can then show a partially applied
+    update. With DoubleBuffering and TripleBuffering, updates are decoded
+    into a back buffer that replaces the published image only once the
+    update is complete, so image() always returns a whole frame. Only the
+    damaged area is copied forward into the next back buffer.
+
+    TripleBuffering additionally lets a reader keep the previous frame while
+    the next one is decoded, without the client having to copy it.
+
+    \sa bufferingMode(), image()
+*/
+void QVncClient::setBufferingMode(BufferingMode bufferingMode)
+{
+    if (d->settings.bufferingMode == bufferingMode) return;
+    d->settings.bufferingMode = bufferingMode;
+    d->applySettings();
+    emit bufferingModeChanged(bufferingMode);
+}
+
+/*!
+    Returns whether the application draws the remote cursor itself.
+
+    \sa setLocalCursor()
+*/
+bool QVncClient::localCursor() const
+{
+    return d->settings.localCursor;
+}
+
+/*!
+    Makes the application draw the remote cursor itself if \a localCursor
+    is true.
+
+    The client then asks the server for the Cursor and PointerPos
+    pseudo-encodings. The server stops drawing the pointer into the
+    framebuffer and sends its shape instead, which is available through
+    cursorShape() and cursorShapeChanged(). The application can draw that
+    shape at the local mouse position right away, so the pointer follows
+    the mouse without waiting a round trip for the server.
+
+    Moves of the remote pointer the client did not cause, for example by an
+    application warping it, are reported through cursorPositionChanged().
+
+    The default is false. Servers that do not support the pseudo-encodings
+    keep drawing the cursor into the framebuffer.
+
+    \sa localCursor(), cursorShape(), cursorPosition()
+*/
+void QVncClient::setLocalCursor(bool localCursor)
+{
+    if (d->settings.localCursor == localCursor) return;
+    d->settings.localCursor = localCursor;
+    d->sentPositions.clear();
+    d->applySettings();
+    emit localCursorChanged(localCursor);
+}
+
+/*!
+    Returns whether a reconnect keeps and resumes the framebuffer.
+
+    \sa setSessionResume()
+*/
+bool QVncClient::sessionResume() const
+{
+    return d->settings.sessionResume;
+}
+
+/*!
+    Keeps the framebuffer across reconnects if \a sessionResume is true.
+
+    When the connection drops, the last frame then stays available, with
+    its size, and is marked as stale instead of being discarded. If the
+    next connection reports the same framebuffer size and desktop name, the
+    session is resumed on that frame: the client requests a refresh of the
+    whole framebuffer in coarse JPEG first, which clears the stale mark
+    once it is complete, and follows it with a lossless one if the server
+    used JPEG. Only then does it return to the encodings and quality the
+    application chose. A different desktop replaces the frame as usual.
+
+    This keeps a view from blanking while a flapping link reconnects, and
+    brings it up to date with a fraction of the data of a full refresh.
+
+    The default is false.
+
+    \sa sessionResume(), isFramebufferStale()
+*/
+void QVncClient::setSessionResume(bool sessionResume)
+{
+    if (d->settings.sessionResume == sessionResume) return;
+    d->settings.sessionResume = sessionResume;
+    d->applySettings();
+    if (!sessionResume && d->stale)
+        d->dropFramebuffer();
+    emit sessionResumeChanged(sessionResume);
+}
+
+/*!
+    Returns whether the framebuffer shows the last frame of a connection
+    that has been lost and not yet resumed.
+
+    \sa sessionResume, framebufferStaleChanged()
+*/
+bool QVncClient::isFramebufferStale() const
+{
+    return d->stale;
+}
+
+/*!
+    Returns the time in milliseconds from the device connecting to the
+    connection reaching \a phase, or -1 if it has not reached it.
+
+    The times tell where connection setup spends its time, for example the
+    round trips of the security handshake against the time the server takes
+    to send the first update. Phases that do not apply to the connection,
+    such as TlsPhase without TLS, stay at -1. The times are kept until the
+    next connection.
+
+    \sa handshakePhaseReached()
+*/
+qreal QVncClient::handshakeTime(HandshakePhase phase) const
+{
+    if (phase < WebSocketUpgradePhase || phase > FirstUpdatePhase)
+        return -1;
+    return d->handshakeTimes[phase];
+}
+
+/*!
+    Returns the cursor shape sent by the server, or a null image if it has
+    not sent one or hides the cursor.
+
+    \sa cursorHotSpot(), localCursor
+*/
+QImage QVncClient::cursorShape() const
+{
+    return d->cursorShape;
+}
+
+/*!
+    Returns the hot spot of cursorShape(), the pixel that is at the pointer
+    position.
+*/
+QPoint QVncClient::cursorHotSpot() const
+{
+    return d->cursorHotSpot;
+}
+
+/*!
+    Returns the position the server last moved the pointer to by itself,
+    in framebuffer coordinates.
+
+    \sa cursorPositionChanged(), localCursor
+*/
+QPoint QVncClient::cursorPosition() const
+{
+    return d->cursorPosition;
+}
+
+/*!
+    Returns the maximum number of pointer motion messages sent per second.
+
+    \sa setPointerEventRate()
+*/
+int QVncClient::pointerEventRate() const
+{
+    return d->pointerRate;
+}
+
+/*!
+    Limits pointer motion sent to the server to \a pointerEventRate
+    messages per second.
+
+    Mice polling at up to 1000 Hz would otherwise flood the server with
+    PointerEvent messages, each of which costs it cursor work and often an
+    update. Motion within one interval is coalesced into the latest
+    position, which is sent when the interval is over. Presses and releases
+    are always sent immediately, at the position they happened at, so that
+    clicks and drags stay exact.
+
+    The default is 120; matching the refresh rate of the display is a good
+    choice. 0 sends every event.
+
+    \sa pointerEventRate(), handlePointerEvent()
+*/
+void QVncClient::setPointerEventRate(int pointerEventRate)
+{
+    pointerEventRate = qMax(0, pointerEventRate);
+    if (d->pointerRate == pointerEventRate) return;
+    d->pointerRate = pointerEventRate;
+    d->flushPointer();
+    d->pointerTimer.stop();
+    emit pointerEventRateChanged(pointerEventRate);
+}
+
+/*!
+    Returns whether the protocol runs on the shared decode threads.
+
+    \sa setThreaded()
+*/
+bool QVncClient::isThreaded() const
+{
+    return d->isThreaded();
+}
+
+/*!
+    Runs the protocol on the decode threads shared by all clients if
+    \a threaded is true.
+
+    Parsing and decoding then happen on a pool with one thread per core,
+    so that a heavy session, e.g. one decoding large JPEG rectangles, does
+    not block the thread the client lives in. The pool is shared by all
+    threaded clients of the process and keeps the messages of each of them
+    in order, so hundreds of clients can be threaded without starting a
+    thread for each. The socket stays in its own thread, which only reads
+    the received data, writes the messages the protocol produces and sends
+    input events right away. Frames, damage and property changes
+    are delivered through queued signals, and frames are always decoded into
+    a back buffer, as with TripleBuffering, while threaded.
+
+    The mode can be changed at any time, including during a session. The
+    default is false.
+
+    \sa isThreaded(), bufferingMode()
+*/
+void QVncClient::setThreaded(bool threaded)
+{
+    if (d->isThreaded() == threaded) return;
+    d->setThreaded(threaded);
+    emit threadedChanged(threaded);
+}
+
+/*!
+    Returns the estimated downstream throughput in bytes per second.
+
+    The estimate is smoothed over framebuffer updates large enough to be
+    limited by the link rather than by latency. It is -1 while unknown.
+
+    \sa roundTripTime(), serverLatency()
+*/
+qreal QVncClient::bandwidth() const
+{
+    return d->bandwidth;
+}
+
+/*!
+    Returns the estimated network round trip time in milliseconds.
+
+    When the server supports the Fence extension, the time for a Fence to be
+    echoed is used. Otherwise it is the shortest recent time between a
+    FramebufferUpdateRequest and the resulting update. It is -1 while unknown.
+
+    \sa bandwidth(), serverLatency()
+*/
+qreal QVncClient::roundTripTime() const
+{
+    return d->roundTripTime;
+}
+
+/*!
+    Returns the estimated time in milliseconds the server needs to answer a
+    FramebufferUpdateRequest, not counting the network round trip.
+
+    This is only meaningful when the server supports Fence, since the round
+    trip cannot be separated from the update time otherwise. It is -1 while
+    unknown.
+
+    \sa bandwidth(), roundTripTime()
+*/
+qreal QVncClient::serverLatency() const
+{
+    return d->serverLatency;
+}
+
+/*!
+    Returns the part of the framebuffer that updates are requested for.
+
+    A null rectangle, the default, stands for the whole framebuffer.
+
+    \sa setRegionOfInterest()
+*/
+QRect QVncClient::regionOfInterest() const
+{
+    return d->settings.regionOfInterest;
+}
+
+/*!
+    Restricts framebuffer update requests to \a regionOfInterest, given in
+    framebuffer coordinates.
+
+    Use this when only part of the remote screen is shown, for example in a
+    zoomed or scrolled view, so that changes elsewhere are not transferred.
+    Areas that become part of the region are refreshed with a
+    non-incremental request, since changes there were not tracked while
+    they were outside. A null rectangle requests the whole framebuffer; a
+    region outside the framebuffer pauses updates until it changes again.
+
+    \sa regionOfInterest()
+*/
+void QVncClient::setRegionOfInterest(const QRect &regionOfInterest)
+{
+    if (d->settings.regionOfInterest == regionOfInterest) return;
+    d->settings.regionOfInterest = regionOfInterest;
+    d->applySettings();
+    emit regionOfInterestChanged(regionOfInterest);
+}
+
 /*!
     Returns the width of the remote framebuffer in pixels.
     
@@ -1811,7 +6027,7 @@ void QVncClient::setSecurityType(QVncClient::SecurityType securityType)
 */
 int QVncClient::framebufferWidth() const
 {
-    return d->frameBufferWidth;
+    return d->framebufferSize.width();
 }
 
 /*!
@@ -1821,7 +6037,7 @@ int QVncClient::framebufferWidth() const
 */
 int QVncClient::framebufferHeight() const
 {
-    return d->frameBufferHeight;
+    return d->framebufferSize.height();
 }
 
 /*!
@@ -1829,19 +6045,53 @@ int QVncClient::framebufferHeight() const
     
     This image represents the current state of the remote desktop.
     It is updated each time framebuffer updates are received from the server.
+
+    The returned image shares its data with the client. Keeping it across a
+    framebuffer update makes the client copy the whole framebuffer, use
+    constImage() where a copy is not needed.
+
+    This function is thread-safe. With double or triple buffering it always
+    returns a completely decoded frame.
     
-    \sa imageChanged()
+    \sa imageChanged(), constImage()
 */
 QImage QVncClient::image() const
 {
+    QMutexLocker locker(&d->imageMutex);
     return d->image;
 }
 
+/*!
+    Returns a reference to the current framebuffer image without copying it.
+
+    Unlike image(), this does not share the image data, so the decoders can
+    keep writing into the framebuffer without detaching a full copy of it.
+    The reference stays valid for the lifetime of the client, but its
+    contents change with every framebuffer update, so it should be read
+    right away, e.g. while painting, and not stored. Unlike image(), it must
+    only be used from the thread the client lives in.
+
+    When the client is threaded, this is the frame last announced by
+    framebufferUpdated(), which the decode threads no longer write to.
+
+    \sa image(), framebufferUpdated()
+*/
+const QImage &QVncClient::constImage() const
+{
+    return d->isThreaded() ? d->published : d->image;
+}
+
 /*!
     Handles a keyboard event and sends it to the VNC server.
     
     This method should be called when keyboard events occur in the client
     application that should be forwarded to the remote VNC server.
+
+    Keys are translated to X11 keysyms, printable keys according to the
+    text they produce with the local layout. If the server supports QEMU
+    extended key events, the scan code of the physical key is sent along,
+    so that the server can apply its own layout. A release always repeats
+    the keysym of its press.
     
     \param e The keyboard event to be forwarded.
 */
@@ -1850,6 +6100,33 @@ void QVncClient::handleKeyEvent(QKeyEvent *e)
     d->keyEvent(e);
 }
 
+/*!
+    Types \a text on the server, at most \a rate characters per second.
+
+    Each character is sent as a press and a release of its keysym, with
+    line breaks as Return and tabs as Tab; other control characters are
+    skipped. The key events are encoded in chunks straight into the output
+    buffer, so typing kilobytes of text takes a fraction of a second. If
+    the server supports Fence, each chunk is followed by a Fence it answers
+    once it has processed the keys, and no more than 32 KiB of key events
+    are outstanding, so its input queue cannot be overrun. Otherwise a
+    chunk of 512 characters is sent every 10 milliseconds. A \a rate of 0,
+    the default, leaves the pace to that flow control.
+
+    Text passed while typing is still in progress is appended. textTyped()
+    is emitted once everything has been sent and acknowledged, right away
+    if \a text has nothing to type.
+
+    The characters are typed with the server's keyboard layout, so they
+    should be available on it.
+
+    \sa handleKeyEvent(), textTyped()
+*/
+void QVncClient::typeText(const QString &text, int rate)
+{
+    d->typeText(text, qMax(0, rate));
+}
+
 /*!
     Handles a mouse event and sends it to the VNC server.
     
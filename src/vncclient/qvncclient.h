@@ -4,11 +4,14 @@
 #define QVNCCLIENT_H
 
 #include "qtvncclientglobal.h"
+#include <QtCore/QIODevice>
 #include <QtNetwork/QTcpSocket>
 #include <QtGui/QImage>
 #include <QtGui/QKeyEvent>
 #include <QtGui/QMouseEvent>
+#include <QtGui/QRegion>
 #include <QtCore/QScopedPointer>
+#include <QtCore/QUrl>
 
 QT_BEGIN_NAMESPACE
 
@@ -16,8 +19,27 @@ class /*Q_VNCCLIENT_EXPORT*/ QVncClient : public QObject
 {
     Q_OBJECT
     Q_PROPERTY(QTcpSocket *socket READ socket WRITE setSocket NOTIFY socketChanged)
+    Q_PROPERTY(QIODevice *device READ device WRITE setDevice NOTIFY deviceChanged)
+    Q_PROPERTY(QUrl webSocketUrl READ webSocketUrl WRITE setWebSocketUrl NOTIFY webSocketUrlChanged)
     Q_PROPERTY(ProtocolVersion protocolVersion READ protocolVersion NOTIFY protocolVersionChanged)
     Q_PROPERTY(SecurityType securityType READ securityType NOTIFY securityTypeChanged)
+    Q_PROPERTY(int qualityLevel READ qualityLevel WRITE setQualityLevel NOTIFY qualityLevelChanged)
+    Q_PROPERTY(int compressionLevel READ compressionLevel WRITE setCompressionLevel NOTIFY compressionLevelChanged)
+    Q_PROPERTY(int fineQualityLevel READ fineQualityLevel WRITE setFineQualityLevel NOTIFY fineQualityLevelChanged)
+    Q_PROPERTY(ChromaSubsampling subsampling READ subsampling WRITE setSubsampling NOTIFY subsamplingChanged)
+    Q_PROPERTY(bool adaptiveEncoding READ adaptiveEncoding WRITE setAdaptiveEncoding NOTIFY adaptiveEncodingChanged)
+    Q_PROPERTY(qreal bandwidth READ bandwidth NOTIFY bandwidthChanged)
+    Q_PROPERTY(qreal roundTripTime READ roundTripTime NOTIFY roundTripTimeChanged)
+    Q_PROPERTY(qreal serverLatency READ serverLatency NOTIFY serverLatencyChanged)
+    Q_PROPERTY(QRect regionOfInterest READ regionOfInterest WRITE setRegionOfInterest NOTIFY regionOfInterestChanged)
+    Q_PROPERTY(BufferingMode bufferingMode READ bufferingMode WRITE setBufferingMode NOTIFY bufferingModeChanged)
+    Q_PROPERTY(bool threaded READ isThreaded WRITE setThreaded NOTIFY threadedChanged)
+    Q_PROPERTY(int pointerEventRate READ pointerEventRate WRITE setPointerEventRate NOTIFY pointerEventRateChanged)
+    Q_PROPERTY(bool localCursor READ localCursor WRITE setLocalCursor NOTIFY localCursorChanged)
+    Q_PROPERTY(QImage cursorShape READ cursorShape NOTIFY cursorShapeChanged)
+    Q_PROPERTY(QPoint cursorPosition READ cursorPosition NOTIFY cursorPositionChanged)
+    Q_PROPERTY(bool sessionResume READ sessionResume WRITE setSessionResume NOTIFY sessionResumeChanged)
+    Q_PROPERTY(bool framebufferStale READ isFramebufferStale NOTIFY framebufferStaleChanged)
 public:
     enum ProtocolVersion {
         ProtocolVersionUnknown,
@@ -44,12 +66,64 @@ public:
     };
     Q_ENUM(SecurityType)
 
+    enum ChromaSubsampling {
+        SubsamplingDefault = -1,
+        Subsampling1X = 0,
+        Subsampling4X = 1,
+        Subsampling2X = 2,
+        SubsamplingGray = 3,
+        Subsampling8X = 4,
+        Subsampling16X = 5,
+    };
+    Q_ENUM(ChromaSubsampling)
+
+    enum BufferingMode {
+        SingleBuffering,
+        DoubleBuffering,
+        TripleBuffering,
+    };
+    Q_ENUM(BufferingMode)
+
+    enum HandshakePhase {
+        WebSocketUpgradePhase,
+        ProtocolVersionPhase,
+        SecurityPhase,
+        TlsPhase,
+        SecurityResultPhase,
+        ServerInitPhase,
+        FirstUpdatePhase,
+    };
+    Q_ENUM(HandshakePhase)
+
     explicit QVncClient(QObject *parent = nullptr);
     ~QVncClient() override;
 
     QTcpSocket *socket() const;
+    QIODevice *device() const;
+    bool isConnected() const;
+    bool setSocketDescriptor(qintptr socketDescriptor);
+    QUrl webSocketUrl() const;
     ProtocolVersion protocolVersion() const;
     SecurityType securityType() const;
+    int qualityLevel() const;
+    int compressionLevel() const;
+    int fineQualityLevel() const;
+    ChromaSubsampling subsampling() const;
+    bool adaptiveEncoding() const;
+    qreal bandwidth() const;
+    qreal roundTripTime() const;
+    qreal serverLatency() const;
+    QRect regionOfInterest() const;
+    BufferingMode bufferingMode() const;
+    bool isThreaded() const;
+    int pointerEventRate() const;
+    bool localCursor() const;
+    QImage cursorShape() const;
+    QPoint cursorHotSpot() const;
+    QPoint cursorPosition() const;
+    bool sessionResume() const;
+    bool isFramebufferStale() const;
+    qreal handshakeTime(HandshakePhase phase) const;
     
     // Get framebuffer size
     int framebufferWidth() const;
@@ -57,13 +131,28 @@ public:
     
     // Get current image
     QImage image() const;
+    const QImage &constImage() const;
     
     // Process input events
     void handleKeyEvent(QKeyEvent *e);
     void handlePointerEvent(QMouseEvent *e);
+    void typeText(const QString &text, int rate = 0);
 
 public slots:
     void setSocket(QTcpSocket *socket);
+    void setDevice(QIODevice *device);
+    void setWebSocketUrl(const QUrl &webSocketUrl);
+    void setQualityLevel(int qualityLevel);
+    void setCompressionLevel(int compressionLevel);
+    void setFineQualityLevel(int fineQualityLevel);
+    void setSubsampling(ChromaSubsampling subsampling);
+    void setAdaptiveEncoding(bool adaptiveEncoding);
+    void setRegionOfInterest(const QRect &regionOfInterest);
+    void setBufferingMode(BufferingMode bufferingMode);
+    void setThreaded(bool threaded);
+    void setPointerEventRate(int pointerEventRate);
+    void setLocalCursor(bool localCursor);
+    void setSessionResume(bool sessionResume);
     
 private:
     void setProtocolVersion(ProtocolVersion protocolVersion);
@@ -71,11 +160,33 @@ private:
 
 signals:
     void socketChanged(QTcpSocket *socket);
+    void deviceChanged(QIODevice *device);
+    void webSocketUrlChanged(const QUrl &webSocketUrl);
     void protocolVersionChanged(ProtocolVersion protocolVersion);
     void securityTypeChanged(SecurityType securityType);
+    void qualityLevelChanged(int qualityLevel);
+    void compressionLevelChanged(int compressionLevel);
+    void fineQualityLevelChanged(int fineQualityLevel);
+    void subsamplingChanged(ChromaSubsampling subsampling);
+    void adaptiveEncodingChanged(bool adaptiveEncoding);
+    void bandwidthChanged(qreal bandwidth);
+    void roundTripTimeChanged(qreal roundTripTime);
+    void serverLatencyChanged(qreal serverLatency);
+    void regionOfInterestChanged(const QRect &regionOfInterest);
+    void bufferingModeChanged(BufferingMode bufferingMode);
+    void threadedChanged(bool threaded);
+    void pointerEventRateChanged(int pointerEventRate);
+    void localCursorChanged(bool localCursor);
+    void cursorShapeChanged(const QImage &shape, const QPoint &hotSpot);
+    void cursorPositionChanged(const QPoint &position);
+    void sessionResumeChanged(bool sessionResume);
+    void framebufferStaleChanged(bool stale);
+    void handshakePhaseReached(HandshakePhase phase, qreal time);
     void framebufferSizeChanged(int width, int height);
     void imageChanged(const QRect &rect);
+    void framebufferUpdated(const QRegion &region);
     void connectionStateChanged(bool connected);
+    void textTyped();
 
 private:
     class Private;
@@ -0,0 +1,398 @@
+// Copyright (C) 2025 Signal Slot Inc.
+// SPDX-License-Identifier: LGPL-3.0-only OR GPL-2.0-only OR GPL-3.0-only
+
+#include "qvncdecodescheduler_p.h"
+
+#include <QtCore/QThread>
+
+#include <algorithm>
+#include <utility>
+
+QT_BEGIN_NAMESPACE
+
+namespace {
+// The scheduler and worker index of the calling thread, if it is a worker
+thread_local QVncDecodeScheduler *currentScheduler = nullptr;
+thread_local int currentWorker = -1;
+
+// Tasks a strand runs in one go before it makes room for other strands
+constexpr int StrandBatchSize = 16;
+}
+
+Q_GLOBAL_STATIC(QVncDecodeScheduler, decodeScheduler, std::max(2, QThread::idealThreadCount()))
+
+/*!
+    \internal
+    \class QVncDecodeScheduler
+    \brief The QVncDecodeScheduler class runs protocol and decoding work of
+    all threaded clients on one fixed pool of worker threads.
+
+    Each worker owns a queue of tasks. Tasks submitted by a worker go to its
+    own queue and are taken newest first, which keeps the data they work on
+    in the worker's cache; a worker that runs out of work steals the oldest
+    task of another worker. Tasks submitted from other threads are spread
+    over the workers round robin.
+
+    Work that has to run in order, such as the messages of one connection,
+    is posted to a Strand.
+*/
+
+/*!
+    \internal
+    Starts \a workerCount worker threads.
+*/
+QVncDecodeScheduler::QVncDecodeScheduler(int workerCount)
+{
+    for (int i = 0; i < workerCount; i++)
+        workers.append(new Worker);
+    for (int i = 0; i < workerCount; i++) {
+        Worker *worker = workers.at(i);
+        worker->thread = QThread::create([this, i]() { work(i); });
+        worker->thread->setObjectName(QStringLiteral("QVncDecoder%1").arg(i));
+        worker->thread->start();
+    }
+}
+
+/*!
+    \internal
+    Stops the worker threads once the tasks submitted so far are done.
+*/
+QVncDecodeScheduler::~QVncDecodeScheduler()
+{
+    {
+        QMutexLocker locker(&sleepMutex);
+        stopping = true;
+        wake.wakeAll();
+    }
+    // Workers steal from each other until the last one is gone
+    for (Worker *worker : std::as_const(workers))
+        worker->thread->wait();
+    for (Worker *worker : std::as_const(workers)) {
+        delete worker->thread;
+        delete worker;
+    }
+}
+
+/*!
+    \internal
+    Returns the scheduler shared by all clients of the process, which has as
+    many workers as the machine has cores.
+*/
+QVncDecodeScheduler *QVncDecodeScheduler::instance()
+{
+    return decodeScheduler();
+}
+
+/*!
+    \internal
+    Runs \a task on one of the workers. Tasks submitted this way may run
+    concurrently and in any order.
+*/
+void QVncDecodeScheduler::submit(Task task)
+{
+    enqueue(std::move(task), false);
+}
+
+/*!
+    \internal
+    Queues \a task, behind the other tasks of the calling worker if \a yield
+    is true, so that they run first and other workers can steal it.
+*/
+void QVncDecodeScheduler::enqueue(Task task, bool yield)
+{
+    int index = currentScheduler == this ? currentWorker : -1;
+    if (index < 0)
+        index = int(quint32(next.fetchAndAddRelaxed(1)) % quint32(workers.size()));
+
+    // Counted before it is queued, so that a worker that sees a pending task
+    // keeps looking until it finds one
+    {
+        QMutexLocker locker(&sleepMutex);
+        pending++;
+    }
+    {
+        Worker *worker = workers.at(index);
+        QMutexLocker locker(&worker->mutex);
+        if (yield)
+            worker->queue.push_front(std::move(task));
+        else
+            worker->queue.push_back(std::move(task));
+    }
+    wake.wakeOne();
+}
+
+/*!
+    \internal
+    Takes the next task for the worker at \a index into \a task, stealing
+    one from another worker if its own queue is empty.
+*/
+bool QVncDecodeScheduler::take(int index, Task *task)
+{
+    {
+        Worker *worker = workers.at(index);
+        QMutexLocker locker(&worker->mutex);
+        if (!worker->queue.empty()) {
+            *task = std::move(worker->queue.back());
+            worker->queue.pop_back();
+            return true;
+        }
+    }
+    for (int i = 1; i < workers.size(); i++) {
+        Worker *victim = workers.at((index + i) % workers.size());
+        QMutexLocker locker(&victim->mutex);
+        if (!victim->queue.empty()) {
+            *task = std::move(victim->queue.front());
+            victim->queue.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+/*!
+    \internal
+    Main loop of the worker at \a index.
+*/
+void QVncDecodeScheduler::work(int index)
+{
+    currentScheduler = this;
+    currentWorker = index;
+
+    Task task;
+    for (;;) {
+        if (take(index, &task)) {
+            {
+                QMutexLocker locker(&sleepMutex);
+                pending--;
+            }
+            task();
+            task = nullptr;
+            continue;
+        }
+        QMutexLocker locker(&sleepMutex);
+        if (pending > 0)
+            continue;
+        if (stopping)
+            break;
+        wake.wait(&sleepMutex);
+    }
+}
+
+/*!
+    \internal
+    \class QVncDecodeScheduler::Strand
+    \brief The Strand class runs the tasks posted to it one after the other,
+    in the order they were posted, on the workers of a scheduler.
+
+    A strand occupies at most one worker at a time and hands it back after a
+    few tasks, so that a busy connection cannot starve the others.
+*/
+
+/*!
+    \internal
+    Creates a strand running on \a scheduler.
+*/
+QVncDecodeScheduler::Strand::Strand(QVncDecodeScheduler *scheduler)
+    : scheduler(scheduler)
+{
+}
+
+/*!
+    \internal
+    Waits for the tasks already posted before the strand goes away.
+*/
+QVncDecodeScheduler::Strand::~Strand()
+{
+    drain();
+}
+
+/*!
+    \internal
+    Runs \a task after all tasks posted before it.
+*/
+void QVncDecodeScheduler::Strand::post(Task task)
+{
+    bool schedule = false;
+    {
+        QMutexLocker locker(&mutex);
+        tasks.push_back(std::move(task));
+        schedule = !std::exchange(scheduled, true);
+    }
+    if (schedule)
+        scheduler->submit([this]() { run(); });
+}
+
+/*!
+    \internal
+    Blocks until all tasks posted so far have run.
+*/
+void QVncDecodeScheduler::Strand::drain()
+{
+    QMutexLocker locker(&mutex);
+    while (scheduled)
+        idle.wait(&mutex);
+}
+
+void QVncDecodeScheduler::Strand::run()
+{
+    for (int i = 0; i < StrandBatchSize; i++) {
+        Task task;
+        {
+            QMutexLocker locker(&mutex);
+            if (tasks.empty()) {
+                scheduled = false;
+                idle.wakeAll();
+                return;
+            }
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        task();
+    }
+    // Still scheduled, continue behind the work that queued up meanwhile
+    scheduler->enqueue([this]() { run(); }, true);
+}
+
+/*!
+    \internal
+    \class QVncDecodeScheduler::Graph
+    \brief The Graph class runs tasks concurrently on the workers of a
+    scheduler as soon as the tasks they depend on are done.
+
+    A thread waiting for the graph runs ready tasks itself instead of just
+    blocking, so a worker may wait for a graph without starving it, and
+    tasks never wait for anything themselves.
+*/
+
+/*!
+    \internal
+    Creates an empty graph running on \a scheduler.
+*/
+QVncDecodeScheduler::Graph::Graph(QVncDecodeScheduler *scheduler)
+    : state(std::make_shared<State>())
+{
+    state->scheduler = scheduler;
+}
+
+/*!
+    \internal
+    Waits for the remaining tasks before the graph goes away.
+*/
+QVncDecodeScheduler::Graph::~Graph()
+{
+    wait();
+}
+
+/*!
+    \internal
+    Adds \a task, which runs once the nodes in \a dependencies are done, and
+    returns its node id. Ids are valid until the next call to wait().
+*/
+int QVncDecodeScheduler::Graph::add(Task task, const QList<int> &dependencies)
+{
+    auto node = std::make_shared<Node>();
+    node->task = std::move(task);
+
+    QMutexLocker locker(&state->mutex);
+    for (int dependency : dependencies) {
+        const auto &other = state->nodes.at(dependency);
+        if (!other->done) {
+            other->dependents.append(node);
+            node->blockers++;
+        }
+    }
+    state->nodes.append(node);
+    state->remaining++;
+    if (node->blockers == 0)
+        schedule(state, node);
+    return int(state->nodes.size()) - 1;
+}
+
+/*!
+    \internal
+    Hands \a node, whose dependencies are done, to the workers and to
+    threads waiting for \a state. Its mutex must be locked.
+*/
+void QVncDecodeScheduler::Graph::schedule(const std::shared_ptr<State> &state, const std::shared_ptr<Node> &node)
+{
+    state->ready.push_back(node);
+    state->scheduler->submit([state, node]() { run(state, node); });
+}
+
+/*!
+    \internal
+    Runs \a node unless somebody else already does and releases the nodes
+    that were waiting for it.
+*/
+void QVncDecodeScheduler::Graph::run(const std::shared_ptr<State> &state, const std::shared_ptr<Node> &node)
+{
+    {
+        QMutexLocker locker(&state->mutex);
+        if (std::exchange(node->claimed, true))
+            return;
+    }
+    node->task();
+    node->task = nullptr;
+
+    QMutexLocker locker(&state->mutex);
+    node->done = true;
+    state->remaining--;
+    for (const auto &dependent : std::as_const(node->dependents)) {
+        if (--dependent->blockers == 0)
+            schedule(state, dependent);
+    }
+    node->dependents.clear();
+    state->finished.wakeAll();
+}
+
+/*!
+    \internal
+    Runs one ready node in the calling thread, with the mutex held by
+    \a locker released meanwhile. Returns false if no node was ready.
+*/
+bool QVncDecodeScheduler::Graph::help(QMutexLocker<QMutex> *locker)
+{
+    while (!state->ready.empty()) {
+        const std::shared_ptr<Node> node = std::move(state->ready.front());
+        state->ready.pop_front();
+        if (node->claimed)
+            continue;
+        locker->unlock();
+        run(state, node);
+        locker->relock();
+        return true;
+    }
+    return false;
+}
+
+/*!
+    \internal
+    Blocks until \a node is done, running ready nodes meanwhile.
+*/
+void QVncDecodeScheduler::Graph::wait(int node)
+{
+    QMutexLocker locker(&state->mutex);
+    const std::shared_ptr<Node> waited = state->nodes.at(node);
+    while (!waited->done) {
+        if (!help(&locker))
+            state->finished.wait(&state->mutex);
+    }
+}
+
+/*!
+    \internal
+    Blocks until all nodes are done, running ready nodes meanwhile, and
+    empties the graph.
+*/
+void QVncDecodeScheduler::Graph::wait()
+{
+    QMutexLocker locker(&state->mutex);
+    while (state->remaining > 0) {
+        if (!help(&locker))
+            state->finished.wait(&state->mutex);
+    }
+    state->nodes.clear();
+    state->ready.clear();
+}
+
+QT_END_NAMESPACE
@@ -0,0 +1,123 @@
+// Copyright (C) 2025 Signal Slot Inc.
+// SPDX-License-Identifier: LGPL-3.0-only OR GPL-2.0-only OR GPL-3.0-only
+
+#ifndef QVNCDECODESCHEDULER_P_H
+#define QVNCDECODESCHEDULER_P_H
+
+//
+//  W A R N I N G
+//  -------------
+//
+// This file is not part of the Qt API. It exists purely as an
+// implementation detail. This header file may change from version to
+// version without notice, or even be removed.
+//
+// We mean it.
+//
+
+#include "qtvncclientglobal.h"
+
+#include <QtCore/QAtomicInt>
+#include <QtCore/QList>
+#include <QtCore/QMutex>
+#include <QtCore/QWaitCondition>
+
+#include <deque>
+#include <functional>
+#include <memory>
+
+QT_BEGIN_NAMESPACE
+
+class QThread;
+
+class QVncDecodeScheduler
+{
+public:
+    using Task = std::function<void()>;
+
+    class Strand
+    {
+    public:
+        explicit Strand(QVncDecodeScheduler *scheduler = QVncDecodeScheduler::instance());
+        ~Strand();
+
+        void post(Task task);
+        void drain();
+
+    private:
+        void run();
+
+        QVncDecodeScheduler *scheduler;
+        QMutex mutex;
+        QWaitCondition idle;
+        std::deque<Task> tasks;
+        bool scheduled = false;
+    };
+
+    class Graph
+    {
+    public:
+        explicit Graph(QVncDecodeScheduler *scheduler = QVncDecodeScheduler::instance());
+        ~Graph();
+
+        int add(Task task, const QList<int> &dependencies);
+        void wait(int node);
+        void wait();
+
+    private:
+        struct Node
+        {
+            Task task;
+            QList<std::shared_ptr<Node>> dependents;
+            int blockers = 0;
+            bool claimed = false;
+            bool done = false;
+        };
+        struct State
+        {
+            QVncDecodeScheduler *scheduler = nullptr;
+            QMutex mutex;
+            QWaitCondition finished;
+            QList<std::shared_ptr<Node>> nodes;
+            std::deque<std::shared_ptr<Node>> ready;
+            int remaining = 0;
+        };
+
+        bool help(QMutexLocker<QMutex> *locker);
+        static void schedule(const std::shared_ptr<State> &state, const std::shared_ptr<Node> &node);
+        static void run(const std::shared_ptr<State> &state, const std::shared_ptr<Node> &node);
+
+        std::shared_ptr<State> state;
+    };
+
+    explicit QVncDecodeScheduler(int workerCount);
+    ~QVncDecodeScheduler();
+
+    static QVncDecodeScheduler *instance();
+
+    int workerCount() const { return int(workers.size()); }
+    void submit(Task task);
+
+private:
+    struct Worker
+    {
+        QThread *thread = nullptr;
+        QMutex mutex;
+        std::deque<Task> queue;
+    };
+
+    void enqueue(Task task, bool yield);
+    void work(int index);
+    bool take(int index, Task *task);
+
+    QList<Worker *> workers;
+    QAtomicInt next;
+    QMutex sleepMutex;
+    QWaitCondition wake;
+    int pending = 0;
+    bool stopping = false;
+};
+
+QT_END_NAMESPACE
+
+#endif // QVNCDECODESCHEDULER_P_H
@@ -0,0 +1,183 @@
+// Copyright (C) 2025 Signal Slot Inc.
+// SPDX-License-Identifier: LGPL-3.0-only OR GPL-2.0-only OR GPL-3.0-only
+
+#include "qvncepolltransport_p.h"
+
+#include <QtCore/QThread>
+
+#include <algorithm>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <cerrno>
+
+QT_BEGIN_NAMESPACE
+
+namespace {
+// Events a poller takes from the kernel in one go
+constexpr int EventBatchSize = 64;
+
+// Read readiness, reported once until the connection rearms it
+constexpr quint32 ReadEvents = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+}
+
+// A poller only hands readiness on, so a few serve hundreds of connections
+Q_GLOBAL_STATIC(QVncEpollTransport, epollTransport, std::clamp(QThread::idealThreadCount() / 4, 1, 4))
+
+/*!
+    \internal
+    \class QVncEpollTransport
+    \brief The QVncEpollTransport class tells clients using native sockets
+    when their sockets have data, using epoll on a few shared threads.
+
+    Connections are spread over the pollers round robin. A poller reports a
+    readable socket once, by calling the connection's callback, and ignores
+    it until the connection has read what is there and rearms it, so the
+    data of one connection is never read by two threads at a time. The
+    reading itself happens wherever the callback sends it, usually the
+    strand of the client on the decode scheduler.
+*/
+
+/*!
+    \internal
+    Starts \a pollerCount poller threads.
+*/
+QVncEpollTransport::QVncEpollTransport(int pollerCount)
+{
+    for (int i = 0; i < pollerCount; i++) {
+        Poller *poller = new Poller;
+        poller->epoll = epoll_create1(EPOLL_CLOEXEC);
+        poller->wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        // Id 0 is never handed out and stands for the wakeup descriptor
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.u64 = 0;
+        epoll_ctl(poller->epoll, EPOLL_CTL_ADD, poller->wakeup, &event);
+        pollers.append(poller);
+    }
+    for (int i = 0; i < pollerCount; i++) {
+        Poller *poller = pollers.at(i);
+        poller->thread = QThread::create([this, poller]() { poll(poller); });
+        poller->thread->setObjectName(QStringLiteral("QVncPoller%1").arg(i));
+        poller->thread->start();
+    }
+}
+
+/*!
+    \internal
+    Stops the poller threads. Registered sockets are left open.
+*/
+QVncEpollTransport::~QVncEpollTransport()
+{
+    for (Poller *poller : std::as_const(pollers)) {
+        {
+            QMutexLocker locker(&poller->mutex);
+            poller->stopping = true;
+        }
+        const quint64 one = 1;
+        [[maybe_unused]] const ssize_t written = ::write(poller->wakeup, &one, sizeof(one));
+    }
+    for (Poller *poller : std::as_const(pollers)) {
+        poller->thread->wait();
+        delete poller->thread;
+        ::close(poller->wakeup);
+        ::close(poller->epoll);
+        delete poller;
+    }
+}
+
+/*!
+    \internal
+    Returns the transport shared by all clients of the process.
+*/
+QVncEpollTransport *QVncEpollTransport::instance()
+{
+    return epollTransport();
+}
+
+/*!
+    \internal
+    Watches the non-blocking socket \a fd and calls \a readable on a poller
+    thread when it has data or has been closed. The callback must return
+    quickly and leave the reading to another thread, which calls rearm()
+    once it has read everything available.
+*/
+QVncEpollTransport::Registration QVncEpollTransport::add(int fd, Callback readable)
+{
+    Registration registration;
+    registration.id = nextId.fetchAndAddRelaxed(1) + 1;
+    registration.poller = int(registration.id % quint64(pollers.size()));
+    registration.fd = fd;
+
+    Poller *poller = pollers.at(registration.poller);
+    QMutexLocker locker(&poller->mutex);
+    epoll_event event = {};
+    event.events = ReadEvents;
+    event.data.u64 = registration.id;
+    if (epoll_ctl(poller->epoll, EPOLL_CTL_ADD, fd, &event) < 0) {
+        registration.id = 0;
+        return registration;
+    }
+    poller->watches.insert(registration.id, Watch { registration, std::move(readable) });
+    return registration;
+}
+
+/*!
+    \internal
+    Reports the socket of \a registration again the next time it is readable.
+
+    This takes no locks, so it may be called from anywhere, including work
+    that a thread holding other locks waits for.
+*/
+void QVncEpollTransport::rearm(const Registration &registration)
+{
+    epoll_event event = {};
+    event.events = ReadEvents;
+    event.data.u64 = registration.id;
+    // Fails harmlessly if the socket has been removed meanwhile
+    epoll_ctl(pollers.at(registration.poller)->epoll, EPOLL_CTL_MOD, registration.fd, &event);
+}
+
+/*!
+    \internal
+    Stops watching the socket of \a registration. The callback is not running
+    and will not be called anymore once this returns; the socket can then be
+    closed.
+*/
+void QVncEpollTransport::remove(const Registration &registration)
+{
+    if (registration.id == 0)
+        return;
+    Poller *poller = pollers.at(registration.poller);
+    QMutexLocker locker(&poller->mutex);
+    epoll_ctl(poller->epoll, EPOLL_CTL_DEL, registration.fd, nullptr);
+    poller->watches.remove(registration.id);
+}
+
+/*!
+    \internal
+    Main loop of \a poller.
+*/
+void QVncEpollTransport::poll(Poller *poller)
+{
+    epoll_event events[EventBatchSize];
+    for (;;) {
+        const int count = epoll_wait(poller->epoll, events, EventBatchSize, -1);
+        if (count < 0 && errno != EINTR)
+            break;
+
+        QMutexLocker locker(&poller->mutex);
+        if (poller->stopping)
+            break;
+        for (int i = 0; i < count; i++) {
+            // Events of sockets removed after epoll_wait() returned are dropped
+            const auto it = poller->watches.constFind(events[i].data.u64);
+            if (it == poller->watches.constEnd())
+                continue;
+            it->readable(it->registration);
+        }
+    }
+}
+
+QT_END_NAMESPACE
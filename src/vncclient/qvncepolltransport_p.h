@@ -0,0 +1,76 @@
+// Copyright (C) 2025 Signal Slot Inc.
+// SPDX-License-Identifier: LGPL-3.0-only OR GPL-2.0-only OR GPL-3.0-only
+
+#ifndef QVNCEPOLLTRANSPORT_P_H
+#define QVNCEPOLLTRANSPORT_P_H
+
+//
+//  W A R N I N G
+//  -------------
+//
+// This file is not part of the Qt API. It exists purely as an
+// implementation detail. This header file may change from version to
+// version without notice, or even be removed.
+//
+// We mean it.
+//
+
+#include "qtvncclientglobal.h"
+
+#include <QtCore/QAtomicInteger>
+#include <QtCore/QHash>
+#include <QtCore/QList>
+#include <QtCore/QMutex>
+
+#include <functional>
+
+QT_BEGIN_NAMESPACE
+
+class QThread;
+
+class QVncEpollTransport
+{
+public:
+    struct Registration
+    {
+        int poller = -1;
+        int fd = -1;
+        quint64 id = 0;
+    };
+    using Callback = std::function<void(const Registration &registration)>;
+
+    explicit QVncEpollTransport(int pollerCount);
+    ~QVncEpollTransport();
+
+    static QVncEpollTransport *instance();
+
+    Registration add(int fd, Callback readable);
+    void rearm(const Registration &registration);
+    void remove(const Registration &registration);
+
+private:
+    struct Watch
+    {
+        Registration registration;
+        Callback readable;
+    };
+
+    struct Poller
+    {
+        QThread *thread = nullptr;
+        int epoll = -1;
+        int wakeup = -1;
+        QMutex mutex;
+        QHash<quint64, Watch> watches;
+        bool stopping = false;
+    };
+
+    void poll(Poller *poller);
+
+    QList<Poller *> pollers;
+    QAtomicInteger<quint64> nextId;
+};
+
+QT_END_NAMESPACE
+
+#endif // QVNCEPOLLTRANSPORT_P_H
@@ -0,0 +1,334 @@
+// Copyright (C) 2025 Signal Slot Inc.
+// SPDX-License-Identifier: LGPL-3.0-only OR GPL-2.0-only OR GPL-3.0-only
+
+#include "qvncuringtransport_p.h"
+
+#include <QtCore/QThread>
+
+#include <algorithm>
+#include <utility>
+
+#include <cerrno>
+
+QT_BEGIN_NAMESPACE
+
+namespace {
+// Entries of the submission queue of a ring
+constexpr unsigned QueueDepth = 256;
+
+// Receive buffers each ring hands to the kernel, a power of two
+constexpr int BufferCount = 128;
+constexpr int BufferSize = 64 * 1024;
+constexpr int BufferGroup = 0;
+
+// User data of the requests that do not belong to a connection
+constexpr quint64 WakeRequest = 0;
+constexpr quint64 CancelRequest = ~quint64(0);
+}
+
+// Like the epoll pollers, a ring thread only hands data on
+Q_GLOBAL_STATIC(QVncUringTransport, uringTransport, std::clamp(QThread::idealThreadCount() / 4, 1, 4))
+
+/*!
+    \internal
+    \class QVncUringTransport
+    \brief The QVncUringTransport class receives the data of clients using
+    native sockets through io_uring, on a few shared threads.
+
+    Each ring thread owns an io_uring instance with a ring of provided
+    buffers. Every connection has one multishot receive in flight, so the
+    kernel fills the buffers as data arrives without any system call per
+    read, and the completions of all connections of a ring are collected
+    with a single wait. The buffers are passed on to the receiver, whose
+    decoders read them in place and hand them back with release().
+
+    Multishot receives need Linux 6.0; on older kernels instance() returns
+    \nullptr and clients use QVncEpollTransport instead.
+*/
+
+/*!
+    \internal
+    Sets up \a ringCount rings and starts their threads, unless the kernel
+    lacks the features needed.
+*/
+QVncUringTransport::QVncUringTransport(int ringCount)
+{
+    for (int i = 0; i < ringCount; i++) {
+        Ring *ring = new Ring;
+        if (!setup(ring)) {
+            delete ring;
+            break;
+        }
+        rings.append(ring);
+    }
+    if (rings.size() < ringCount) {
+        for (Ring *ring : std::as_const(rings)) {
+            io_uring_free_buf_ring(&ring->ring, ring->buffers, BufferCount, BufferGroup);
+            io_uring_queue_exit(&ring->ring);
+            delete ring;
+        }
+        rings.clear();
+        return;
+    }
+    supported = true;
+    for (int i = 0; i < ringCount; i++) {
+        Ring *ring = rings.at(i);
+        ring->thread = QThread::create([this, i]() { run(i); });
+        ring->thread->setObjectName(QStringLiteral("QVncRing%1").arg(i));
+        ring->thread->start();
+    }
+}
+
+/*!
+    \internal
+    Stops the ring threads. Registered sockets are left open.
+*/
+QVncUringTransport::~QVncUringTransport()
+{
+    for (Ring *ring : std::as_const(rings)) {
+        {
+            QMutexLocker locker(&ring->watchMutex);
+            ring->stopping = true;
+        }
+        wake(ring);
+    }
+    for (Ring *ring : std::as_const(rings)) {
+        ring->thread->wait();
+        delete ring->thread;
+        io_uring_free_buf_ring(&ring->ring, ring->buffers, BufferCount, BufferGroup);
+        io_uring_queue_exit(&ring->ring);
+        delete ring;
+    }
+}
+
+/*!
+    \internal
+    Returns the transport shared by all clients of the process, or \nullptr
+    if io_uring cannot be used.
+*/
+QVncUringTransport *QVncUringTransport::instance()
+{
+    QVncUringTransport *transport = uringTransport();
+    return transport && transport->supported ? transport : nullptr;
+}
+
+/*!
+    \internal
+    Creates the io_uring instance of \a ring and gives the kernel its
+    buffers. Returns false if the kernel is too old.
+*/
+bool QVncUringTransport::setup(Ring *ring)
+{
+    if (io_uring_queue_init(QueueDepth, &ring->ring, 0) < 0)
+        return false;
+
+    // Multishot receives came with Linux 6.0, as did zero-copy sends, which
+    // unlike the former can be probed for
+    io_uring_probe *probe = io_uring_get_probe_ring(&ring->ring);
+    const bool recent = probe && io_uring_opcode_supported(probe, IORING_OP_SEND_ZC);
+    io_uring_free_probe(probe);
+    int error = 0;
+    if (recent)
+        ring->buffers = io_uring_setup_buf_ring(&ring->ring, BufferCount, BufferGroup, 0, &error);
+    if (!ring->buffers) {
+        io_uring_queue_exit(&ring->ring);
+        return false;
+    }
+
+    ring->memory.reset(new char[size_t(BufferCount) * BufferSize]);
+    for (int i = 0; i < BufferCount; i++) {
+        io_uring_buf_ring_add(ring->buffers, ring->memory.get() + qsizetype(i) * BufferSize, BufferSize,
+                              i, io_uring_buf_ring_mask(BufferCount), i);
+    }
+    io_uring_buf_ring_advance(ring->buffers, BufferCount);
+    ring->available.storeRelaxed(BufferCount);
+    return true;
+}
+
+/*!
+    \internal
+    Receives from the non-blocking socket \a fd and calls \a received on a
+    ring thread for each chunk of data, in order. The callback must return
+    quickly and leave the decoding to another thread.
+*/
+QVncUringTransport::Registration QVncUringTransport::add(int fd, Callback received)
+{
+    Registration registration;
+    registration.id = nextId.fetchAndAddRelaxed(1) + 1;
+    registration.ring = int(registration.id % quint64(rings.size()));
+    registration.fd = fd;
+
+    Ring *ring = rings.at(registration.ring);
+    {
+        QMutexLocker locker(&ring->watchMutex);
+        ring->watches.insert(registration.id, Watch { registration, std::move(received) });
+    }
+    QMutexLocker locker(&ring->submitMutex);
+    receive(ring, registration);
+    io_uring_submit(&ring->ring);
+    return registration;
+}
+
+/*!
+    \internal
+    Gives the buffer of \a chunk back to the kernel.
+*/
+void QVncUringTransport::release(const Chunk &chunk)
+{
+    if (chunk.buffer < 0)
+        return;
+    Ring *ring = rings.at(chunk.ring);
+    {
+        QMutexLocker locker(&ring->bufferMutex);
+        io_uring_buf_ring_add(ring->buffers, ring->memory.get() + qsizetype(chunk.buffer) * BufferSize, BufferSize,
+                              chunk.buffer, io_uring_buf_ring_mask(BufferCount), 0);
+        io_uring_buf_ring_advance(ring->buffers, 1);
+    }
+    ring->available.fetchAndAddRelaxed(1);
+    // Receives stopped for lack of buffers can go on
+    if (ring->wakeOnRelease.testAndSetRelaxed(1, 0))
+        wake(ring);
+}
+
+/*!
+    \internal
+    Stops receiving from the socket of \a registration. The callback is not
+    running and will not be called anymore once this returns; the socket can
+    then be closed.
+*/
+void QVncUringTransport::remove(const Registration &registration)
+{
+    if (registration.id == 0)
+        return;
+    Ring *ring = rings.at(registration.ring);
+    {
+        QMutexLocker locker(&ring->watchMutex);
+        ring->watches.remove(registration.id);
+        ring->starved.removeOne(registration.id);
+    }
+    QMutexLocker locker(&ring->submitMutex);
+    io_uring_sqe *sqe = submission(ring);
+    io_uring_prep_cancel64(sqe, registration.id, 0);
+    io_uring_sqe_set_data64(sqe, CancelRequest);
+    io_uring_submit(&ring->ring);
+}
+
+/*!
+    \internal
+    Returns a free entry of the submission queue of \a ring, whose submit
+    mutex must be locked.
+*/
+io_uring_sqe *QVncUringTransport::submission(Ring *ring)
+{
+    io_uring_sqe *sqe = io_uring_get_sqe(&ring->ring);
+    while (!sqe) {
+        io_uring_submit(&ring->ring);
+        sqe = io_uring_get_sqe(&ring->ring);
+    }
+    return sqe;
+}
+
+/*!
+    \internal
+    Queues a multishot receive for \a registration into the provided
+    buffers of \a ring, whose submit mutex must be locked.
+*/
+void QVncUringTransport::receive(Ring *ring, const Registration &registration)
+{
+    io_uring_sqe *sqe = submission(ring);
+    io_uring_prep_recv_multishot(sqe, registration.fd, nullptr, 0, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BufferGroup;
+    io_uring_sqe_set_data64(sqe, registration.id);
+}
+
+/*!
+    \internal
+    Makes the thread of \a ring look at its state.
+*/
+void QVncUringTransport::wake(Ring *ring)
+{
+    QMutexLocker locker(&ring->submitMutex);
+    io_uring_sqe *sqe = submission(ring);
+    io_uring_prep_nop(sqe);
+    io_uring_sqe_set_data64(sqe, WakeRequest);
+    io_uring_submit(&ring->ring);
+}
+
+/*!
+    \internal
+    Main loop of the ring at \a index.
+*/
+void QVncUringTransport::run(int index)
+{
+    Ring *ring = rings.at(index);
+    for (;;) {
+        io_uring_cqe *cqe = nullptr;
+        const int result = io_uring_wait_cqe(&ring->ring, &cqe);
+        if (result == -EINTR)
+            continue;
+        if (result < 0)
+            break;
+
+        QMutexLocker locker(&ring->watchMutex);
+        if (ring->stopping)
+            break;
+
+        bool resubmit = false;
+        unsigned head = 0;
+        unsigned count = 0;
+        io_uring_for_each_cqe(&ring->ring, head, cqe) {
+            count++;
+            const quint64 id = io_uring_cqe_get_data64(cqe);
+            if (id == WakeRequest) {
+                resubmit = !ring->starved.isEmpty();
+                continue;
+            }
+            if (id == CancelRequest)
+                continue;
+
+            Chunk chunk;
+            chunk.ring = index;
+            chunk.size = cqe->res;
+            if (cqe->flags & IORING_CQE_F_BUFFER) {
+                chunk.buffer = int(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                chunk.data = ring->memory.get() + qsizetype(chunk.buffer) * BufferSize;
+                ring->available.fetchAndSubRelaxed(1);
+            }
+            const auto it = ring->watches.constFind(id);
+            if (it == ring->watches.constEnd()) {
+                // The rest of a receive that has been cancelled
+                release(chunk);
+                continue;
+            }
+            if (chunk.size == -ENOBUFS) {
+                // All buffers are with the receivers; go on once one is back
+                ring->starved.append(id);
+                ring->wakeOnRelease.storeRelaxed(1);
+                resubmit = resubmit || ring->available.loadRelaxed() > 0;
+                continue;
+            }
+            it->received(it->registration, chunk);
+            // The kernel may end a multishot receive, for example when the
+            // completion queue overflows
+            if (chunk.size > 0 && !(cqe->flags & IORING_CQE_F_MORE)) {
+                ring->starved.append(id);
+                resubmit = true;
+            }
+        }
+        io_uring_cq_advance(&ring->ring, count);
+
+        // The receives of all connections that need one go out together
+        if (resubmit) {
+            QMutexLocker submitLocker(&ring->submitMutex);
+            for (quint64 id : std::exchange(ring->starved, {})) {
+                const auto it = ring->watches.constFind(id);
+                if (it != ring->watches.constEnd())
+                    receive(ring, it->registration);
+            }
+            io_uring_submit(&ring->ring);
+        }
+    }
+}
+
+QT_END_NAMESPACE
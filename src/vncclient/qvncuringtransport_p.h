@@ -0,0 +1,101 @@
+// Copyright (C) 2025 Signal Slot Inc.
+// SPDX-License-Identifier: LGPL-3.0-only OR GPL-2.0-only OR GPL-3.0-only
+
+#ifndef QVNCURINGTRANSPORT_P_H
+#define QVNCURINGTRANSPORT_P_H
+
+//
+//  W A R N I N G
+//  -------------
+//
+// This file is not part of the Qt API. It exists purely as an
+// implementation detail. This header file may change from version to
+// version without notice, or even be removed.
+//
+// We mean it.
+//
+
+#include "qtvncclientglobal.h"
+
+#include <QtCore/QAtomicInteger>
+#include <QtCore/QHash>
+#include <QtCore/QList>
+#include <QtCore/QMutex>
+
+#include <functional>
+#include <memory>
+
+#include <liburing.h>
+
+QT_BEGIN_NAMESPACE
+
+class QThread;
+
+class QVncUringTransport
+{
+public:
+    struct Registration
+    {
+        int ring = -1;
+        int fd = -1;
+        quint64 id = 0;
+    };
+
+    // Data received into one of the registered buffers, which stays with
+    // the receiver until it calls release(). A size of 0 means the peer
+    // closed the connection, a negative size is an error.
+    struct Chunk
+    {
+        int ring = -1;
+        int buffer = -1;
+        const char *data = nullptr;
+        qsizetype size = 0;
+    };
+    using Callback = std::function<void(const Registration &registration, const Chunk &chunk)>;
+
+    explicit QVncUringTransport(int ringCount);
+    ~QVncUringTransport();
+
+    static QVncUringTransport *instance();
+
+    Registration add(int fd, Callback received);
+    void release(const Chunk &chunk);
+    void remove(const Registration &registration);
+
+private:
+    struct Watch
+    {
+        Registration registration;
+        Callback received;
+    };
+
+    struct Ring
+    {
+        QThread *thread = nullptr;
+        io_uring ring = {};
+        io_uring_buf_ring *buffers = nullptr;
+        std::unique_ptr<char[]> memory;
+        QMutex submitMutex;                     // Guards the submission queue
+        QMutex bufferMutex;                     // Guards handing buffers back
+        QMutex watchMutex;                      // Guards watches and dispatching
+        QHash<quint64, Watch> watches;
+        QList<quint64> starved;                 // Watches whose receive has to be queued again
+        QAtomicInt available;                   // Buffers the kernel can fill
+        QAtomicInt wakeOnRelease;               // Whether release() has to wake the thread
+        bool stopping = false;
+    };
+
+    bool setup(Ring *ring);
+    io_uring_sqe *submission(Ring *ring);
+    void receive(Ring *ring, const Registration &registration);
+    void wake(Ring *ring);
+    void run(int index);
+
+    QList<Ring *> rings;
+    QAtomicInteger<quint64> nextId;
+    bool supported = false;
+};
+
+QT_END_NAMESPACE
+
+#endif // QVNCURINGTRANSPORT_P_H
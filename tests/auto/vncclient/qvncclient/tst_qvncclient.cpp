@@ -11,8 +11,63 @@
 #include <QtCore/QStandardPaths>
 #include <QtNetwork/QTcpSocket>
 #include <QtNetwork/QTcpServer>
+#include <QtNetwork/QLocalServer>
+#include <QtNetwork/QLocalSocket>
+#if QT_CONFIG(ssl)
+#include <QtNetwork/QSslSocket>
+#endif
 #include <QtCore/QThread>
+#include <QtCore/QtEndian>
+#include <QtCore/QCryptographicHash>
+#include <QtGui/QMouseEvent>
 #include <QtVncClient/QVncClient>
+#ifdef USE_IO_URING
+#include "qvncuringtransport_p.h"
+#endif
+
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <vector>
+
+#ifdef Q_OS_LINUX
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+// Stands in for a connection of unknown reach, such as a tunnel. What the
+// test feeds is read by the client, and what the client writes is kept.
+class PipeDevice : public QIODevice
+{
+public:
+    PipeDevice() { open(QIODevice::ReadWrite); }
+    bool isSequential() const override { return true; }
+    qint64 bytesAvailable() const override { return incoming.size() + QIODevice::bytesAvailable(); }
+    void feed(const QByteArray &data)
+    {
+        incoming += data;
+        emit readyRead();
+    }
+
+    QByteArray written;
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) override
+    {
+        const qint64 size = qMin(maxSize, qint64(incoming.size()));
+        memcpy(data, incoming.constData(), size);
+        incoming.remove(0, size);
+        return size;
+    }
+    qint64 writeData(const char *data, qint64 size) override
+    {
+        written.append(data, size);
+        return size;
+    }
+
+private:
+    QByteArray incoming;
+};
 
 class tst_qvncclient : public QObject
 {
@@ -30,6 +85,39 @@ private slots:
     void testImage();
     void testZRLEEncoding();            // Test ZRLE encoding support
     void testTightEncoding();           // Test Tight encoding support
+    void testTightDecoding_data();
+    void testTightDecoding();
+    void testZRLEDecoding_data();
+    void testZRLEDecoding();
+    void testQualityAndCompressionLevel();
+    void testAdaptiveEncoding();
+    void testRemoteEncodingOrder();
+    void testLinkStatistics();
+    void testRegionOfInterest();
+    void testFramebufferUpdated();
+    void testProgressiveUpdate();
+    void testBufferingMode_data();
+    void testBufferingMode();
+    void testThreaded();
+    void testManyThreadedClients();
+    void testDeferredDecoding_data();
+    void testDeferredDecoding();
+    void testOutputCoalescing();
+    void testPointerEventRate();
+    void testLocalCursor();
+    void testTypeText();
+    void testTypeTextWindow();
+    void testKeyEvents();
+    void testQemuKeyEvents();
+    void testLocalSocket();
+    void testSocketDescriptor_data();
+    void testSocketDescriptor();
+    void testWebSocket_data();
+    void testWebSocket();
+    void testVeNCrypt_data();
+    void testVeNCrypt();
+    void testSessionResume();
+    void testHandshakePipelining();
 
 private:
     // Helper method to wait for signals with timeout
@@ -37,6 +125,19 @@ private:
     
     // Helper to check if a port is available
     bool isPortAvailable(int port);
+
+    // Helpers to play the server side of a session over a loopback connection
+    QTcpSocket *startSession(QVncClient *client, QTcpServer *listener, const QSize &size);
+    QByteArray nextMessage(QTcpSocket *peer, QByteArray *buffer, quint8 type);
+    void writeInPieces(QTcpSocket *peer, const QByteArray &data, int size);
+    static bool announces(const QByteArray &setEncodings, qint32 encoding);
+
+    // Builders for the parts of a FramebufferUpdate
+    static QByteArray rectangle(const QRect &rect, qint32 encoding);
+    static QByteArray rawPixels(const QImage &image, const QRect &rect);
+    static QByteArray tightPixels(const QImage &image, const QRect &rect);
+    static QByteArray tightLength(int length);
+    static QByteArray storedBlock(const QByteArray &data);
     
     // VNC server process
     QProcess *server = nullptr;
@@ -177,6 +278,170 @@ bool tst_qvncclient::waitForSignal(QObject *sender, const char *signal, int time
     return timer.isActive();
 }
 
+// Connects the client to the listener and plays a server with a 32 bpp
+// framebuffer of the given size named "desk" up to ServerInit. Returns the
+// server's end with the version reply and ClientInit read, or null.
+QTcpSocket *tst_qvncclient::startSession(QVncClient *client, QTcpServer *listener, const QSize &size)
+{
+    QTcpSocket *socket = new QTcpSocket(client);
+    client->setSocket(socket);
+    socket->connectToHost(QHostAddress::LocalHost, listener->serverPort());
+    if (!listener->waitForNewConnection(5000))
+        return nullptr;
+    QTcpSocket *peer = listener->nextPendingConnection();
+    peer->write("RFB 003.003\n");
+    if (!QTest::qWaitFor([peer]() { return peer->bytesAvailable() >= 12; }, 5000))
+        return nullptr;
+    peer->write(QByteArray("\x00\x00\x00\x01", 4));
+    if (!QTest::qWaitFor([peer]() { return peer->bytesAvailable() >= 13; }, 5000))
+        return nullptr;
+    QByteArray init(4, Qt::Uninitialized);
+    qToBigEndian(quint16(size.width()), init.data());
+    qToBigEndian(quint16(size.height()), init.data() + 2);
+    init += QByteArray("\x20\x18\x00\x01\x00\xff\x00\xff\x00\xff\x10\x08\x00\x00\x00\x00", 16);
+    init += QByteArray("\x00\x00\x00\x04" "desk", 8);
+    peer->write(init);
+    peer->read(13);
+    return peer;
+}
+
+// Reads client messages into the buffer until one of the given type is
+// complete and returns it, dropping the ones before it. Returns an empty
+// array if none arrives within five seconds.
+QByteArray tst_qvncclient::nextMessage(QTcpSocket *peer, QByteArray *buffer, quint8 type)
+{
+    QElapsedTimer timer;
+    timer.start();
+    for (;;) {
+        *buffer += peer->readAll();
+        while (!buffer->isEmpty()) {
+            qsizetype size = 0;
+            switch (quint8(buffer->at(0))) {
+            case 0: size = 20; break;         // SetPixelFormat
+            case 2:                           // SetEncodings
+                if (buffer->size() >= 4)
+                    size = 4 + 4 * qFromBigEndian<quint16>(buffer->constData() + 2);
+                break;
+            case 3: size = 10; break;         // FramebufferUpdateRequest
+            case 4: size = 8; break;          // KeyEvent
+            case 5: size = 6; break;          // PointerEvent
+            case 150: size = 10; break;       // EnableContinuousUpdates
+            case 248:                         // Fence
+                if (buffer->size() >= 9)
+                    size = 9 + quint8(buffer->at(8));
+                break;
+            case 255: size = 12; break;       // QEMU extended key event
+            default:
+                qWarning() << "Unexpected client message" << quint8(buffer->at(0));
+                return QByteArray();
+            }
+            if (size == 0 || size > buffer->size())
+                break;
+            const QByteArray message = buffer->left(size);
+            buffer->remove(0, size);
+            if (quint8(message.at(0)) == type)
+                return message;
+        }
+        if (timer.elapsed() > 5000)
+            return QByteArray();
+        QTest::qWait(10);
+    }
+}
+
+// Writes the data in pieces of the given size, or at once for 0, letting
+// the client read each piece by itself
+void tst_qvncclient::writeInPieces(QTcpSocket *peer, const QByteArray &data, int size)
+{
+    if (size <= 0) {
+        peer->write(data);
+        return;
+    }
+    for (qsizetype pos = 0; pos < data.size(); pos += size) {
+        peer->write(data.mid(pos, size));
+        peer->flush();
+        QTest::qWait(1);
+    }
+}
+
+// Returns whether a SetEncodings message lists the encoding
+bool tst_qvncclient::announces(const QByteArray &setEncodings, qint32 encoding)
+{
+    const int count = qFromBigEndian<quint16>(setEncodings.constData() + 2);
+    for (int i = 0; i < count; i++) {
+        if (qFromBigEndian<qint32>(setEncodings.constData() + 4 + i * 4) == encoding)
+            return true;
+    }
+    return false;
+}
+
+// The header of a rectangle in a FramebufferUpdate
+QByteArray tst_qvncclient::rectangle(const QRect &rect, qint32 encoding)
+{
+    QByteArray header(12, Qt::Uninitialized);
+    qToBigEndian(quint16(rect.x()), header.data());
+    qToBigEndian(quint16(rect.y()), header.data() + 2);
+    qToBigEndian(quint16(rect.width()), header.data() + 4);
+    qToBigEndian(quint16(rect.height()), header.data() + 6);
+    qToBigEndian(encoding, header.data() + 8);
+    return header;
+}
+
+// The pixels of an area in the 32 bpp format of startSession()
+QByteArray tst_qvncclient::rawPixels(const QImage &image, const QRect &rect)
+{
+    QByteArray pixels;
+    for (int y = rect.top(); y <= rect.bottom(); y++) {
+        for (int x = rect.left(); x <= rect.right(); x++) {
+            const QRgb color = image.pixel(x, y);
+            pixels += char(qBlue(color));
+            pixels += char(qGreen(color));
+            pixels += char(qRed(color));
+            pixels += char(0);
+        }
+    }
+    return pixels;
+}
+
+// The pixels of an area as Tight sends them for that format, three bytes
+// each with red first
+QByteArray tst_qvncclient::tightPixels(const QImage &image, const QRect &rect)
+{
+    QByteArray pixels;
+    for (int y = rect.top(); y <= rect.bottom(); y++) {
+        for (int x = rect.left(); x <= rect.right(); x++) {
+            const QRgb color = image.pixel(x, y);
+            pixels += char(qRed(color));
+            pixels += char(qGreen(color));
+            pixels += char(qBlue(color));
+        }
+    }
+    return pixels;
+}
+
+// A Tight compact length
+QByteArray tst_qvncclient::tightLength(int length)
+{
+    QByteArray bytes;
+    bytes += char((length & 0x7f) | (length > 0x7f ? 0x80 : 0));
+    if (length > 0x7f)
+        bytes += char(((length >> 7) & 0x7f) | (length > 0x3fff ? 0x80 : 0));
+    if (length > 0x3fff)
+        bytes += char(length >> 14);
+    return bytes;
+}
+
+// The data as an uncompressed deflate block that does not end the stream,
+// which lets a test continue a zlib stream across rectangles the way a
+// server flushing it after each one does. A stream starts with "\x78\x01".
+QByteArray tst_qvncclient::storedBlock(const QByteArray &data)
+{
+    QByteArray block(5, Qt::Uninitialized);
+    block[0] = 0;
+    qToLittleEndian(quint16(data.size()), block.data() + 1);
+    qToLittleEndian(quint16(~data.size()), block.data() + 3);
+    return block + data;
+}
+
 // Test that the client can successfully establish a connection to a VNC server
 void tst_qvncclient::testConnectionHandshake()
 {
@@ -390,6 +655,11 @@ void tst_qvncclient::testImage()
     // Image should have matching dimensions to framebuffer
     QCOMPARE(image.width(), client.framebufferWidth()); 
     QCOMPARE(image.height(), client.framebufferHeight()); 
+
+    // The non-copying accessor refers to the same framebuffer
+    const QImage &constImage = client.constImage();
+    QCOMPARE(constImage.size(), image.size());
+    QCOMPARE(&constImage, &client.constImage());
     
     // Check that there's actual image content (not all white)
     bool hasNonWhitePixel = false;
@@ -563,5 +833,1555 @@ void tst_qvncclient::testTightEncoding()
     }
 }
 
+void tst_qvncclient::testTightDecoding_data()
+{
+    QTest::addColumn<int>("pieces");
+    QTest::newRow("whole") << 0;
+    QTest::newRow("bytes") << 1;
+    QTest::newRow("odd") << 7;
+    QTest::newRow("large") << 97;
+}
+
+// Test the Tight compression types and filters against a fake server, with
+// the update arriving at once or split at arbitrary bytes
+void tst_qvncclient::testTightDecoding()
+{
+    QFETCH(int, pieces);
+    QTcpServer listener;
+    QVERIFY(listener.listen(QHostAddress::LocalHost));
+
+    QVncClient client;
+    QTcpSocket *peer = startSession(&client, &listener, QSize(32, 16));
+    QVERIFY(peer);
+    QByteArray messages;
+    const QByteArray setEncodings = nextMessage(peer, &messages, 2);
+    QVERIFY(!setEncodings.isEmpty());
+    if (!announces(setEncodings, 7))
+        QSKIP("Tight encoding needs zlib");
+    QVERIFY(!nextMessage(peer, &messages, 3).isEmpty());
+
+    // The server's framebuffer, drawn along with the update
+    QImage expected(32, 16, QImage::Format_ARGB32);
+    const auto draw = [&](const QRect &rect, const std::function<QRgb(int, int)> &color) {
+        for (int y = rect.top(); y <= rect.bottom(); y++) {
+            for (int x = rect.left(); x <= rect.right(); x++)
+                expected.setPixel(x, y, color(x, y));
+        }
+    };
+    const auto tightPixel = [](QRgb color) {
+        return QByteArray() + char(qRed(color)) + char(qGreen(color)) + char(qBlue(color));
+    };
+    const QRgb colors[] = {
+        qRgb(0, 0, 0), qRgb(0xff, 0xee, 0), qRgb(0x20, 0x40, 0xff), qRgb(0xc0, 0x10, 0x30),
+    };
+    // A byte per pixel indexing the colours above
+    const auto indices = [&](const QRect &rect) {
+        QByteArray data;
+        for (int y = rect.top(); y <= rect.bottom(); y++) {
+            for (int x = rect.left(); x <= rect.right(); x++)
+                data += char(std::find(std::begin(colors), std::end(colors), expected.pixel(x, y)) - std::begin(colors));
+        }
+        return data;
+    };
+    QByteArray update("\x00\x00\x00\x07", 4);
+
+    // A single colour
+    const QRect fill(0, 0, 8, 4);
+    draw(fill, [](int, int) { return qRgb(0x12, 0x34, 0x56); });
+    update += rectangle(fill, 7) + '\x80' + tightPixel(qRgb(0x12, 0x34, 0x56));
+
+    // The copy filter on stream 0, implied by leaving out the filter id
+    const QRect copy(8, 0, 8, 4);
+    draw(copy, [](int x, int y) { return qRgb(x * 8, y * 16, 0x90); });
+    QByteArray data = QByteArray("\x78\x01", 2) + storedBlock(tightPixels(expected, copy));
+    update += rectangle(copy, 7) + '\x00' + tightLength(data.size()) + data;
+
+    // Two colours on stream 1 take a bit per pixel, and the 8 bytes of them
+    // are too few to be compressed
+    const QRect mono(16, 0, 16, 4);
+    draw(mono, [&](int x, int y) { return colors[(x + y) % 3 ? 1 : 0]; });
+    data.clear();
+    for (int y = mono.top(); y <= mono.bottom(); y++) {
+        for (int byte = 0; byte < 2; byte++) {
+            quint8 bits = 0;
+            for (int bit = 0; bit < 8; bit++) {
+                if (expected.pixel(mono.left() + byte * 8 + bit, y) == colors[1])
+                    bits |= 0x80 >> bit;
+            }
+            data += char(bits);
+        }
+    }
+    QCOMPARE(data.size(), 8);
+    update += rectangle(mono, 7) + "\x50\x01\x01" + tightPixel(colors[0]) + tightPixel(colors[1]) + data;
+
+    // More colours on stream 1 take a byte per pixel
+    const QRect palette(0, 4, 16, 4);
+    draw(palette, [&](int x, int y) { return colors[(x / 3 + y) % 4]; });
+    data = QByteArray("\x78\x01", 2) + storedBlock(indices(palette));
+    update += rectangle(palette, 7) + "\x50\x01\x03";
+    for (QRgb color : colors)
+        update += tightPixel(color);
+    update += tightLength(data.size()) + data;
+
+    // The gradient filter on stream 2 sends the difference of each channel
+    // to the estimate from the pixels left and above
+    const QRect gradient(16, 4, 16, 4);
+    draw(gradient, [](int x, int y) { return qRgb(x * 12 + y, 0xff - x * y, y * 40); });
+    QByteArray deltas;
+    for (int y = gradient.top(); y <= gradient.bottom(); y++) {
+        for (int x = gradient.left(); x <= gradient.right(); x++) {
+            const auto channels = [&](int px, int py) -> std::array<int, 3> {
+                if (!gradient.contains(px, py))
+                    return { 0, 0, 0 };
+                const QRgb color = expected.pixel(px, py);
+                return { qRed(color), qGreen(color), qBlue(color) };
+            };
+            const auto value = channels(x, y);
+            const auto left = channels(x - 1, y);
+            const auto up = channels(x, y - 1);
+            const auto upLeft = channels(x - 1, y - 1);
+            for (int c = 0; c < 3; c++)
+                deltas += char(value[c] - qBound(0, left[c] + up[c] - upLeft[c], 255));
+        }
+    }
+    data = QByteArray("\x78\x01", 2) + storedBlock(deltas);
+    update += rectangle(gradient, 7) + "\x60\x02" + tightLength(data.size()) + data;
+
+    // Resetting stream 0 starts it over, here with an explicit copy filter
+    const QRect reset(0, 8, 16, 8);
+    draw(reset, [](int x, int y) { return qRgb(0x70, x * 16, y * 32); });
+    data = QByteArray("\x78\x01", 2) + storedBlock(tightPixels(expected, reset));
+    update += rectangle(reset, 7) + QByteArray("\x41\x00", 2) + tightLength(data.size()) + data;
+
+    // Stream 1 goes on where the palette left it
+    const QRect continued(16, 8, 16, 8);
+    draw(continued, [&](int x, int y) { return colors[(x + y / 2) % 4]; });
+    data = storedBlock(indices(continued));
+    update += rectangle(continued, 7) + "\x50\x01\x03";
+    for (QRgb color : colors)
+        update += tightPixel(color);
+    update += tightLength(data.size()) + data;
+
+    writeInPieces(peer, update, pieces);
+    QVERIFY(!nextMessage(peer, &messages, 3).isEmpty());
+    QTRY_COMPARE_WITH_TIMEOUT(client.image().convertToFormat(QImage::Format_ARGB32), expected, 5000);
+}
+
+void tst_qvncclient::testZRLEDecoding_data()
+{
+    QTest::addColumn<int>("pieces");
+    QTest::newRow("whole") << 0;
+    QTest::newRow("odd") << 13;
+    QTest::newRow("large") << 1021;
+}
+
+// Test the ZRLE subencodings against a fake server, with the update
+// arriving at once or split at arbitrary bytes
+void tst_qvncclient::testZRLEDecoding()
+{
+    QFETCH(int, pieces);
+    QTcpServer listener;
+    QVERIFY(listener.listen(QHostAddress::LocalHost));
+
+    QVncClient client;
+    QTcpSocket *peer = startSession(&client, &listener, QSize(144, 80));
+    QVERIFY(peer);
+    QByteArray messages;
+    const QByteArray setEncodings = nextMessage(peer, &messages, 2);
+    QVERIFY(!setEncodings.isEmpty());
+    if (!announces(setEncodings, 16))
+        QSKIP("ZRLE encoding needs zlib");
+    QVERIFY(!nextMessage(peer, &messages, 3).isEmpty());
+
+    // The server's framebuffer, drawn along with the update
+    QImage expected(144, 80, QImage::Format_ARGB32);
+    const auto draw = [&](const QRect &rect, const std::function<QRgb(int, int)> &color) {
+        for (int y = rect.top(); y <= rect.bottom(); y++) {
+            for (int x = rect.left(); x <= rect.right(); x++)
+                expected.setPixel(x, y, color(x, y));
+        }
+    };
+    // A CPIXEL leaves out the unused byte of the pixel
+    const auto compactPixel = [](QRgb color) {
+        return QByteArray() + char(qBlue(color)) + char(qGreen(color)) + char(qRed(color));
+    };
+    const auto runLength = [](int length) {
+        return QByteArray((length - 1) / 255, '\xff') + char((length - 1) % 255);
+    };
+    // Encodes a tile of the server's framebuffer with the subencoding, the
+    // palette being the colours in the order they appear
+    const auto tile = [&](const QRect &area, int subencoding) {
+        QList<QRgb> pixels;
+        QList<QRgb> palette;
+        for (int y = area.top(); y <= area.bottom(); y++) {
+            for (int x = area.left(); x <= area.right(); x++) {
+                pixels.append(expected.pixel(x, y));
+                if (!palette.contains(pixels.last()))
+                    palette.append(pixels.last());
+            }
+        }
+        QByteArray data(1, char(subencoding));
+        if (subencoding == 0) {
+            for (QRgb pixel : std::as_const(pixels))
+                data += compactPixel(pixel);
+            return data;
+        }
+        if (subencoding == 1)
+            return data + compactPixel(pixels.first());
+        if (subencoding != 128) {
+            for (QRgb color : std::as_const(palette))
+                data += compactPixel(color);
+        }
+        if (subencoding <= 16) {
+            const int bits = palette.size() == 2 ? 1 : palette.size() <= 4 ? 2 : 4;
+            for (int y = 0; y < area.height(); y++) {
+                QByteArray row((area.width() * bits + 7) / 8, '\0');
+                for (int x = 0; x < area.width(); x++) {
+                    const int index = palette.indexOf(pixels.at(y * area.width() + x));
+                    row[x * bits / 8] = char(row.at(x * bits / 8) | index << (8 - bits - x * bits % 8));
+                }
+                data += row;
+            }
+            return data;
+        }
+        for (qsizetype i = 0; i < pixels.size();) {
+            qsizetype length = 1;
+            while (i + length < pixels.size() && pixels.at(i + length) == pixels.at(i))
+                length++;
+            if (subencoding == 128)
+                data += compactPixel(pixels.at(i)) + runLength(length);
+            else if (length == 1)
+                data += char(palette.indexOf(pixels.at(i)));
+            else
+                data += char(0x80 | palette.indexOf(pixels.at(i))) + runLength(length);
+            i += length;
+        }
+        return data;
+    };
+    QByteArray update("\x00\x00\x00\x02", 4);
+
+    // Six tiles of 64x64 pixels or what is left of the rectangle at its
+    // right and bottom edges, one per subencoding
+    const QRect first(0, 0, 144, 70);
+    QByteArray tiles;
+    draw(QRect(0, 0, 64, 64), [](int x, int y) { return qRgb(x * 4, y * 4, 0x33); });
+    tiles += tile(QRect(0, 0, 64, 64), 0);
+    draw(QRect(64, 0, 64, 64), [](int, int) { return qRgb(0x44, 0x88, 0xcc); });
+    tiles += tile(QRect(64, 0, 64, 64), 1);
+    draw(QRect(128, 0, 16, 64), [](int x, int y) { return qRgb(0x10, ((y * 16 + x) / 37 % 3) * 0x60, 0x10); });
+    tiles += tile(QRect(128, 0, 16, 64), 128 + 3);
+    draw(QRect(0, 64, 64, 6), [](int x, int y) { return qRgb(((x / 3 + y) % 4) * 0x50, 0x20, 0xa0); });
+    tiles += tile(QRect(0, 64, 64, 6), 4);
+    draw(QRect(64, 64, 64, 6), [](int x, int y) { return qRgb((y * 64 + x) / 300 * 0x80, 0x10, 0xf0); });
+    tiles += tile(QRect(64, 64, 64, 6), 128);
+    draw(QRect(128, 64, 16, 6), [](int x, int y) { return (x + y) % 2 ? qRgb(0xff, 0xff, 0) : qRgb(0, 0, 0x80); });
+    tiles += tile(QRect(128, 64, 16, 6), 2);
+    QByteArray data = QByteArray("\x78\x01", 2) + storedBlock(tiles);
+    update += rectangle(first, 16);
+    update += QByteArray(4, Qt::Uninitialized);
+    qToBigEndian(quint32(data.size()), update.data() + update.size() - 4);
+    update += data;
+
+    // A second rectangle continues the stream
+    const QRect second(0, 70, 144, 10);
+    draw(QRect(0, 70, 64, 10), [](int x, int) { return qRgb((x / 4) * 16, 0xff - (x / 4) * 16, 0x80); });
+    tiles = tile(QRect(0, 70, 64, 10), 16);
+    draw(QRect(64, 70, 64, 10), [](int, int) { return qRgb(0xfe, 0xdc, 0xba); });
+    tiles += tile(QRect(64, 70, 64, 10), 1);
+    draw(QRect(128, 70, 16, 10), [](int x, int y) { return qRgb(x, y, x + y); });
+    tiles += tile(QRect(128, 70, 16, 10), 0);
+    data = storedBlock(tiles);
+    update += rectangle(second, 16);
+    update += QByteArray(4, Qt::Uninitialized);
+    qToBigEndian(quint32(data.size()), update.data() + update.size() - 4);
+    update += data;
+
+    writeInPieces(peer, update, pieces);
+    QVERIFY(!nextMessage(peer, &messages, 3).isEmpty());
+    QTRY_COMPARE_WITH_TIMEOUT(client.image().convertToFormat(QImage::Format_ARGB32), expected, 5000);
+}
+
+// Test the quality and compression level properties
+void tst_qvncclient::testQualityAndCompressionLevel()
+{
+    QVncClient client;
+    QSignalSpy qualitySpy(&client, &QVncClient::qualityLevelChanged);
+    QSignalSpy compressionSpy(&client, &QVncClient::compressionLevelChanged);
+
+    // Both default to the server's choice
+    QCOMPARE(client.qualityLevel(), -1);
+    QCOMPARE(client.compressionLevel(), -1);
+
+    client.setQualityLevel(3);
+    QCOMPARE(client.qualityLevel(), 3);
+    QCOMPARE(qualitySpy.count(), 1);
+
+    // Setting the same value again does not emit
+    client.setQualityLevel(3);
+    QCOMPARE(qualitySpy.count(), 1);
+
+    // Out of range values are clamped
+    client.setQualityLevel(42);
+    QCOMPARE(client.qualityLevel(), 9);
+    client.setCompressionLevel(-5);
+    QCOMPARE(client.compressionLevel(), -1);
+    QCOMPARE(compressionSpy.count(), 0);
+    client.setCompressionLevel(1);
+    QCOMPARE(client.compressionLevel(), 1);
+    QCOMPARE(compressionSpy.count(), 1);
+
+    // TurboVNC fine-grained quality and subsampling
+    QCOMPARE(client.fineQualityLevel(), -1);
+    client.setFineQualityLevel(0);
+    QCOMPARE(client.fineQualityLevel(), 1);
+    client.setFineQualityLevel(250);
+    QCOMPARE(client.fineQualityLevel(), 100);
+    QSignalSpy subsamplingSpy(&client, &QVncClient::subsamplingChanged);
+    QCOMPARE(client.subsampling(), QVncClient::SubsamplingDefault);
+    client.setSubsampling(QVncClient::SubsamplingGray);
+    QCOMPARE(client.subsampling(), QVncClient::SubsamplingGray);
+    QCOMPARE(subsamplingSpy.count(), 1);
+
+    if (!server)
+        return;
+
+    // Changing the levels mid-session must not break the connection
+    QSignalSpy imageSpy(&client, &QVncClient::imageChanged);
+    QTcpSocket *socket = new QTcpSocket(&client);
+    client.setSocket(socket);
+    socket->connectToHost("localhost", vncPort);
+    QVERIFY2(socket->waitForConnected(5000),
+            qPrintable(QString("Failed to connect to VNC server: %1").arg(socket->errorString())));
+    QTRY_VERIFY_WITH_TIMEOUT(imageSpy.count() > 0, 10000);
+
+    client.setQualityLevel(0);
+    client.setCompressionLevel(9);
+    QTest::qWait(500);
+    QCOMPARE(socket->state(), QAbstractSocket::ConnectedState);
+}
+
+// Test the adaptive encoding property and that a slow link reorders the
+// announced encodings
+void tst_qvncclient::testAdaptiveEncoding()
+{
+    QVncClient client;
+    QVERIFY(!client.adaptiveEncoding());
+    QSignalSpy adaptiveSpy(&client, &QVncClient::adaptiveEncodingChanged);
+    client.setAdaptiveEncoding(true);
+    QVERIFY(client.adaptiveEncoding());
+    QCOMPARE(adaptiveSpy.count(), 1);
+    QCOMPARE(adaptiveSpy.at(0).at(0).toBool(), true);
+
+    // Setting the same value again does not emit
+    client.setAdaptiveEncoding(true);
+    QCOMPARE(adaptiveSpy.count(), 1);
+
+    QTcpServer listener;
+    QVERIFY(listener.listen(QHostAddress::LocalHost));
+    QTcpSocket *peer = startSession(&client, &listener, QSize(64, 64));
+    QVERIFY(peer);
+    QByteArray messages;
+    const QByteArray initial = nextMessage(peer, &messages, 2);
+    QVERIFY(!initial.isEmpty());
+    const int count = qFromBigEndian<quint16>(initial.constData() + 2);
+    QList<qint32> encodings;
+    for (int i = 0; i < count; i++)
+        encodings.append(qFromBigEndian<qint32>(initial.constData() + 4 + i * 4));
+    // Raw is cheapest while the link is assumed to be loopback speed
+    QCOMPARE(encodings.first(), qint32(0));
+
+    // Raw updates of 16 KiB taking 100 ms each measure a link that is far
+    // too slow for Raw. They are written from another thread, as the client
+    // may block while reading an update.
+    QByteArray update("\x00\x00\x00\x01\x00\x00\x00\x00\x00\x40\x00\x40\x00\x00\x00\x00", 16);
+    update += QByteArray(64 * 64 * 4, '\x80');
+    QThread *mainThread = QThread::currentThread();
+    QScopedPointer<QThread> writer(QThread::create([peer, update, mainThread]() {
+        for (int i = 0; i < 5; i++) {
+            peer->write(update.left(update.size() / 2));
+            peer->waitForBytesWritten(1000);
+            QThread::msleep(100);
+            peer->write(update.mid(update.size() / 2));
+            peer->waitForBytesWritten(1000);
+            QThread::msleep(100);
+        }
+        peer->moveToThread(mainThread);
+    }));
+    peer->setParent(nullptr);
+    peer->moveToThread(writer.data());
+    writer->start();
+    QTRY_VERIFY_WITH_TIMEOUT(writer->isFinished(), 10000);
+    peer->setParent(&listener);
+
+    // The order is announced again, led by an encoding that compresses
+    const QByteArray resent = nextMessage(peer, &messages, 2);
+    QVERIFY(!resent.isEmpty());
+    QList<qint32> reordered;
+    for (int i = 0; i < qFromBigEndian<quint16>(resent.constData() + 2); i++)
+        reordered.append(qFromBigEndian<qint32>(resent.constData() + 4 + i * 4));
+    QVERIFY(reordered.first() != qint32(0));
+    for (qint32 encoding : std::as_const(encodings)) {
+        if (encoding >= 0)
+            QVERIFY(reordered.contains(encoding));
+    }
+    // Tight, where available, comes with JPEG for the slow link
+    if (encodings.contains(7)) {
+        QCOMPARE(reordered.first(), qint32(7));
+        QVERIFY(reordered.contains(-32 + 6));
+    }
+}
+
+// Test that throughput and latency estimates become available
+void tst_qvncclient::testRemoteEncodingOrder()
+{
+    PipeDevice device;
+    QVncClient client;
+    client.setDevice(&device);
+    device.feed("RFB 003.003\n");
+    QTRY_COMPARE_WITH_TIMEOUT(device.written.size(), 12, 5000);
+    device.feed(QByteArray("\x00\x00\x00\x01", 4));
+    QTRY_COMPARE_WITH_TIMEOUT(device.written.size(), 13, 5000);
+    device.feed(QByteArray("\x00\x04\x00\x04\x20\x18\x00\x01\x00\xff\x00\xff\x00\xff\x10\x08"
+                           "\x00\x00\x00\x00\x00\x00\x00\x04" "desk", 28));
+
+    // SetPixelFormat, then SetEncodings
+    QTRY_VERIFY_WITH_TIMEOUT(device.written.size() >= 13 + 20 + 4, 5000);
+    const QByteArray setEncodings = device.written.mid(13 + 20);
+    QCOMPARE(quint8(setEncodings.at(0)), quint8(2));
+    const int count = qFromBigEndian<quint16>(setEncodings.constData() + 2);
+    QVERIFY(setEncodings.size() >= 4 + count * 4);
+    QList<qint32> encodings;
+    for (int i = 0; i < count; i++)
+        encodings.append(qFromBigEndian<qint32>(setEncodings.constData() + 4 + i * 4));
+
+    // Without a loopback peer, Raw comes after every encoding that
+    // compresses, right before CopyRect
+    QCOMPARE(encodings.first(), 5);
+    const qsizetype raw = encodings.indexOf(0);
+    QVERIFY(raw > 0);
+    QCOMPARE(encodings.value(raw + 1), 1);
+}
+
+void tst_qvncclient::testLinkStatistics()
+{
+    QVncClient client;
+    QCOMPARE(client.bandwidth(), -1.0);
+    QCOMPARE(client.roundTripTime(), -1.0);
+    QCOMPARE(client.serverLatency(), -1.0);
+
+    if (!server)
+        QSKIP("No VNC server available");
+
+    QSignalSpy roundTripSpy(&client, &QVncClient::roundTripTimeChanged);
+    QTcpSocket *socket = new QTcpSocket(&client);
+    client.setSocket(socket);
+    socket->connectToHost("localhost", vncPort);
+    QVERIFY2(socket->waitForConnected(5000),
+            qPrintable(QString("Failed to connect to VNC server: %1").arg(socket->errorString())));
+
+    // The first update answers our first request, which gives a round trip
+    QTRY_VERIFY_WITH_TIMEOUT(roundTripSpy.count() > 0, 10000);
+    QVERIFY(client.roundTripTime() >= 0);
+    QVERIFY(client.serverLatency() >= 0);
+
+    // Going away reports the values as unknown again
+    socket->disconnectFromHost();
+    QTRY_COMPARE_WITH_TIMEOUT(client.roundTripTime(), -1.0, 5000);
+}
+
+void tst_qvncclient::testRegionOfInterest()
+{
+    QVncClient client;
+    QVERIFY(client.regionOfInterest().isNull());
+
+    QSignalSpy spy(&client, &QVncClient::regionOfInterestChanged);
+    client.setRegionOfInterest(QRect(0, 0, 64, 64));
+    QCOMPARE(spy.count(), 1);
+    client.setRegionOfInterest(QRect(0, 0, 64, 64));
+    QCOMPARE(spy.count(), 1);
+
+    if (!server)
+        QSKIP("No VNC server available");
+
+    QSignalSpy imageSpy(&client, &QVncClient::imageChanged);
+    QTcpSocket *socket = new QTcpSocket(&client);
+    client.setSocket(socket);
+    socket->connectToHost("localhost", vncPort);
+    QVERIFY2(socket->waitForConnected(5000),
+            qPrintable(QString("Failed to connect to VNC server: %1").arg(socket->errorString())));
+
+    // Only the region of interest is requested
+    QTRY_VERIFY_WITH_TIMEOUT(imageSpy.count() > 0, 10000);
+    for (const auto &args : imageSpy)
+        QVERIFY(QRect(0, 0, 64, 64).contains(args.at(0).toRect()));
+
+    // Growing the region requests the newly exposed part
+    imageSpy.clear();
+    client.setRegionOfInterest(QRect());
+    QTRY_VERIFY_WITH_TIMEOUT(imageSpy.count() > 0, 10000);
+
+    socket->disconnectFromHost();
+}
+
+void tst_qvncclient::testFramebufferUpdated()
+{
+    if (!server)
+        QSKIP("No VNC server available");
+
+    QVncClient client;
+    QSignalSpy imageSpy(&client, &QVncClient::imageChanged);
+    QSignalSpy updateSpy(&client, &QVncClient::framebufferUpdated);
+    QTcpSocket *socket = new QTcpSocket(&client);
+    client.setSocket(socket);
+    socket->connectToHost("localhost", vncPort);
+    QVERIFY2(socket->waitForConnected(5000),
+            qPrintable(QString("Failed to connect to VNC server: %1").arg(socket->errorString())));
+
+    // The first update covers the whole framebuffer, coalesced into one region
+    QTRY_VERIFY_WITH_TIMEOUT(updateSpy.count() > 0, 10000);
+    const QRegion region = updateSpy.first().at(0).value<QRegion>();
+    QCOMPARE(region.boundingRect(), client.image().rect());
+    QVERIFY(imageSpy.count() >= region.rectCount());
+
+    socket->disconnectFromHost();
+}
+
+// Test that a large raw rectangle on a slow link shows up row by row
+void tst_qvncclient::testProgressiveUpdate()
+{
+    QTcpServer listener;
+    QVERIFY(listener.listen(QHostAddress::LocalHost));
+
+    QVncClient client;
+    QSignalSpy updateSpy(&client, &QVncClient::framebufferUpdated);
+    QTcpSocket *peer = startSession(&client, &listener, QSize(32, 32));
+    QVERIFY(peer);
+    QByteArray messages;
+    QVERIFY(!nextMessage(peer, &messages, 3).isEmpty());
+
+    QImage expected(32, 32, QImage::Format_ARGB32);
+    for (int y = 0; y < 32; y++) {
+        for (int x = 0; x < 32; x++)
+            expected.setPixel(x, y, qRgb(x * 8, y * 8, 0x55));
+    }
+    const QByteArray update = QByteArray("\x00\x00\x00\x01", 4)
+            + rectangle(expected.rect(), 0) + rawPixels(expected, expected.rect());
+    const qsizetype rowBytes = 32 * 4;
+
+    // Ten and a half rows, and after a while the rest of the first twenty
+    peer->write(update.left(16 + rowBytes * 10 + rowBytes / 2));
+    QTest::qWait(60);
+    peer->write(update.mid(16 + rowBytes * 10 + rowBytes / 2, rowBytes * 10 - rowBytes / 2));
+
+    // What has been decoded is published before the rectangle is complete
+    QTRY_VERIFY_WITH_TIMEOUT(!updateSpy.isEmpty(), 5000);
+    const QRegion partial = updateSpy.first().first().value<QRegion>();
+    QVERIFY(!partial.isEmpty());
+    QVERIFY(QRect(0, 0, 32, 20).contains(partial.boundingRect()));
+    QCOMPARE(partial.boundingRect().top(), 0);
+    const QImage image = client.image();
+    for (int y = 0; y < partial.boundingRect().height(); y++) {
+        for (int x = 0; x < 32; x++)
+            QCOMPARE(image.pixel(x, y), expected.pixel(x, y));
+    }
+    QCOMPARE(image.pixel(0, 31), qRgb(255, 255, 255));
+
+    // The last byte completes the frame
+    peer->write(update.mid(16 + rowBytes * 20));
+    QVERIFY(!nextMessage(peer, &messages, 3).isEmpty());
+    QTRY_COMPARE_WITH_TIMEOUT(client.image().convertToFormat(QImage::Format_ARGB32), expected, 5000);
+    QVERIFY(updateSpy.last().first().value<QRegion>().contains(QRect(0, 31, 32, 1)));
+}
+
+void tst_qvncclient::testBufferingMode_data()
+{
+    QTest::addColumn<QVncClient::BufferingMode>("mode");
+    QTest::newRow("single") << QVncClient::SingleBuffering;
+    QTest::newRow("double") << QVncClient::DoubleBuffering;
+    QTest::newRow("triple") << QVncClient::TripleBuffering;
+}
+
+void tst_qvncclient::testBufferingMode()
+{
+    QFETCH(QVncClient::BufferingMode, mode);
+
+    QVncClient client;
+    QCOMPARE(client.bufferingMode(), QVncClient::SingleBuffering);
+    QSignalSpy modeSpy(&client, &QVncClient::bufferingModeChanged);
+    client.setBufferingMode(mode);
+    QCOMPARE(client.bufferingMode(), mode);
+    QCOMPARE(modeSpy.count(), mode == QVncClient::SingleBuffering ? 0 : 1);
+
+    if (!server)
+        QSKIP("No VNC server available");
+
+    QSignalSpy updateSpy(&client, &QVncClient::framebufferUpdated);
+    QTcpSocket *socket = new QTcpSocket(&client);
+    client.setSocket(socket);
+    socket->connectToHost("localhost", vncPort);
+    QVERIFY2(socket->waitForConnected(5000),
+            qPrintable(QString("Failed to connect to VNC server: %1").arg(socket->errorString())));
+
+    // A frame held by a reader is not modified by later updates
+    QTRY_VERIFY_WITH_TIMEOUT(updateSpy.count() > 0, 10000);
+    const QImage held = client.image();
+    QCOMPARE(held.size(), QSize(client.framebufferWidth(), client.framebufferHeight()));
+    const QImage snapshot = held.copy();
+    updateSpy.clear();
+    QTest::qWait(500);
+    QCOMPARE(held, snapshot);
+
+    // The published frame is complete and matches the framebuffer size
+    QCOMPARE(client.image().size(), held.size());
+
+    socket->disconnectFromHost();
+}
+
+void tst_qvncclient::testThreaded()
+{
+    QVncClient client;
+    QVERIFY(!client.isThreaded());
+    QSignalSpy threadedSpy(&client, &QVncClient::threadedChanged);
+    client.setThreaded(true);
+    QVERIFY(client.isThreaded());
+    QCOMPARE(threadedSpy.count(), 1);
+
+    if (!server)
+        QSKIP("No VNC server available");
+
+    QSignalSpy sizeSpy(&client, &QVncClient::framebufferSizeChanged);
+    QSignalSpy updateSpy(&client, &QVncClient::framebufferUpdated);
+    QTcpSocket *socket = new QTcpSocket(&client);
+    client.setSocket(socket);
+    socket->connectToHost("localhost", vncPort);
+    QVERIFY2(socket->waitForConnected(5000),
+            qPrintable(QString("Failed to connect to VNC server: %1").arg(socket->errorString())));
+
+    // Results of the decode threads arrive in the thread of the client
+    QTRY_VERIFY_WITH_TIMEOUT(updateSpy.count() > 0, 10000);
+    QCOMPARE(sizeSpy.count(), 1);
+    QCOMPARE(client.protocolVersion(), QVncClient::ProtocolVersion33);
+    QCOMPARE(client.constImage().size(), QSize(client.framebufferWidth(), client.framebufferHeight()));
+    QVERIFY(!client.image().isNull());
+
+    // Leaving threaded mode keeps the session going
+    client.setThreaded(false);
+    QVERIFY(!client.isThreaded());
+    QCOMPARE(threadedSpy.count(), 2);
+    QCOMPARE(client.constImage().size(), QSize(client.framebufferWidth(), client.framebufferHeight()));
+    QMouseEvent move(QEvent::MouseMove, QPointF(1, 1), QPointF(1, 1), Qt::NoButton, Qt::NoButton, Qt::NoModifier);
+    client.handlePointerEvent(&move);
+    QVERIFY(socket->state() == QAbstractSocket::ConnectedState);
+
+    socket->disconnectFromHost();
+}
+
+void tst_qvncclient::testManyThreadedClients()
+{
+    if (!server)
+        QSKIP("No VNC server available");
+
+    // Many more clients than cores share the decode threads
+    const int count = 4 * QThread::idealThreadCount();
+    std::vector<std::unique_ptr<QVncClient>> clients;
+    std::vector<std::unique_ptr<QSignalSpy>> spies;
+    for (int i = 0; i < count; i++) {
+        auto client = std::make_unique<QVncClient>();
+        client->setThreaded(true);
+        spies.push_back(std::make_unique<QSignalSpy>(client.get(), &QVncClient::framebufferUpdated));
+        QTcpSocket *socket = new QTcpSocket(client.get());
+        client->setSocket(socket);
+        socket->connectToHost("localhost", vncPort);
+        clients.push_back(std::move(client));
+    }
+
+    for (int i = 0; i < count; i++) {
+        QTRY_VERIFY_WITH_TIMEOUT(spies[i]->count() > 0, 20000);
+        QCOMPARE(clients[i]->constImage().size(),
+                 QSize(clients[i]->framebufferWidth(), clients[i]->framebufferHeight()));
+    }
+
+    // Clients go away with work possibly still queued for them
+    spies.clear();
+    clients.clear();
+}
+
+void tst_qvncclient::testDeferredDecoding_data()
+{
+    QTest::addColumn<bool>("threaded");
+    QTest::newRow("unthreaded") << false;
+    QTest::newRow("threaded") << true;
+}
+
+// Test that rectangles decoded concurrently within an update keep the
+// order their areas and zlib streams depend on
+void tst_qvncclient::testDeferredDecoding()
+{
+    QFETCH(bool, threaded);
+    QTcpServer listener;
+    QVERIFY(listener.listen(QHostAddress::LocalHost));
+
+    QVncClient client;
+    client.setThreaded(threaded);
+    QTcpSocket *peer = startSession(&client, &listener, QSize(16, 12));
+    QVERIFY(peer);
+    QByteArray messages;
+    const QByteArray setEncodings = nextMessage(peer, &messages, 2);
+    QVERIFY(!setEncodings.isEmpty());
+    if (!announces(setEncodings, 7))
+        QSKIP("Tight encoding needs zlib");
+    QVERIFY(!nextMessage(peer, &messages, 3).isEmpty());
+
+    // The server's framebuffer, drawn along with the update
+    QImage expected(16, 12, QImage::Format_ARGB32);
+    const auto draw = [&](const QRect &rect, const std::function<QRgb(int, int)> &color) {
+        for (int y = rect.top(); y <= rect.bottom(); y++) {
+            for (int x = rect.left(); x <= rect.right(); x++)
+                expected.setPixel(x, y, color(x, y));
+        }
+    };
+    QByteArray update("\x00\x00\x00\x05", 4);
+
+    // Two raw rectangles, the second one overwriting half of the first
+    const QRect first(0, 0, 8, 8);
+    draw(first, [](int x, int y) { return qRgb(x * 16, y * 16, 0x40); });
+    update += rectangle(first, 0) + rawPixels(expected, first);
+    const QRect second(4, 0, 8, 8);
+    draw(second, [](int x, int y) { return qRgb(0x80, x * 16, y * 16); });
+    update += rectangle(second, 0) + rawPixels(expected, second);
+
+    // A copy of an area both of them wrote to
+    const QRect copy(12, 0, 4, 8);
+    for (int y = copy.top(); y <= copy.bottom(); y++) {
+        for (int x = copy.left(); x <= copy.right(); x++)
+            expected.setPixel(x, y, expected.pixel(x - 10, y));
+    }
+    update += rectangle(copy, 1) + QByteArray("\x00\x02\x00\x00", 4);
+
+    // Two Tight rectangles on stream 0, the second one continuing the zlib
+    // stream where the first one left it
+    const QRect left(0, 8, 8, 4);
+    draw(left, [](int x, int y) { return qRgb(0x20, y * 32, x * 16); });
+    QByteArray data = QByteArray("\x78\x01", 2) + storedBlock(tightPixels(expected, left));
+    update += rectangle(left, 7) + '\x00' + tightLength(data.size()) + data;
+    const QRect right(8, 8, 8, 4);
+    draw(right, [](int x, int y) { return qRgb(x * 16, 0xc0, y * 32); });
+    data = storedBlock(tightPixels(expected, right));
+    update += rectangle(right, 7) + '\x00' + tightLength(data.size()) + data;
+
+    // Arriving at once, the rectangles are decoded concurrently
+    peer->write(update);
+    QVERIFY(!nextMessage(peer, &messages, 3).isEmpty());
+    QTRY_COMPARE_WITH_TIMEOUT(client.image().convertToFormat(QImage::Format_ARGB32), expected, 5000);
+}
+
+// Test that the messages of one event loop turn go out in a single write,
+// and that input takes the messages queued before it along
+void tst_qvncclient::testOutputCoalescing()
+{
+    QTcpServer listener;
+    QVERIFY(listener.listen(QHostAddress::LocalHost));
+
+    QVncClient client;
+    QSignalSpy updateSpy(&client, &QVncClient::framebufferUpdated);
+    QTcpSocket *peer = startSession(&client, &listener, QSize(4, 4));
+    QVERIFY(peer);
+    QByteArray messages;
+    QVERIFY(!nextMessage(peer, &messages, 3).isEmpty());
+
+    // Until the first update, every message goes out at once
+    QImage image(4, 4, QImage::Format_ARGB32);
+    image.fill(Qt::red);
+    peer->write(QByteArray("\x00\x00\x00\x01", 4) + rectangle(image.rect(), 0) + rawPixels(image, image.rect()));
+    QTRY_VERIFY_WITH_TIMEOUT(!updateSpy.isEmpty(), 5000);
+    QVERIFY(!nextMessage(peer, &messages, 3).isEmpty());
+    QVERIFY(messages.isEmpty());
+
+    // Returns the types of the complete messages in data
+    const auto types = [](const QByteArray &data) {
+        QList<quint8> list;
+        for (qsizetype i = 0; i < data.size();) {
+            const quint8 type = quint8(data.at(i));
+            list.append(type);
+            if (type == 2)
+                i += 4 + 4 * qFromBigEndian<quint16>(data.constData() + i + 2);
+            else
+                i += type == 3 ? 10 : 8;
+        }
+        return list;
+    };
+
+    // Settings changes wait for the event loop and then leave together
+    client.setQualityLevel(5);
+    client.setCompressionLevel(3);
+    QVERIFY(!peer->waitForReadyRead(100));
+    QTRY_VERIFY_WITH_TIMEOUT(peer->bytesAvailable() > 0, 5000);
+    QCOMPARE(types(peer->readAll()), QList<quint8>({ 2, 2 }));
+
+    // A key goes out at once, behind what was queued before it
+    client.setQualityLevel(6);
+    QKeyEvent press(QEvent::KeyPress, Qt::Key_A, Qt::NoModifier, QStringLiteral("a"));
+    client.handleKeyEvent(&press);
+    QVERIFY(peer->waitForReadyRead(5000));
+    QCOMPARE(types(peer->readAll()), QList<quint8>({ 2, 4 }));
+}
+
+void tst_qvncclient::testPointerEventRate()
+{
+    QVncClient client;
+    QCOMPARE(client.pointerEventRate(), 120);
+    QSignalSpy rateSpy(&client, &QVncClient::pointerEventRateChanged);
+    client.setPointerEventRate(-1);
+    QCOMPARE(client.pointerEventRate(), 0);
+    QCOMPARE(rateSpy.count(), 1);
+    client.setPointerEventRate(10);
+    QCOMPARE(rateSpy.count(), 2);
+
+    // A server that never starts the handshake sees nothing but input
+    QTcpServer listener;
+    QVERIFY(listener.listen(QHostAddress::LocalHost));
+    QTcpSocket *socket = new QTcpSocket(&client);
+    client.setSocket(socket);
+    socket->connectToHost(QHostAddress::LocalHost, listener.serverPort());
+    QVERIFY(socket->waitForConnected(5000));
+    QVERIFY(listener.waitForNewConnection(5000));
+    QTcpSocket *peer = listener.nextPendingConnection();
+    QVERIFY(peer);
+
+    const auto move = [&](QEvent::Type type, const QPointF &position, Qt::MouseButtons buttons) {
+        const Qt::MouseButton button = type == QEvent::MouseMove ? Qt::NoButton : Qt::LeftButton;
+        QMouseEvent event(type, position, position, button, buttons, Qt::NoModifier);
+        client.handlePointerEvent(&event);
+    };
+
+    // A burst of motion within one interval is sent as its first and last
+    // position
+    for (int i = 0; i < 50; i++)
+        move(QEvent::MouseMove, QPointF(i, i), Qt::NoButton);
+    QTRY_COMPARE_WITH_TIMEOUT(peer->bytesAvailable(), 12, 1000);
+    QByteArray messages = peer->readAll();
+    QCOMPARE(quint8(messages.at(6)), quint8(0x05));
+    QCOMPARE(quint8(messages.at(9)), quint8(49));
+
+    // A press is never held back, however long the interval
+    client.setPointerEventRate(1);
+    move(QEvent::MouseMove, QPointF(60, 60), Qt::NoButton);
+    move(QEvent::MouseButtonPress, QPointF(61, 61), Qt::LeftButton);
+    QTRY_COMPARE_WITH_TIMEOUT(peer->bytesAvailable(), 6, 500);
+    messages = peer->readAll();
+    QCOMPARE(quint8(messages.at(1)), quint8(1));
+    QCOMPARE(quint8(messages.at(3)), quint8(61));
+}
+
+void tst_qvncclient::testLocalCursor()
+{
+    QVncClient client;
+    QVERIFY(!client.localCursor());
+    QVERIFY(client.cursorShape().isNull());
+    QSignalSpy localCursorSpy(&client, &QVncClient::localCursorChanged);
+    client.setLocalCursor(true);
+    QVERIFY(client.localCursor());
+    QCOMPARE(localCursorSpy.count(), 1);
+
+    if (!server)
+        QSKIP("No VNC server available");
+
+    QSignalSpy shapeSpy(&client, &QVncClient::cursorShapeChanged);
+    QSignalSpy updateSpy(&client, &QVncClient::framebufferUpdated);
+    QTcpSocket *socket = new QTcpSocket(&client);
+    client.setSocket(socket);
+    socket->connectToHost("localhost", vncPort);
+    QVERIFY2(socket->waitForConnected(5000),
+            qPrintable(QString("Failed to connect to VNC server: %1").arg(socket->errorString())));
+    QTRY_VERIFY_WITH_TIMEOUT(updateSpy.count() > 0, 10000);
+
+    // Servers that know the pseudo-encoding send the shape with the first update
+    if (shapeSpy.isEmpty())
+        QSKIP("Server does not support the Cursor pseudo-encoding");
+    const QImage shape = client.cursorShape();
+    QVERIFY(shape.isNull() || shape.rect().contains(client.cursorHotSpot()));
+}
+
+void tst_qvncclient::testTypeText()
+{
+    // A server that never starts the handshake sees nothing but input
+    QVncClient client;
+    QTcpServer listener;
+    QVERIFY(listener.listen(QHostAddress::LocalHost));
+    QTcpSocket *socket = new QTcpSocket(&client);
+    client.setSocket(socket);
+    socket->connectToHost(QHostAddress::LocalHost, listener.serverPort());
+    QVERIFY(socket->waitForConnected(5000));
+    QVERIFY(listener.waitForNewConnection(5000));
+    QTcpSocket *peer = listener.nextPendingConnection();
+    QVERIFY(peer);
+
+    // Without Fence the text is paced by time, a press and a release each
+    QSignalSpy typedSpy(&client, &QVncClient::textTyped);
+    QString text = QStringLiteral("ab\r\n");
+    text += QString(300, QLatin1Char('x'));
+    client.typeText(text);
+    QTRY_COMPARE_WITH_TIMEOUT(typedSpy.count(), 1, 5000);
+    QTRY_COMPARE_WITH_TIMEOUT(peer->bytesAvailable(), qint64(303 * 2 * 8), 1000);
+
+    const QByteArray messages = peer->readAll();
+    QCOMPARE(quint8(messages.at(0)), quint8(0x04));
+    QCOMPARE(quint8(messages.at(1)), quint8(1));
+    QCOMPARE(quint8(messages.at(7)), quint8('a'));
+    QCOMPARE(quint8(messages.at(9)), quint8(0));
+    // The line break is a single Return
+    QCOMPARE(qFromBigEndian<quint32>(messages.constData() + 32 + 4), quint32(0xff0d));
+    QCOMPARE(quint8(messages.at(48 + 7)), quint8('x'));
+
+    // Text with nothing to type is done right away
+    client.typeText(QString());
+    QCOMPARE(typedSpy.count(), 2);
+    client.typeText(QStringLiteral("\a"));
+    QCOMPARE(typedSpy.count(), 3);
+    QVERIFY(!peer->waitForReadyRead(100));
+}
+
+// Test that a server answering Fences is kept a bounded number of bytes of
+// typed keys ahead, and that its answers release the rest
+void tst_qvncclient::testTypeTextWindow()
+{
+    QTcpServer listener;
+    QVERIFY(listener.listen(QHostAddress::LocalHost));
+
+    QVncClient client;
+    QTcpSocket *peer = startSession(&client, &listener, QSize(4, 4));
+    QVERIFY(peer);
+    QByteArray messages;
+    QVERIFY(!nextMessage(peer, &messages, 3).isEmpty());
+
+    // A Fence request tells the client the server supports them
+    peer->write(QByteArray("\xf8\x00\x00\x00\x80\x00\x00\x00\x00", 9));
+    QVERIFY(!nextMessage(peer, &messages, 248).isEmpty());
+
+    // Counts the key events and typing Fences the client sent
+    int keys = 0;
+    int fences = 0;
+    const auto receive = [&]() {
+        messages += peer->readAll();
+        while (!messages.isEmpty()) {
+            const quint8 type = quint8(messages.at(0));
+            const qsizetype size = type == 248 && messages.size() >= 9 ? 9 + quint8(messages.at(8)) : 8;
+            if (messages.size() < size)
+                break;
+            if (type == 4)
+                keys++;
+            else if (type == 248 && messages.mid(9, size - 9) == "typing")
+                fences++;
+            messages.remove(0, size);
+        }
+    };
+    const QByteArray answer = QByteArray("\xf8\x00\x00\x00\x00\x00\x00\x00\x06", 9) + "typing";
+
+    // 4000 characters are 64000 bytes of key events, of which four chunks
+    // of 512 characters fill the window
+    QSignalSpy typedSpy(&client, &QVncClient::textTyped);
+    client.typeText(QString(4000, QLatin1Char('x')));
+    QTest::qWait(200);
+    receive();
+    QCOMPARE(fences, 4);
+    QCOMPARE(keys, 4 * 512 * 2);
+
+    // Each answer lets another chunk go
+    peer->write(answer);
+    QTest::qWait(200);
+    receive();
+    QCOMPARE(fences, 5);
+    QCOMPARE(keys, 5 * 512 * 2);
+    QCOMPARE(typedSpy.count(), 0);
+
+    int answered = 1;
+    QTRY_VERIFY_WITH_TIMEOUT([&]() {
+        receive();
+        for (; answered < fences; answered++)
+            peer->write(answer);
+        return typedSpy.count() == 1;
+    }(), 5000);
+    QCOMPARE(fences, 8);
+    QCOMPARE(keys, 4000 * 2);
+}
+
+void tst_qvncclient::testKeyEvents()
+{
+    QVncClient client;
+    QTcpServer listener;
+    QVERIFY(listener.listen(QHostAddress::LocalHost));
+    QTcpSocket *socket = new QTcpSocket(&client);
+    client.setSocket(socket);
+    socket->connectToHost(QHostAddress::LocalHost, listener.serverPort());
+    QVERIFY(socket->waitForConnected(5000));
+    QVERIFY(listener.waitForNewConnection(5000));
+    QTcpSocket *peer = listener.nextPendingConnection();
+    QVERIFY(peer);
+
+    const auto press = [&client](QEvent::Type type, int key, Qt::KeyboardModifiers modifiers,
+                                 const QString &text = QString()) {
+        QKeyEvent event(type, key, modifiers, text);
+        client.handleKeyEvent(&event);
+    };
+    QByteArray messages;
+    const auto expectKey = [this, peer, &messages](bool down, quint32 keysym) {
+        const QByteArray message = nextMessage(peer, &messages, 4);
+        return message.size() == 8 && quint8(message.at(1)) == quint8(down ? 1 : 0)
+                && qFromBigEndian<quint32>(message.constData() + 4) == keysym;
+    };
+
+    // Modifiers pressed on their own carry no text but still have keysyms
+    press(QEvent::KeyPress, Qt::Key_Shift, Qt::ShiftModifier);
+    QVERIFY(expectKey(true, 0xffe1));
+    press(QEvent::KeyRelease, Qt::Key_Shift, Qt::NoModifier);
+    QVERIFY(expectKey(false, 0xffe1));
+    press(QEvent::KeyPress, Qt::Key_Control, Qt::ControlModifier);
+    QVERIFY(expectKey(true, 0xffe3));
+    press(QEvent::KeyRelease, Qt::Key_Control, Qt::NoModifier);
+    QVERIFY(expectKey(false, 0xffe3));
+
+    // A dead key is sent as such, the server composes it
+    press(QEvent::KeyPress, Qt::Key_Dead_Acute, Qt::NoModifier);
+    QVERIFY(expectKey(true, 0xfe51));
+    press(QEvent::KeyRelease, Qt::Key_Dead_Acute, Qt::NoModifier);
+    QVERIFY(expectKey(false, 0xfe51));
+
+    // Shift let go before the letter: the release repeats the press
+    press(QEvent::KeyPress, Qt::Key_Shift, Qt::ShiftModifier);
+    QVERIFY(expectKey(true, 0xffe1));
+    press(QEvent::KeyPress, Qt::Key_A, Qt::ShiftModifier, QStringLiteral("A"));
+    QVERIFY(expectKey(true, 'A'));
+    press(QEvent::KeyRelease, Qt::Key_Shift, Qt::NoModifier);
+    QVERIFY(expectKey(false, 0xffe1));
+    press(QEvent::KeyRelease, Qt::Key_A, Qt::NoModifier, QStringLiteral("a"));
+    QVERIFY(expectKey(false, 'A'));
+}
+
+void tst_qvncclient::testQemuKeyEvents()
+{
+#if defined(Q_OS_WIN)
+    const quint32 scanCode = 0x1e; // Set 1 make code of A
+#elif defined(Q_OS_UNIX) && !defined(Q_OS_DARWIN)
+    const quint32 scanCode = 38;   // X11 key code of A, input event code 30
+#else
+    const quint32 scanCode = 0;
+#endif
+    if (!scanCode)
+        QSKIP("Scan codes are not translated on this platform");
+    QTcpServer listener;
+    QVERIFY(listener.listen(QHostAddress::LocalHost));
+
+    QVncClient client;
+    QTcpSocket *peer = startSession(&client, &listener, QSize(4, 4));
+    QVERIFY(peer);
+    QByteArray messages;
+    const QByteArray setEncodings = nextMessage(peer, &messages, 2);
+    QVERIFY(announces(setEncodings, -258));
+    QVERIFY(!nextMessage(peer, &messages, 3).isEmpty());
+
+    // Until the server acknowledges the extension keys go out as keysyms
+    QKeyEvent before(QEvent::KeyPress, Qt::Key_A, Qt::NoModifier, scanCode, 0, 0, QStringLiteral("a"));
+    client.handleKeyEvent(&before);
+    QByteArray message = nextMessage(peer, &messages, 4);
+    QCOMPARE(message.size(), 8);
+    QCOMPARE(qFromBigEndian<quint32>(message.constData() + 4), quint32('a'));
+    QKeyEvent beforeRelease(QEvent::KeyRelease, Qt::Key_A, Qt::NoModifier, scanCode, 0, 0, QStringLiteral("a"));
+    client.handleKeyEvent(&beforeRelease);
+    QVERIFY(!nextMessage(peer, &messages, 4).isEmpty());
+
+    // The acknowledgement is an empty rectangle of the pseudo-encoding
+    peer->write(QByteArray("\x00\x00\x00\x01", 4) + rectangle(QRect(), -258));
+    QVERIFY(!nextMessage(peer, &messages, 3).isEmpty());
+
+    // Then the scan code travels along with the keysym
+    QKeyEvent after(QEvent::KeyPress, Qt::Key_A, Qt::ShiftModifier, scanCode, 0, 0, QStringLiteral("A"));
+    client.handleKeyEvent(&after);
+    message = nextMessage(peer, &messages, 255);
+    QCOMPARE(message.size(), 12);
+    QCOMPARE(quint8(message.at(1)), quint8(0));
+    QCOMPARE(qFromBigEndian<quint16>(message.constData() + 2), quint16(1));
+    QCOMPARE(qFromBigEndian<quint32>(message.constData() + 4), quint32('A'));
+    QCOMPARE(qFromBigEndian<quint32>(message.constData() + 8), quint32(0x1e));
+    QKeyEvent afterRelease(QEvent::KeyRelease, Qt::Key_A, Qt::NoModifier, scanCode, 0, 0, QStringLiteral("a"));
+    client.handleKeyEvent(&afterRelease);
+    message = nextMessage(peer, &messages, 255);
+    QCOMPARE(message.size(), 12);
+    QCOMPARE(qFromBigEndian<quint16>(message.constData() + 2), quint16(0));
+    QCOMPARE(qFromBigEndian<quint32>(message.constData() + 4), quint32('A'));
+    QCOMPARE(qFromBigEndian<quint32>(message.constData() + 8), quint32(0x1e));
+}
+
+void tst_qvncclient::testLocalSocket()
+{
+    QLocalServer listener;
+    QVERIFY(listener.listen(QStringLiteral("tst_qvncclient-%1").arg(QCoreApplication::applicationPid())));
+
+    QVncClient client;
+    QSignalSpy stateSpy(&client, &QVncClient::connectionStateChanged);
+    QLocalSocket *socket = new QLocalSocket(&client);
+    client.setDevice(socket);
+    QCOMPARE(client.device(), socket);
+    QCOMPARE(client.socket(), nullptr);
+    QVERIFY(!client.isConnected());
+
+    socket->connectToServer(listener.fullServerName());
+    QVERIFY(socket->waitForConnected(5000));
+    QVERIFY(listener.waitForNewConnection(5000));
+    QLocalSocket *peer = listener.nextPendingConnection();
+    QVERIFY(peer);
+    QTRY_VERIFY_WITH_TIMEOUT(client.isConnected(), 1000);
+    QCOMPARE(stateSpy.count(), 1);
+
+    // The handshake runs over the local socket like over TCP
+    peer->write("RFB 003.003\n");
+    QTRY_COMPARE_WITH_TIMEOUT(peer->bytesAvailable(), qint64(12), 5000);
+    QCOMPARE(peer->readAll(), QByteArray("RFB 003.003\n"));
+    QTRY_COMPARE_WITH_TIMEOUT(client.protocolVersion(), QVncClient::ProtocolVersion33, 1000);
+
+    peer->disconnectFromServer();
+    QTRY_VERIFY_WITH_TIMEOUT(!client.isConnected(), 5000);
+    QCOMPARE(stateSpy.count(), 2);
+}
+
+void tst_qvncclient::testSocketDescriptor_data()
+{
+    QTest::addColumn<bool>("threaded");
+    QTest::addColumn<bool>("uring");
+    QTest::newRow("unthreaded") << false << false;
+    QTest::newRow("threaded") << true << false;
+    QTest::newRow("unthreaded io_uring") << false << true;
+    QTest::newRow("threaded io_uring") << true << true;
+}
+
+void tst_qvncclient::testSocketDescriptor()
+{
+#ifdef Q_OS_LINUX
+    QFETCH(bool, threaded);
+    QFETCH(bool, uring);
+#ifdef USE_IO_URING
+    if (uring && !QVncUringTransport::instance())
+        QSKIP("io_uring needs Linux 6.0");
+#else
+    if (uring)
+        QSKIP("Built without io_uring");
+#endif
+    // The transport is picked when the descriptor is set
+    if (!uring)
+        qputenv("QT_VNCCLIENT_NO_IO_URING", "1");
+    const auto restore = qScopeGuard([]() { qunsetenv("QT_VNCCLIENT_NO_IO_URING"); });
+    int sockets[2];
+    QCOMPARE(::socketpair(AF_UNIX, SOCK_STREAM, 0, sockets), 0);
+    const int peer = sockets[1];
+
+    QVncClient client;
+    client.setThreaded(threaded);
+    QSignalSpy stateSpy(&client, &QVncClient::connectionStateChanged);
+    QVERIFY(client.setSocketDescriptor(sockets[0]));
+    QVERIFY(client.isConnected());
+    QCOMPARE(client.device(), nullptr);
+    QCOMPARE(stateSpy.count(), 1);
+
+    // The handshake runs over the native socket. Each write ends within a
+    // message, which the client has to keep until the rest arrives.
+    const auto send = [peer](const QByteArray &data) {
+        QCOMPARE(::write(peer, data.constData(), data.size()), ssize_t(data.size()));
+        QTest::qWait(50);
+    };
+    const QByteArray version("RFB 003.003\n");
+    send(version.left(5));
+    send(version.mid(5) + QByteArray("\x00\x00", 2));
+    QTRY_COMPARE_WITH_TIMEOUT(client.protocolVersion(), QVncClient::ProtocolVersion33, 5000);
+    send(QByteArray("\x00\x01" "\x00\x04\x00\x04\x20\x18", 8));
+    send(QByteArray("\x00\x01\x00\xff\x00\xff\x00\xff\x10\x08\x00\x00\x00\x00"
+                    "\x00\x00\x00\x04" "de", 22));
+    send("sk");
+    QTRY_COMPARE_WITH_TIMEOUT(client.framebufferWidth(), 4, 5000);
+    QCOMPARE(client.framebufferHeight(), 4);
+
+    // The replies may only be written once the event loop runs
+    QByteArray reply;
+    QTRY_VERIFY_WITH_TIMEOUT([&]() {
+        char buffer[13];
+        const ssize_t size = ::recv(peer, buffer, sizeof(buffer) - reply.size(), MSG_DONTWAIT);
+        if (size > 0)
+            reply.append(buffer, size);
+        return reply.size() == version.size() + 1;
+    }(), 5000);
+    QCOMPARE(reply.left(version.size()), version);
+
+    ::close(peer);
+    QTRY_VERIFY_WITH_TIMEOUT(!client.isConnected(), 5000);
+    QCOMPARE(stateSpy.count(), 2);
+#else
+    QSKIP("The native transport needs epoll");
+#endif
+}
+
+void tst_qvncclient::testWebSocket_data()
+{
+    QTest::addColumn<QByteArray>("close");
+    QTest::newRow("status") << QByteArray("\x88\x02\x03\xe8", 4);
+    QTest::newRow("empty") << QByteArray("\x88\x00", 2);
+}
+
+void tst_qvncclient::testWebSocket()
+{
+    QFETCH(QByteArray, close);
+    // Stands in for websockify
+    QTcpServer listener;
+    QVERIFY(listener.listen(QHostAddress::LocalHost));
+
+    QVncClient client;
+    const QUrl url(QStringLiteral("ws://localhost:%1/websockify?token=abc").arg(listener.serverPort()));
+    QSignalSpy urlSpy(&client, &QVncClient::webSocketUrlChanged);
+    client.setWebSocketUrl(url);
+    QCOMPARE(client.webSocketUrl(), url);
+    QCOMPARE(urlSpy.count(), 1);
+
+    QTcpSocket *socket = new QTcpSocket(&client);
+    client.setDevice(socket);
+    socket->connectToHost(QHostAddress::LocalHost, listener.serverPort());
+    QVERIFY(listener.waitForNewConnection(5000));
+    QTcpSocket *peer = listener.nextPendingConnection();
+    QVERIFY(peer);
+
+    QByteArray request;
+    QTRY_VERIFY_WITH_TIMEOUT((request += peer->readAll()).contains("\r\n\r\n"), 5000);
+    QVERIFY(request.startsWith("GET /websockify?token=abc HTTP/1.1\r\n"));
+    QVERIFY(request.contains("Sec-WebSocket-Protocol: binary\r\n"));
+    QByteArray key;
+    for (const QByteArray &line : request.split('\n')) {
+        if (line.startsWith("Sec-WebSocket-Key:"))
+            key = line.mid(18).trimmed();
+    }
+    QVERIFY(!key.isEmpty());
+    const QByteArray accept = QCryptographicHash::hash(key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11",
+                                                       QCryptographicHash::Sha1).toBase64();
+
+    // The session waits for the upgrade to complete
+    QTest::qWait(50);
+    QCOMPARE(client.protocolVersion(), QVncClient::ProtocolVersionUnknown);
+
+    // The version arrives split over a fragmented message with a ping in
+    // between, in the same segment as the response
+    QByteArray response("HTTP/1.1 101 Switching Protocols\r\n"
+                        "Upgrade: websocket\r\nConnection: Upgrade\r\n"
+                        "Sec-WebSocket-Accept: " + accept + "\r\n"
+                        "Sec-WebSocket-Protocol: binary\r\n\r\n");
+    response += QByteArray("\x02\x07RFB 003", 9);
+    response += QByteArray("\x89\x02hi", 4);
+    response += QByteArray("\x80\x05.003\n", 7);
+    peer->write(response);
+    QTRY_COMPARE_WITH_TIMEOUT(client.protocolVersion(), QVncClient::ProtocolVersion33, 5000);
+
+    // Frames from the client are masked
+    QByteArray frames;
+    QList<QPair<quint8, QByteArray>> received;
+    const auto receive = [&]() {
+        frames += peer->readAll();
+        while (frames.size() >= 6) {
+            const quint8 opcode = quint8(frames.at(0)) & 0x0f;
+            const int size = quint8(frames.at(1)) & 0x7f;
+            if (!(quint8(frames.at(1)) & 0x80) || size > 125 || frames.size() < 6 + size)
+                break;
+            QByteArray payload = frames.mid(6, size);
+            for (int i = 0; i < size; i++)
+                payload[i] = char(payload.at(i) ^ frames.at(2 + (i & 3)));
+            received.append({ opcode, payload });
+            frames.remove(0, 6 + size);
+        }
+    };
+    const auto payloads = [&](quint8 opcode) {
+        QByteArrayList list;
+        for (const auto &frame : std::as_const(received)) {
+            if (frame.first == opcode)
+                list.append(frame.second);
+        }
+        return list;
+    };
+    QTRY_VERIFY_WITH_TIMEOUT((receive(), payloads(0x2).join().size() >= 12 && payloads(0xa).size() == 1), 5000);
+    QCOMPARE(payloads(0x2).join(), QByteArray("RFB 003.003\n"));
+    QCOMPARE(payloads(0xa), QByteArrayList{ "hi" });
+
+    // An empty ping at the end of a segment is answered all the same
+    peer->write(QByteArray("\x89\x00", 2));
+    QTRY_VERIFY_WITH_TIMEOUT((receive(), payloads(0xa).size() == 2), 5000);
+    QCOMPARE(payloads(0xa).last(), QByteArray());
+
+    // A close frame is echoed and ends the connection
+    peer->write(close);
+    QTRY_VERIFY_WITH_TIMEOUT(!client.isConnected(), 5000);
+    QTRY_VERIFY_WITH_TIMEOUT((receive(), payloads(0x8).size() == 1), 5000);
+    QCOMPARE(payloads(0x8).first(), close.mid(2));
+}
+
+void tst_qvncclient::testVeNCrypt_data()
+{
+    QTest::addColumn<QVncClient::SecurityType>("securityType");
+    QTest::newRow("VeNCrypt") << QVncClient::SecurityTypeVeNCrypt;
+    QTest::newRow("TLS") << QVncClient::SecurityTypeTLS;
+}
+
+void tst_qvncclient::testVeNCrypt()
+{
+    QFETCH(QVncClient::SecurityType, securityType);
+    QTcpServer listener;
+    QVERIFY(listener.listen(QHostAddress::LocalHost));
+
+    QVncClient client;
+#if QT_CONFIG(ssl)
+    QTcpSocket *socket = new QSslSocket(&client);
+#else
+    QTcpSocket *socket = new QTcpSocket(&client);
+#endif
+    client.setDevice(socket);
+    socket->connectToHost(QHostAddress::LocalHost, listener.serverPort());
+    QVERIFY(listener.waitForNewConnection(5000));
+    QTcpSocket *peer = listener.nextPendingConnection();
+    QVERIFY(peer);
+    QTRY_VERIFY_WITH_TIMEOUT(client.isConnected(), 5000);
+    QSignalSpy securitySpy(&client, &QVncClient::securityTypeChanged);
+
+    const auto reply = [peer](qsizetype size) {
+        QByteArray data;
+        QElapsedTimer timer;
+        timer.start();
+        // The client answers from the event loop of this thread
+        while (data.size() < size && timer.elapsed() < 5000) {
+            QTest::qWait(10);
+            data += peer->read(size - data.size());
+        }
+        return data;
+    };
+
+    peer->write("RFB 003.008\n");
+    QCOMPARE(reply(12), QByteArray("RFB 003.008\n"));
+    QTRY_COMPARE_WITH_TIMEOUT(client.protocolVersion(), QVncClient::ProtocolVersion38, 5000);
+
+    // VeNCrypt and anonymous TLS are chosen over types that need a password
+    QByteArray types("\x02\x02", 2);
+    types += char(securityType);
+    peer->write(types);
+    QCOMPARE(reply(1), QByteArray(1, char(securityType)));
+    // Without SSL support the client gives up on TLS right away
+    QTRY_VERIFY_WITH_TIMEOUT(!securitySpy.isEmpty(), 5000);
+    QCOMPARE(securitySpy.first().first().value<QVncClient::SecurityType>(), securityType);
+
+    if (securityType == QVncClient::SecurityTypeVeNCrypt) {
+        peer->write(QByteArray("\x00\x02", 2));
+        QCOMPARE(reply(2), QByteArray("\x00\x02", 2));
+
+        // X509None is preferred over anonymous TLS and Plain is skipped
+        peer->write(QByteArray("\x00\x03\x00\x00\x01\x00\x00\x00\x01\x01\x00\x00\x01\x04", 14));
+        QCOMPARE(reply(4), QByteArray("\x00\x00\x01\x04", 4));
+
+        peer->write(QByteArray("\x01", 1));
+    }
+#if QT_CONFIG(ssl)
+    // What follows is the TLS handshake, starting with a handshake record
+    QCOMPARE(reply(1), QByteArray("\x16", 1));
+#else
+    QTRY_VERIFY_WITH_TIMEOUT(!client.isConnected(), 5000);
+#endif
+}
+
+void tst_qvncclient::testSessionResume()
+{
+    QTcpServer listener;
+    QVERIFY(listener.listen(QHostAddress::LocalHost));
+
+    QVncClient client;
+    QVERIFY(!client.sessionResume());
+    QSignalSpy resumeSpy(&client, &QVncClient::sessionResumeChanged);
+    client.setSessionResume(true);
+    QVERIFY(client.sessionResume());
+    QCOMPARE(resumeSpy.count(), 1);
+    QSignalSpy staleSpy(&client, &QVncClient::framebufferStaleChanged);
+    QSignalSpy sizeSpy(&client, &QVncClient::framebufferSizeChanged);
+    QTcpSocket *socket = new QTcpSocket(&client);
+    client.setSocket(socket);
+
+    struct Requests
+    {
+        QList<qint32> encodings;
+        bool incremental = true;
+    };
+    // Plays a 4x2 RGB888 server named "desk" up to the first request
+    const auto connectToServer = [&]() {
+        socket->connectToHost(QHostAddress::LocalHost, listener.serverPort());
+        if (!listener.waitForNewConnection(5000))
+            return static_cast<QTcpSocket *>(nullptr);
+        QTcpSocket *peer = listener.nextPendingConnection();
+        peer->write("RFB 003.003\n");
+        peer->write(QByteArray("\x00\x00\x00\x01", 4));
+        QByteArray init;
+        init += QByteArray("\x00\x04\x00\x02", 4);
+        init += QByteArray("\x20\x18\x00\x01\x00\xff\x00\xff\x00\xff\x10\x08\x00\x00\x00\x00", 16);
+        init += QByteArray("\x00\x00\x00\x04" "desk", 8);
+        peer->write(init);
+        return peer;
+    };
+    // Reads the client's messages after ServerInit up to its update request
+    const auto readRequests = [](QTcpSocket *peer, qsizetype skip) {
+        Requests requests;
+        QByteArray data;
+        QElapsedTimer timer;
+        timer.start();
+        while (timer.elapsed() < 5000) {
+            QTest::qWait(10);
+            data += peer->readAll();
+            qsizetype pos = skip;
+            while (pos < data.size()) {
+                const quint8 type = quint8(data.at(pos));
+                if (type == 0) {
+                    pos += 20;
+                } else if (type == 2 && pos + 4 <= data.size()) {
+                    const int count = qFromBigEndian<quint16>(data.constData() + pos + 2);
+                    if (pos + 4 + count * 4 > data.size())
+                        break;
+                    requests.encodings.clear();
+                    for (int i = 0; i < count; i++)
+                        requests.encodings.append(qFromBigEndian<qint32>(data.constData() + pos + 4 + i * 4));
+                    pos += 4 + count * 4;
+                } else if (type == 3 && pos + 10 <= data.size()) {
+                    requests.incremental = data.at(pos + 1);
+                    return requests;
+                } else {
+                    break;
+                }
+            }
+        }
+        return requests;
+    };
+    // A raw update filling the framebuffer with one colour
+    const auto fill = [](QTcpSocket *peer, QRgb color) {
+        QByteArray update("\x00\x00\x00\x01\x00\x00\x00\x00\x00\x04\x00\x02\x00\x00\x00\x00", 16);
+        for (int i = 0; i < 8; i++) {
+            update += char(qBlue(color));
+            update += char(qGreen(color));
+            update += char(qRed(color));
+            update += char(0);
+        }
+        peer->write(update);
+    };
+
+    // The version reply and ClientInit precede the requests
+    QTcpSocket *peer = connectToServer();
+    QVERIFY(peer);
+    Requests requests = readRequests(peer, 13);
+    QVERIFY(!requests.incremental);
+    QVERIFY(!requests.encodings.contains(-32 + 1));
+    fill(peer, qRgb(255, 0, 0));
+    QTRY_COMPARE_WITH_TIMEOUT(qRed(client.image().pixel(0, 0)), 255, 5000);
+    QCOMPARE(sizeSpy.count(), 1);
+
+    // The frame outlives the connection
+    peer->disconnectFromHost();
+    QTRY_VERIFY_WITH_TIMEOUT(!client.isConnected(), 5000);
+    QVERIFY(client.isFramebufferStale());
+    QCOMPARE(staleSpy.count(), 1);
+    QCOMPARE(client.framebufferWidth(), 4);
+    QCOMPARE(qRed(client.image().pixel(0, 0)), 255);
+
+    // The same desktop resumes on it with a coarse JPEG refresh first
+    peer = connectToServer();
+    QVERIFY(peer);
+    requests = readRequests(peer, 13);
+    QVERIFY(!requests.incremental);
+    QVERIFY(requests.encodings.contains(-32 + 1));
+    QCOMPARE(qRed(client.image().pixel(0, 0)), 255);
+    QCOMPARE(sizeSpy.count(), 1);
+    QVERIFY(client.isFramebufferStale());
+
+    // Without JPEG in it, the refresh is lossless already and the session
+    // goes back to its own encodings
+    fill(peer, qRgb(0, 0, 255));
+    QTRY_VERIFY_WITH_TIMEOUT(!client.isFramebufferStale(), 5000);
+    QCOMPARE(qBlue(client.image().pixel(0, 0)), 255);
+    requests = readRequests(peer, 0);
+    QVERIFY(requests.incremental);
+    QVERIFY(!requests.encodings.contains(-32 + 1));
+
+    // Turning resuming off drops a stale frame
+    peer->disconnectFromHost();
+    QTRY_VERIFY_WITH_TIMEOUT(client.isFramebufferStale(), 5000);
+    client.setSessionResume(false);
+    QVERIFY(!client.isFramebufferStale());
+    QCOMPARE(client.framebufferWidth(), 0);
+}
+
+void tst_qvncclient::testHandshakePipelining()
+{
+    QTcpServer listener;
+    QVERIFY(listener.listen(QHostAddress::LocalHost));
+
+    QVncClient client;
+    QSignalSpy phaseSpy(&client, &QVncClient::handshakePhaseReached);
+    QCOMPARE(client.handshakeTime(QVncClient::ServerInitPhase), qreal(-1));
+    QTcpSocket *socket = new QTcpSocket(&client);
+    client.setSocket(socket);
+    socket->connectToHost(QHostAddress::LocalHost, listener.serverPort());
+    QVERIFY(listener.waitForNewConnection(5000));
+    QTcpSocket *peer = listener.nextPendingConnection();
+    QVERIFY(peer);
+
+    QByteArray sent;
+    const auto waitFor = [&](qsizetype size) {
+        QElapsedTimer timer;
+        timer.start();
+        while (sent.size() < size && timer.elapsed() < 5000) {
+            QTest::qWait(10);
+            sent += peer->readAll();
+        }
+        return sent.size() >= size;
+    };
+
+    peer->write("RFB 003.008\n");
+    QVERIFY(waitFor(12));
+    peer->write(QByteArray("\x01\x01", 2));
+    // ClientInit follows the security type without waiting for the result
+    QVERIFY(waitFor(14));
+    QCOMPARE(sent.mid(12, 2), QByteArray("\x01\x01", 2));
+    QCOMPARE(client.handshakeTime(QVncClient::SecurityResultPhase), qreal(-1));
+
+    QByteArray init("\x00\x00\x00\x00", 4);
+    init += QByteArray("\x00\x04\x00\x02", 4);
+    init += QByteArray("\x20\x18\x00\x01\x00\xff\x00\xff\x00\xff\x10\x08\x00\x00\x00\x00", 16);
+    init += QByteArray("\x00\x00\x00\x04" "desk", 8);
+    peer->write(init);
+    // SetPixelFormat and SetEncodings come with the update request
+    QVERIFY(waitFor(14 + 20 + 4));
+    const int encodings = qFromBigEndian<quint16>(sent.constData() + 14 + 20 + 2);
+    const qsizetype request = 14 + 20 + 4 + encodings * 4;
+    QVERIFY(waitFor(request + 10));
+    QCOMPARE(quint8(sent.at(14)), quint8(0));
+    QCOMPARE(quint8(sent.at(14 + 20)), quint8(2));
+    QCOMPARE(quint8(sent.at(request)), quint8(3));
+
+    peer->write(QByteArray("\x00\x00\x00\x01\x00\x00\x00\x00\x00\x04\x00\x02\x00\x00\x00\x00", 16)
+                + QByteArray(4 * 2 * 4, '\xff'));
+    QTRY_VERIFY_WITH_TIMEOUT(client.handshakeTime(QVncClient::FirstUpdatePhase) >= 0, 5000);
+
+    // The phases without WebSocket and TLS, in order
+    const QList<QVncClient::HandshakePhase> phases {
+        QVncClient::ProtocolVersionPhase,
+        QVncClient::SecurityPhase,
+        QVncClient::SecurityResultPhase,
+        QVncClient::ServerInitPhase,
+        QVncClient::FirstUpdatePhase,
+    };
+    QCOMPARE(phaseSpy.count(), phases.size());
+    qreal previous = 0;
+    for (int i = 0; i < phases.size(); i++) {
+        QCOMPARE(phaseSpy.at(i).at(0).value<QVncClient::HandshakePhase>(), phases.at(i));
+        const qreal time = client.handshakeTime(phases.at(i));
+        QCOMPARE(phaseSpy.at(i).at(1).toReal(), time);
+        QVERIFY(time >= previous);
+        previous = time;
+    }
+    QCOMPARE(client.handshakeTime(QVncClient::WebSocketUpgradePhase), qreal(-1));
+    QCOMPARE(client.handshakeTime(QVncClient::TlsPhase), qreal(-1));
+}
+
 QTEST_MAIN(tst_qvncclient)
 #include "tst_qvncclient.moc"
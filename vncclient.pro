@@ -8,6 +8,7 @@ INCLUDEPATH += src/vncclient
 HEADERS += \
     src/vncclient/qtvncclientglobal.h \
 	src/vncclient/qvncclient.h \
+	src/vncclient/qvncdecodescheduler_p.h \
 	examples/vncclient/mainwindow.h \
 	examples/vncclient/spinbox.h \
 	examples/vncclient/vncwidget.h
@@ -15,6 +16,7 @@ HEADERS += \
 SOURCES += \
     src/vncclient/qtvncclientlogging.cpp \
 	src/vncclient/qvncclient.cpp \
+	src/vncclient/qvncdecodescheduler.cpp \
 	examples/vncclient/main.cpp \
 	examples/vncclient/mainwindow.cpp \
 	examples/vncclient/spinbox.cpp \